@@ -25,6 +25,8 @@ if [[ ${UNAME_S} == "Darwin" ]]; then
 else # Linux
     TIMEOUT=90
 fi
+# Slower builds, such as JIT lockstep testing, set BOOT_TIMEOUT
+TIMEOUT=${BOOT_TIMEOUT:-${TIMEOUT}}
 
 ASSERT expect <<DONE
 set timeout ${TIMEOUT}
@@ -6,10 +6,14 @@
 /* ACLINT MTIMER */
 void aclint_mtimer_update_interrupts(hart_t *hart, mtimer_state_t *mtimer)
 {
-    if (semu_timer_get(&mtimer->mtime) >= mtimer->mtimecmp[hart->mhartid])
-        hart->sip |= RV_INT_STI_BIT; /* Set Supervisor Timer Interrupt */
-    else
-        hart->sip &= ~RV_INT_STI_BIT; /* Clear Supervisor Timer Interrupt */
+    /* Set or clear Supervisor Timer Interrupt */
+    bool pending =
+        semu_timer_get(&mtimer->mtime) >= mtimer->mtimecmp[hart->mhartid];
+    vm_set_pending(hart, RV_INT_STI_BIT, pending);
+    __atomic_store_n(&mtimer->next_check[hart->mhartid],
+                     pending ? UINT64_MAX
+                             : hart->instret + MTIMER_CHECK_INTERVAL,
+                     __ATOMIC_RELAXED);
 }
 
 static bool aclint_mtimer_reg_read(mtimer_state_t *mtimer,
@@ -99,17 +103,25 @@ void aclint_mtimer_write(hart_t *hart,
                          uint8_t width,
                          uint32_t value)
 {
-    if (!aclint_mtimer_reg_write(mtimer, addr, value << (RV_MEM_SW - width)))
+    if (!aclint_mtimer_reg_write(mtimer, addr, value << (RV_MEM_SW - width))) {
         vm_set_exception(hart, RV_EXC_STORE_FAULT, hart->exc_val);
+        return;
+    }
+
+    /* A new MTIMECMP affects its hart, a new MTIME all of them */
+    if (addr < 0x7FF8) {
+        aclint_mtimer_rearm(mtimer, addr >> 3);
+        return;
+    }
+    for (uint32_t i = 0; i < hart->vm->n_hart; i++)
+        aclint_mtimer_rearm(mtimer, i);
 }
 
 /* ACLINT MSWI */
 void aclint_mswi_update_interrupts(hart_t *hart, mswi_state_t *mswi)
 {
-    if (mswi->msip[hart->mhartid])
-        hart->sip |= RV_INT_SSI_BIT; /* Set Machine Software Interrupt */
-    else
-        hart->sip &= ~RV_INT_SSI_BIT; /* Clear Machine Software Interrupt */
+    /* Set or clear Machine Software Interrupt */
+    vm_set_pending(hart, RV_INT_SSI_BIT, mswi->msip[hart->mhartid]);
 }
 
 static bool aclint_mswi_reg_read(mswi_state_t *mswi,
@@ -165,10 +177,8 @@ void aclint_mswi_write(hart_t *hart,
 /* ACLINT SSWI */
 void aclint_sswi_update_interrupts(hart_t *hart, sswi_state_t *sswi)
 {
-    if (sswi->ssip[hart->mhartid])
-        hart->sip |= RV_INT_SSI_BIT; /* Set Supervisor Software Interrupt */
-    else
-        hart->sip &= ~RV_INT_SSI_BIT; /* Clear Supervisor Software Interrupt */
+    /* Set or clear Supervisor Software Interrupt */
+    vm_set_pending(hart, RV_INT_SSI_BIT, sswi->ssip[hart->mhartid]);
 }
 
 static bool aclint_sswi_reg_read(__attribute__((unused)) sswi_state_t *sswi,
@@ -14,6 +14,8 @@
 
 #define UNUSED __attribute__((unused))
 
+#define FORCE_INLINE static inline __attribute__((always_inline))
+
 #define MASK(n) (~((~0U << (n))))
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
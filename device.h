@@ -1,8 +1,11 @@
 #pragma once
 
+#include <pthread.h>
+
 #if SEMU_HAS(VIRTIONET)
 #include "netdev.h"
 #endif
+#include "profile.h"
 #include "riscv.h"
 #include "virtio.h"
 
@@ -63,6 +66,8 @@ typedef struct {
     /* I/O handling */
     int in_fd, out_fd;
     bool in_ready;
+    bool exit_on_eof; /**< for clones, see forkserver.h */
+    bool quit;        /**< Ctrl-a x with a thread per hart */
 } u8250_state_t;
 
 void u8250_update_interrupts(u8250_state_t *uart);
@@ -78,6 +83,7 @@ void u8250_write(hart_t *core,
                  uint32_t value);
 void u8250_check_ready(u8250_state_t *uart);
 void capture_keyboard_input();
+void reset_keyboard_input();
 
 /* virtio-net */
 
@@ -85,6 +91,8 @@ void capture_keyboard_input();
 #define IRQ_VNET 2
 #define IRQ_VNET_BIT (1 << IRQ_VNET)
 
+enum { VNET_QUEUE_RX = 0, VNET_QUEUE_TX = 1 };
+
 typedef struct {
     uint32_t QueueNum;
     uint32_t QueueDesc;
@@ -125,8 +133,6 @@ void virtio_net_write(hart_t *core,
                       uint32_t value);
 void virtio_net_refresh_queue(virtio_net_state_t *vnet);
 
-void virtio_net_recv_from_peer(void *peer);
-
 bool virtio_net_init(virtio_net_state_t *vnet, const char *name);
 #endif /* SEMU_HAS(VIRTIONET) */
 
@@ -177,6 +183,7 @@ void virtio_blk_write(hart_t *vm,
                       uint32_t value);
 
 uint32_t *virtio_blk_init(virtio_blk_state_t *vblk, char *disk_file);
+bool virtio_blk_overlay(virtio_blk_state_t *vblk);
 #endif /* SEMU_HAS(VIRTIOBLK) */
 
 /* VirtIO-RNG */
@@ -354,8 +361,31 @@ typedef struct {
      */
     uint64_t *mtimecmp;
     semu_timer_t mtime;
+
+    /* Reading MTIME costs a host clock read, so each hart only compares it
+     * against its MTIMECMP once its instret reaches "next_check". That is
+     * every MTIMER_CHECK_INTERVAL instructions while the interrupt is not
+     * pending, and never while it is, since only a write of MTIMECMP or MTIME
+     * can clear it. Such writes reset "next_check" to 0.
+     */
+    uint64_t *next_check;
 } mtimer_state_t;
 
+#define MTIMER_CHECK_INTERVAL 1024
+
+/* Return true if the hart is due to compare MTIME against its MTIMECMP */
+static inline bool aclint_mtimer_check_due(hart_t *hart, mtimer_state_t *mtimer)
+{
+    return hart->instret >= __atomic_load_n(&mtimer->next_check[hart->mhartid],
+                                            __ATOMIC_RELAXED);
+}
+
+/* Have the hart compare MTIME against its MTIMECMP before it runs again */
+static inline void aclint_mtimer_rearm(mtimer_state_t *mtimer, uint32_t hartid)
+{
+    __atomic_store_n(&mtimer->next_check[hartid], 0, __ATOMIC_RELAXED);
+}
+
 void aclint_mtimer_update_interrupts(hart_t *hart, mtimer_state_t *mtimer);
 void aclint_mtimer_read(hart_t *hart,
                         mtimer_state_t *mtimer,
@@ -504,6 +534,47 @@ typedef struct {
 
     uint32_t peripheral_update_ctr;
 
+    /* The host I/O thread waits for the UART input and the TAP device, and
+     * raises the "ready" flags of the devices once they are. Whoever clears
+     * such a flag writes to "io_wake" (unless "io_kicked" says that it is
+     * pending already), so that the thread watches the fd again. The thread
+     * writes to "io_notify" to wake up an idle emulator.
+     */
+    pthread_t io_thread;
+    int io_wake[2], io_notify[2];
+    bool io_kicked;
+
+    /* Harts that are not stopped, see semu_step(). "preempt" ends the turn of
+     * the running hart early.
+     */
+    hart_t **runnable;
+    uint32_t n_runnable;
+    bool preempt;
+
+    /* Instructions retired by each hart before the boot completed, plus the
+     * steps it spent idle, which drive the emulator time until then.
+     */
+    uint64_t *boot_progress;
+
+#if SEMU_HAS(PROFILER)
+    profile_t profile;
+#endif
+
+#if SEMU_HAS(SMP_THREADS)
+    /* Each hart runs on its own host thread. Devices, SBI calls and the HSM
+     * state of harts are shared, and only accessed with "lock" held. Stopped
+     * harts wait on "hsm_cond" to be started, and harts that sent a remote
+     * fence wait on "rfence_cond" for the targets to carry it out. The
+     * "n_parked" idle harts wait on "wfi_cond" for an interrupt.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t hsm_cond;
+    pthread_cond_t rfence_cond;
+    pthread_cond_t wfi_cond;
+    uint32_t n_parked;
+    int exit_code;
+#endif
+
     /* The fields used for debug mode */
     bool is_interrupted;
     int curr_cpuid;
@@ -32,5 +32,35 @@
 #define SEMU_FEATURE_VIRTIOINPUT 1
 #endif
 
+/* Threaded interpreter dispatch (computed goto) */
+#ifndef SEMU_FEATURE_THREADED_DISPATCH
+#define SEMU_FEATURE_THREADED_DISPATCH 1
+#endif
+
+/* JIT compilation of hot blocks into x86-64 code */
+#ifndef SEMU_FEATURE_JIT
+#define SEMU_FEATURE_JIT 0
+#endif
+
+/* Check every JIT-compiled block against the interpreter */
+#ifndef SEMU_FEATURE_JIT_LOCKSTEP
+#define SEMU_FEATURE_JIT_LOCKSTEP 0
+#endif
+
+/* Run each hart on its own host thread */
+#ifndef SEMU_FEATURE_SMP_THREADS
+#define SEMU_FEATURE_SMP_THREADS 0
+#endif
+
+/* Sampling profiler of the guest, see profile.h */
+#ifndef SEMU_FEATURE_PROFILER
+#define SEMU_FEATURE_PROFILER 1
+#endif
+
+/* Event counters, see stats.h */
+#ifndef SEMU_FEATURE_STATS
+#define SEMU_FEATURE_STATS 0
+#endif
+
 /* Feature test macro */
 #define SEMU_HAS(x) SEMU_FEATURE_##x
@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "forkserver.h"
+#include "riscv_private.h"
+#include "utils.h"
+
+static struct {
+    const char *socket;
+    stream_match_t marker;
+    bool started;
+    bool due;
+    hart_t *requester; /**< hart of the SBI call, NULL for the marker */
+} fs;
+
+int forkserver_init(const forkserver_config_t *config)
+{
+    fs.socket = config->socket;
+    if (!fs.socket)
+        return 0;
+
+    struct sockaddr_un addr;
+    if (strlen(fs.socket) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "The fork server socket path must be shorter than %zu"
+                        " characters.\n",
+                sizeof(addr.sun_path));
+        return -1;
+    }
+    if (!stream_match_init(&fs.marker, config->marker
+                                           ? config->marker
+                                           : FORKSERVER_DEFAULT_MARKER)) {
+        fprintf(stderr,
+                "The fork server marker must have 1 to %d characters.\n",
+                STREAM_MATCH_MAX);
+        return -1;
+    }
+    return 0;
+}
+
+void forkserver_console(uint8_t c)
+{
+    if (!fs.socket || fs.started)
+        return;
+    if (stream_match(&fs.marker, c))
+        fs.started = fs.due = true;
+}
+
+bool forkserver_request(hart_t *hart)
+{
+    if (!fs.socket)
+        return false;
+    if (!fs.started) {
+        fs.started = fs.due = true;
+        fs.requester = hart;
+    }
+    return true;
+}
+
+bool forkserver_pending(void)
+{
+    return fs.due;
+}
+
+bool forkserver_due(void)
+{
+    if (likely(!fs.due))
+        return false;
+    fs.due = false;
+    return true;
+}
+
+static int forkserver_listen(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, fs.socket);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    /* A socket left behind by an earlier run would fail the bind */
+    unlink(fs.socket);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int forkserver_run(void)
+{
+    int listen_fd = forkserver_listen();
+    if (listen_fd < 0) {
+        fprintf(stderr, "could not listen on %s: %s\n", fs.socket,
+                strerror(errno));
+        exit(2);
+    }
+    fprintf(stderr, "fork server: listening on %s\n", fs.socket);
+
+    /* Clones are never waited for, let the kernel reap them */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (uint32_t clone = 1;; clone++) {
+        int conn;
+        while ((conn = accept(listen_fd, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                fprintf(stderr, "fork server: accept: %s\n", strerror(errno));
+                exit(2);
+            }
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            close(listen_fd);
+            if (fs.requester) {
+                fs.requester->x_regs[RV_R_A1] = clone;
+                fs.requester = NULL;
+            }
+            return conn;
+        }
+
+        if (pid < 0)
+            fprintf(stderr, "fork server: fork: %s\n", strerror(errno));
+        else
+            fprintf(stderr, "fork server: clone %u is pid %d\n", clone,
+                    (int) pid);
+        close(conn);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "riscv.h"
+
+/* Fork server, which boots a system once and then clones it on demand. Once
+ * the console prints a marker, or the guest makes the fork server SBI call,
+ * the emulator stops running the guest and listens on a UNIX socket instead.
+ * Each connection forks a clone of the machine, whose guest RAM is shared
+ * copy-on-write with the others. The connection is the console of the clone,
+ * which exits once the client hangs up. The environment gives each clone a
+ * backend of its own for virtio-net and a copy-on-write overlay of the disk
+ * image.
+ *
+ * The clones start from the instruction after the SBI call, or from the end
+ * of the block that printed the marker. The output that follows the marker
+ * within that block still goes to the console of the emulator.
+ */
+
+#define FORKSERVER_DEFAULT_MARKER "login:"
+
+typedef struct {
+    const char *socket; /**< path of the control socket, NULL if off */
+    const char *marker; /**< console output that starts the server */
+} forkserver_config_t;
+
+/* Return nonzero on error */
+int forkserver_init(const forkserver_config_t *config);
+
+/* Feed a byte of console output to the marker matcher */
+void forkserver_console(uint8_t c);
+
+/* Start the server at the end of the current step, on behalf of the guest.
+ * The call returns the number of the clone, counting from 1, to the guest in
+ * each clone. Return false if the server is off.
+ */
+bool forkserver_request(hart_t *hart);
+
+/* Return true if the server was asked to start, for harts to yield */
+bool forkserver_pending(void);
+
+/* Return true once after the server was asked to start, when the harts are
+ * between two steps.
+ */
+bool forkserver_due(void);
+
+/* Listen on the socket and fork a clone for each connection. Only returns in
+ * a clone, with the fd of its connection. Exits on errors.
+ */
+int forkserver_run(void);
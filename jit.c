@@ -0,0 +1,888 @@
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "jit.h"
+#include "riscv.h"
+#include "riscv_private.h"
+
+#if !defined(__x86_64__)
+#error "the JIT only emits x86-64 code"
+#endif
+
+/* A compiled block is called as "void f(hart_t *vm)" with the System V ABI.
+ * R15 holds the hart for the whole block, the guest registers used most by
+ * the block live in the remaining callee-saved registers, and the
+ * caller-saved registers are scratch. Memory accesses and divisions call back
+ * into C, which therefore preserves the cached guest registers for free.
+ *
+ * On every exit, compiled code leaves the hart exactly as the interpreter
+ * would after running the same instructions: pc, current_pc and instret are
+ * updated, and the cached guest registers are written back.
+ */
+
+/* clang-format off */
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+/* clang-format on */
+
+#define VM R15
+
+static const uint8_t cache_regs[] = {RBX, RBP, R12, R13, R14};
+
+/* condition codes */
+enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_G = 0xF,
+};
+
+/* opcodes and ModRM extensions */
+enum {
+    OP_ADD = 0x01,
+    OP_OR = 0x09,
+    OP_AND = 0x21,
+    OP_SUB = 0x29,
+    OP_XOR = 0x31,
+    OP_CMP = 0x39,
+    OP_MOVSXD = 0x63,
+    OP_MOV_STORE = 0x89,
+    OP_MOV_LOAD = 0x8B,
+    OP_IMUL = 0x0FAF,
+    OP_MOVZX8 = 0x0FB6,
+    OP_MOVZX16 = 0x0FB7,
+    OP_MOVSX8 = 0x0FBE,
+    OP_MOVSX16 = 0x0FBF,
+    OP_SETCC = 0x0F90,
+    OP_CMOVCC = 0x0F40,
+    OP_BSWAP = 0x0FC8,
+    OP_BSF = 0x0FBC,
+    OP_BSR = 0x0FBD,
+    OP_BTS = 0x0FAB,
+    OP_BTR = 0x0FB3,
+    OP_BTC = 0x0FBB,
+    OP_BT_IMM = 0x0FBA,
+    OP_UNARY = 0xF7,
+};
+enum { EXT_ADD = 0, EXT_OR = 1, EXT_AND = 4, EXT_SUB = 5, EXT_XOR = 6 };
+enum { EXT_CMP = 7, EXT_SHL = 4, EXT_SHR = 5, EXT_SAR = 7 };
+enum { EXT_ROL = 0, EXT_ROR = 1, EXT_NOT = 2 };
+enum { EXT_BTS = 5, EXT_BTR = 6, EXT_BTC = 7 };
+
+#define OFF(field) ((int32_t) offsetof(hart_t, field))
+#define OFF_X(reg) (OFF(x_regs) + 4 * (int32_t) (reg))
+
+/* Worst-case host code size of a single guest instruction, including its
+ * share of out-of-line fault exits.
+ */
+#define JIT_MAX_INSN_CODE 160
+
+typedef struct {
+    uint8_t *p, *end;
+    uint8_t *epilogue;
+    int8_t host[32]; /**< host register caching each guest register, or -1 */
+    /* offset of each instruction from the block entry, as compressed ones are
+     * only 2 bytes long
+     */
+    uint16_t off[BLOCK_MAX_INSN + 1];
+
+    /* Forward jumps to the fault exits, emitted after the block body */
+    uint32_t n_faults;
+    struct {
+        uint8_t *rel;
+        uint32_t idx;
+    } faults[BLOCK_MAX_INSN];
+} jit_t;
+
+static inline void emit8(jit_t *j, uint8_t b)
+{
+    *j->p++ = b;
+}
+
+static inline void emit32(jit_t *j, uint32_t v)
+{
+    memcpy(j->p, &v, 4);
+    j->p += 4;
+}
+
+static inline void emit64(jit_t *j, uint64_t v)
+{
+    memcpy(j->p, &v, 8);
+    j->p += 8;
+}
+
+static void emit_rex(jit_t *j, bool w, uint8_t reg, uint8_t rm)
+{
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        emit8(j, rex);
+}
+
+static void emit_op(jit_t *j, uint16_t op)
+{
+    if (op >> 8)
+        emit8(j, op >> 8);
+    emit8(j, op & 0xFF);
+}
+
+/* "op" with a register "rm" operand; "reg" is a register or an extension */
+static void emit_rr(jit_t *j, bool w, uint16_t op, uint8_t reg, uint8_t rm)
+{
+    emit_rex(j, w, reg, rm);
+    emit_op(j, op);
+    emit8(j, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* "op" with a hart field "[VM + disp]" as the "rm" operand */
+static void emit_rm(jit_t *j, bool w, uint16_t op, uint8_t reg, int32_t disp)
+{
+    emit_rex(j, w, reg, VM);
+    emit_op(j, op);
+    if (disp >= -128 && disp < 128) {
+        emit8(j, 0x40 | (reg & 7) << 3 | (VM & 7));
+        emit8(j, disp);
+    } else {
+        emit8(j, 0x80 | (reg & 7) << 3 | (VM & 7));
+        emit32(j, disp);
+    }
+}
+
+static void emit_mov(jit_t *j, uint8_t dst, uint8_t src)
+{
+    if (dst != src)
+        emit_rr(j, false, OP_MOV_STORE, src, dst);
+}
+
+static void emit_mov_imm(jit_t *j, uint8_t dst, uint32_t imm)
+{
+    if (!imm) {
+        emit_rr(j, false, OP_XOR, dst, dst);
+        return;
+    }
+    emit_rex(j, false, 0, dst);
+    emit8(j, 0xB8 + (dst & 7));
+    emit32(j, imm);
+}
+
+/* ALU operation "ext" of register "r" with an immediate */
+static void emit_alu_imm(jit_t *j, bool w, uint8_t ext, uint8_t r, int32_t imm)
+{
+    if (imm >= -128 && imm < 128) {
+        emit_rr(j, w, 0x83, ext, r);
+        emit8(j, imm);
+    } else {
+        emit_rr(j, w, 0x81, ext, r);
+        emit32(j, imm);
+    }
+}
+
+static void emit_shift_imm(jit_t *j, bool w, uint8_t ext, uint8_t r, uint8_t n)
+{
+    emit_rr(j, w, 0xC1, ext, r);
+    emit8(j, n);
+}
+
+static void emit_call(jit_t *j, const void *fn)
+{
+    emit_rex(j, true, 0, RAX);
+    emit8(j, 0xB8);
+    emit64(j, (uintptr_t) fn);
+    emit_rr(j, false, 0xFF, 2, RAX);
+}
+
+static void emit_push(jit_t *j, uint8_t r)
+{
+    emit_rex(j, false, 0, r);
+    emit8(j, 0x50 + (r & 7));
+}
+
+static void emit_pop(jit_t *j, uint8_t r)
+{
+    emit_rex(j, false, 0, r);
+    emit8(j, 0x58 + (r & 7));
+}
+
+/* Emit a jump and return the location of its 32-bit displacement */
+static uint8_t *emit_jcc(jit_t *j, uint8_t cc)
+{
+    emit8(j, 0x0F);
+    emit8(j, 0x80 | cc);
+    emit32(j, 0);
+    return j->p - 4;
+}
+
+static uint8_t *emit_jmp(jit_t *j)
+{
+    emit8(j, 0xE9);
+    emit32(j, 0);
+    return j->p - 4;
+}
+
+static void patch(uint8_t *rel, const uint8_t *target)
+{
+    int32_t disp = target - (rel + 4);
+    memcpy(rel, &disp, 4);
+}
+
+/* Return the host register holding guest register "g", loading it into "tmp"
+ * unless it is cached.
+ */
+static uint8_t emit_get(jit_t *j, uint8_t g, uint8_t tmp)
+{
+    if (!g) {
+        emit_mov_imm(j, tmp, 0);
+        return tmp;
+    }
+    if (j->host[g] >= 0)
+        return j->host[g];
+    emit_rm(j, false, OP_MOV_LOAD, tmp, OFF_X(g));
+    return tmp;
+}
+
+static void emit_get_into(jit_t *j, uint8_t r, uint8_t g)
+{
+    emit_mov(j, r, emit_get(j, g, r));
+}
+
+static void emit_set(jit_t *j, uint8_t g, uint8_t r)
+{
+    if (!g)
+        return;
+    if (j->host[g] >= 0)
+        emit_mov(j, j->host[g], r);
+    else
+        emit_rm(j, false, OP_MOV_STORE, r, OFF_X(g));
+}
+
+static void emit_set_imm(jit_t *j, uint8_t g, uint32_t imm)
+{
+    if (!g)
+        return;
+    if (j->host[g] >= 0) {
+        emit_mov_imm(j, j->host[g], imm);
+    } else {
+        emit_rm(j, false, 0xC7, 0, OFF_X(g));
+        emit32(j, imm);
+    }
+}
+
+/* Load the address of the instruction "idx" plus "off" into "r". The block
+ * may be mapped at several virtual addresses, so it is derived from vm->pc,
+ * which holds the entry address until the block exits.
+ */
+static void emit_pc(jit_t *j, uint8_t r, uint32_t idx, int32_t off)
+{
+    emit_rm(j, false, OP_MOV_LOAD, r, OFF(pc));
+    if (j->off[idx] + off)
+        emit_alu_imm(j, false, EXT_ADD, r, j->off[idx] + off);
+}
+
+/* Return the length of the instruction "idx", i.e. the offset of the next one
+ * from it
+ */
+static inline int32_t insn_len(const jit_t *j, uint32_t idx)
+{
+    return j->off[idx + 1] - j->off[idx];
+}
+
+/* Leave the block after instruction "idx" with the next pc at "off" bytes
+ * from it, or in EAX if "indirect" is set.
+ */
+static void emit_exit(jit_t *j, uint32_t idx, bool indirect, int32_t off)
+{
+    if (!indirect)
+        emit_pc(j, RAX, idx, off);
+    emit_pc(j, RCX, idx, 0);
+    emit_rm(j, false, OP_MOV_STORE, RCX, OFF(current_pc));
+    emit_rm(j, false, OP_MOV_STORE, RAX, OFF(pc));
+    emit_rm(j, true, 0x83, EXT_ADD, OFF(instret));
+    emit8(j, idx + 1);
+    patch(emit_jmp(j), j->epilogue);
+}
+
+static void emit_fault_check(jit_t *j, uint32_t idx)
+{
+    emit_rm(j, false, 0x83, EXT_CMP, OFF(error));
+    emit8(j, ERR_NONE);
+    j->faults[j->n_faults].rel = emit_jcc(j, CC_NE);
+    j->faults[j->n_faults].idx = idx;
+    j->n_faults++;
+}
+
+static uint32_t helper_div(uint32_t a, uint32_t b)
+{
+    if (!b)
+        return 0xFFFFFFFF;
+    if (a == 0x80000000 && (int32_t) b == -1)
+        return 0x80000000;
+    return (uint32_t) ((int32_t) a / (int32_t) b);
+}
+
+static uint32_t helper_divu(uint32_t a, uint32_t b)
+{
+    return b ? a / b : 0xFFFFFFFF;
+}
+
+static uint32_t helper_rem(uint32_t a, uint32_t b)
+{
+    if (!b)
+        return a;
+    if (a == 0x80000000 && (int32_t) b == -1)
+        return 0;
+    return (uint32_t) ((int32_t) a % (int32_t) b);
+}
+
+static uint32_t helper_remu(uint32_t a, uint32_t b)
+{
+    return b ? a % b : a;
+}
+
+static uint32_t helper_cpop(uint32_t a)
+{
+    return __builtin_popcount(a);
+}
+
+static uint32_t helper_orc_b(uint32_t a)
+{
+    uint32_t high = (((a & 0x7F7F7F7F) + 0x7F7F7F7F) | a) & 0x80808080;
+    return (high >> 7) * 0xFF;
+}
+
+/* Return whether the instruction can be compiled */
+static bool insn_supported(const rv_insn_t *ir)
+{
+    switch (ir->opcode) {
+    case RV_INSN_illegal:
+    case RV_INSN_fencei:
+    case RV_INSN_amo:
+    case RV_INSN_system:
+#define _(inst) case RV_INSN_##inst:
+        RV_INSN_LIST_FP
+#undef _
+        return false;
+    default:
+        return true;
+    }
+}
+
+/* Count the guest register operands of the instruction into "uses" */
+static void insn_count_regs(const rv_insn_t *ir, uint32_t *uses)
+{
+    switch (ir->opcode) {
+    case RV_INSN_nop:
+    case RV_INSN_fence:
+    case RV_INSN_pause:
+        break;
+    case RV_INSN_cbo_zero:
+        uses[ir->rs1]++;
+        break;
+    case RV_INSN_lui:
+    case RV_INSN_auipc:
+    case RV_INSN_jal:
+        uses[ir->rd]++;
+        break;
+    case RV_INSN_beq:
+    case RV_INSN_bne:
+    case RV_INSN_blt:
+    case RV_INSN_bge:
+    case RV_INSN_bltu:
+    case RV_INSN_bgeu:
+    case RV_INSN_sb:
+    case RV_INSN_sh:
+    case RV_INSN_sw:
+        uses[ir->rs1]++;
+        uses[ir->rs2]++;
+        break;
+    case RV_INSN_jalr:
+    case RV_INSN_lb:
+    case RV_INSN_lh:
+    case RV_INSN_lw:
+    case RV_INSN_lbu:
+    case RV_INSN_lhu:
+    case RV_INSN_addi:
+    case RV_INSN_slti:
+    case RV_INSN_sltiu:
+    case RV_INSN_xori:
+    case RV_INSN_ori:
+    case RV_INSN_andi:
+    case RV_INSN_slli:
+    case RV_INSN_srli:
+    case RV_INSN_srai:
+    case RV_INSN_clz:
+    case RV_INSN_ctz:
+    case RV_INSN_cpop:
+    case RV_INSN_sext_b:
+    case RV_INSN_sext_h:
+    case RV_INSN_zext_h:
+    case RV_INSN_rori:
+    case RV_INSN_orc_b:
+    case RV_INSN_rev8:
+    case RV_INSN_bclri:
+    case RV_INSN_bexti:
+    case RV_INSN_binvi:
+    case RV_INSN_bseti:
+        uses[ir->rd]++;
+        uses[ir->rs1]++;
+        break;
+    default:
+        uses[ir->rd]++;
+        uses[ir->rs1]++;
+        uses[ir->rs2]++;
+        break;
+    }
+}
+
+/* Cache the most used guest registers of the first "n" instructions */
+static void alloc_regs(jit_t *j, const rv_insn_t *ir, uint32_t n)
+{
+    uint32_t uses[32] = {0};
+    for (uint32_t i = 0; i < n; i++)
+        insn_count_regs(&ir[i], uses);
+    uses[0] = 0;
+
+    memset(j->host, -1, sizeof(j->host));
+    for (uint32_t k = 0; k < ARRAY_SIZE(cache_regs); k++) {
+        uint8_t best = 0;
+        for (uint8_t g = 1; g < 32; g++) {
+            if (uses[g] > uses[best])
+                best = g;
+        }
+        if (!best)
+            break;
+        j->host[best] = cache_regs[k];
+        uses[best] = 0;
+    }
+}
+
+static void emit_epilogue(jit_t *j)
+{
+    for (uint8_t g = 1; g < 32; g++) {
+        if (j->host[g] >= 0)
+            emit_rm(j, false, OP_MOV_STORE, j->host[g], OFF_X(g));
+    }
+    emit_alu_imm(j, true, EXT_ADD, RSP, 8);
+    for (int i = ARRAY_SIZE(cache_regs) - 1; i >= 0; i--)
+        emit_pop(j, cache_regs[i]);
+    emit_pop(j, VM);
+    emit8(j, 0xC3); /* ret */
+}
+
+static void emit_prologue(jit_t *j)
+{
+    emit_push(j, VM);
+    for (uint32_t i = 0; i < ARRAY_SIZE(cache_regs); i++)
+        emit_push(j, cache_regs[i]);
+    /* keep the stack 16-byte aligned for helper calls */
+    emit_alu_imm(j, true, EXT_SUB, RSP, 8);
+    emit_rr(j, true, OP_MOV_STORE, RDI, VM);
+    for (uint8_t g = 1; g < 32; g++) {
+        if (j->host[g] >= 0)
+            emit_rm(j, false, OP_MOV_LOAD, j->host[g], OFF_X(g));
+    }
+}
+
+static void emit_alu(jit_t *j, const rv_insn_t *ir, uint16_t op)
+{
+    if (ir->rd && ir->rd == ir->rs1 && j->host[ir->rd] >= 0 &&
+        ir->rs2 != ir->rd) {
+        emit_rr(j, false, op, emit_get(j, ir->rs2, RCX), j->host[ir->rd]);
+        return;
+    }
+    emit_get_into(j, RAX, ir->rs1);
+    emit_rr(j, false, op, emit_get(j, ir->rs2, RCX), RAX);
+    emit_set(j, ir->rd, RAX);
+}
+
+static void emit_alu_i(jit_t *j, const rv_insn_t *ir, uint8_t ext)
+{
+    if (ir->rd && ir->rd == ir->rs1 && j->host[ir->rd] >= 0) {
+        emit_alu_imm(j, false, ext, j->host[ir->rd], ir->imm);
+        return;
+    }
+    emit_get_into(j, RAX, ir->rs1);
+    emit_alu_imm(j, false, ext, RAX, ir->imm);
+    emit_set(j, ir->rd, RAX);
+}
+
+static void emit_shift_i(jit_t *j, const rv_insn_t *ir, uint8_t ext)
+{
+    uint8_t n = ir->imm & MASK(5);
+    if (ir->rd && ir->rd == ir->rs1 && j->host[ir->rd] >= 0) {
+        emit_shift_imm(j, false, ext, j->host[ir->rd], n);
+        return;
+    }
+    emit_get_into(j, RAX, ir->rs1);
+    emit_shift_imm(j, false, ext, RAX, n);
+    emit_set(j, ir->rd, RAX);
+}
+
+static void emit_shift(jit_t *j, const rv_insn_t *ir, uint8_t ext)
+{
+    emit_get_into(j, RCX, ir->rs2);
+    emit_get_into(j, RAX, ir->rs1);
+    emit_rr(j, false, 0xD3, ext, RAX); /* shift by CL */
+    emit_set(j, ir->rd, RAX);
+}
+
+static void emit_set_cc(jit_t *j, const rv_insn_t *ir, uint8_t cc, bool imm)
+{
+    uint8_t a = emit_get(j, ir->rs1, RAX);
+    if (imm)
+        emit_alu_imm(j, false, EXT_CMP, a, ir->imm);
+    else
+        emit_rr(j, false, OP_CMP, emit_get(j, ir->rs2, RCX), a);
+    emit_rr(j, false, OP_SETCC | cc, 0, RAX);
+    emit_rr(j, false, OP_MOVZX8, RAX, RAX);
+    emit_set(j, ir->rd, RAX);
+}
+
+/* Upper half of the 64-bit product, with each operand sign- or
+ * zero-extended.
+ */
+static void emit_mul_high(jit_t *j,
+                          const rv_insn_t *ir,
+                          bool signed_a,
+                          bool signed_b)
+{
+    emit_get_into(j, RAX, ir->rs1);
+    if (signed_a)
+        emit_rr(j, true, OP_MOVSXD, RAX, RAX);
+    emit_get_into(j, RCX, ir->rs2);
+    if (signed_b)
+        emit_rr(j, true, OP_MOVSXD, RCX, RCX);
+    emit_rr(j, true, OP_IMUL, RAX, RCX);
+    emit_shift_imm(j, true, EXT_SHR, RAX, 32);
+    emit_set(j, ir->rd, RAX);
+}
+
+static void emit_div(jit_t *j, const rv_insn_t *ir, const void *helper)
+{
+    emit_get_into(j, RDI, ir->rs1);
+    emit_get_into(j, RSI, ir->rs2);
+    emit_call(j, helper);
+    emit_set(j, ir->rd, RAX);
+}
+
+/* Unary operation "helper" of rs1 */
+static void emit_unary(jit_t *j, const rv_insn_t *ir, const void *helper)
+{
+    emit_get_into(j, RDI, ir->rs1);
+    emit_call(j, helper);
+    emit_set(j, ir->rd, RAX);
+}
+
+/* SH1ADD, SH2ADD and SH3ADD */
+static void emit_shadd(jit_t *j, const rv_insn_t *ir, uint8_t n)
+{
+    emit_get_into(j, RAX, ir->rs1);
+    emit_shift_imm(j, false, EXT_SHL, RAX, n);
+    emit_rr(j, false, OP_ADD, emit_get(j, ir->rs2, RCX), RAX);
+    emit_set(j, ir->rd, RAX);
+}
+
+/* ANDN, ORN and XNOR: ALU "op" of rs1 with the complement of rs2 */
+static void emit_alu_not(jit_t *j, const rv_insn_t *ir, uint16_t op)
+{
+    emit_get_into(j, RCX, ir->rs2);
+    emit_rr(j, false, OP_UNARY, EXT_NOT, RCX);
+    emit_get_into(j, RAX, ir->rs1);
+    emit_rr(j, false, op, RCX, RAX);
+    emit_set(j, ir->rd, RAX);
+}
+
+/* MIN, MAX, MINU and MAXU: rs2 if "cc" holds for rs1 against rs2, else rs1 */
+static void emit_select(jit_t *j, const rv_insn_t *ir, uint8_t cc)
+{
+    emit_get_into(j, RAX, ir->rs1);
+    uint8_t b = emit_get(j, ir->rs2, RCX);
+    emit_rr(j, false, OP_CMP, b, RAX);
+    emit_rr(j, false, OP_CMOVCC | cc, RAX, b);
+    emit_set(j, ir->rd, RAX);
+}
+
+/* SEXT.B, SEXT.H, ZEXT.H and REV8 */
+static void emit_extend(jit_t *j, const rv_insn_t *ir, uint16_t op)
+{
+    emit_get_into(j, RAX, ir->rs1);
+    if (op == OP_BSWAP)
+        emit_op(j, op);
+    else
+        emit_rr(j, false, op, RAX, RAX);
+    emit_set(j, ir->rd, RAX);
+}
+
+/* CLZ and CTZ, as BSR and BSF leave a zero operand undefined */
+static void emit_bit_scan(jit_t *j, const rv_insn_t *ir, uint16_t op)
+{
+    emit_mov_imm(j, RCX, op == OP_BSR ? 63 : 32);
+    emit_rr(j, false, op, RAX, emit_get(j, ir->rs1, RDX));
+    emit_rr(j, false, OP_CMOVCC | CC_E, RAX, RCX);
+    /* the index of the highest set bit is 31 - clz */
+    if (op == OP_BSR)
+        emit_alu_imm(j, false, EXT_XOR, RAX, 31);
+    emit_set(j, ir->rd, RAX);
+}
+
+/* BCLRI, BINVI and BSETI */
+static void emit_bit_i(jit_t *j, const rv_insn_t *ir, uint8_t ext)
+{
+    emit_get_into(j, RAX, ir->rs1);
+    emit_rr(j, false, OP_BT_IMM, ext, RAX);
+    emit8(j, ir->imm & MASK(5));
+    emit_set(j, ir->rd, RAX);
+}
+
+/* BEXT and BEXTI */
+static void emit_bit_extract(jit_t *j, const rv_insn_t *ir, bool imm)
+{
+    if (imm) {
+        emit_get_into(j, RAX, ir->rs1);
+        emit_shift_imm(j, false, EXT_SHR, RAX, ir->imm & MASK(5));
+    } else {
+        emit_get_into(j, RCX, ir->rs2);
+        emit_get_into(j, RAX, ir->rs1);
+        emit_rr(j, false, 0xD3, EXT_SHR, RAX);
+    }
+    emit_alu_imm(j, false, EXT_AND, RAX, 1);
+    emit_set(j, ir->rd, RAX);
+}
+
+static void emit_load(jit_t *j, const rv_insn_t *ir, uint32_t idx, uint8_t w)
+{
+    emit_get_into(j, RSI, ir->rs1);
+    emit_alu_imm(j, false, EXT_ADD, RSI, ir->imm);
+    emit_rr(j, true, OP_MOV_STORE, VM, RDI);
+    emit_mov_imm(j, RDX, w);
+    emit_call(j, jit_load);
+    emit_fault_check(j, idx);
+    emit_set(j, ir->rd, RAX);
+}
+
+static void emit_store(jit_t *j, const rv_insn_t *ir, uint32_t idx, uint8_t w)
+{
+    emit_get_into(j, RCX, ir->rs2);
+    emit_get_into(j, RSI, ir->rs1);
+    emit_alu_imm(j, false, EXT_ADD, RSI, ir->imm);
+    emit_rr(j, true, OP_MOV_STORE, VM, RDI);
+    emit_mov_imm(j, RDX, w);
+    emit_call(j, jit_store);
+    emit_fault_check(j, idx);
+}
+
+static void emit_branch(jit_t *j, const rv_insn_t *ir, uint32_t idx, uint8_t cc)
+{
+    uint8_t a = emit_get(j, ir->rs1, RAX);
+    emit_rr(j, false, OP_CMP, emit_get(j, ir->rs2, RCX), a);
+    uint8_t *taken = emit_jcc(j, cc);
+    emit_exit(j, idx, false, insn_len(j, idx));
+    patch(taken, j->p);
+    emit_exit(j, idx, false, ir->imm);
+}
+
+static void emit_jalr(jit_t *j, const rv_insn_t *ir, uint32_t idx)
+{
+    emit_get_into(j, RAX, ir->rs1);
+    emit_alu_imm(j, false, EXT_ADD, RAX, ir->imm);
+    emit_alu_imm(j, false, EXT_AND, RAX, ~1);
+    emit_pc(j, RCX, idx, insn_len(j, idx));
+    emit_set(j, ir->rd, RCX);
+    emit_exit(j, idx, true, 0);
+}
+
+/* Emit the instruction. Return true if it left the block. */
+static bool emit_insn(jit_t *j, const rv_insn_t *ir, uint32_t idx)
+{
+    switch (ir->opcode) {
+    case RV_INSN_nop:
+        break;
+    case RV_INSN_fence:
+#if SEMU_HAS(SMP_THREADS)
+        emit_op(j, 0x0FAE); /* mfence */
+        emit8(j, 0xF0);
+#endif
+        break;
+    case RV_INSN_pause:
+#if SEMU_HAS(SMP_THREADS)
+        emit_op(j, 0xF390); /* pause */
+#else
+        emit_rm(j, false, 0xC6, 0, OFF(yield)); /* mov byte */
+        emit8(j, 1);
+#endif
+        break;
+    case RV_INSN_cbo_zero:
+        emit_get_into(j, RSI, ir->rs1);
+        emit_rr(j, true, OP_MOV_STORE, VM, RDI);
+        emit_call(j, jit_cbo_zero);
+        emit_fault_check(j, idx);
+        break;
+    case RV_INSN_lui:
+        emit_set_imm(j, ir->rd, ir->imm);
+        break;
+    case RV_INSN_auipc:
+        if (!ir->rd)
+            break;
+        emit_pc(j, RAX, idx, ir->imm);
+        emit_set(j, ir->rd, RAX);
+        break;
+    case RV_INSN_jal:
+        if (ir->rd) {
+            emit_pc(j, RAX, idx, insn_len(j, idx));
+            emit_set(j, ir->rd, RAX);
+        }
+        emit_exit(j, idx, false, ir->imm);
+        return true;
+    case RV_INSN_jalr:
+        emit_jalr(j, ir, idx);
+        return true;
+
+    /* clang-format off */
+    case RV_INSN_beq:  emit_branch(j, ir, idx, CC_E);  return true;
+    case RV_INSN_bne:  emit_branch(j, ir, idx, CC_NE); return true;
+    case RV_INSN_blt:  emit_branch(j, ir, idx, CC_L);  return true;
+    case RV_INSN_bge:  emit_branch(j, ir, idx, CC_GE); return true;
+    case RV_INSN_bltu: emit_branch(j, ir, idx, CC_B);  return true;
+    case RV_INSN_bgeu: emit_branch(j, ir, idx, CC_AE); return true;
+
+    case RV_INSN_lb:  emit_load(j, ir, idx, RV_MEM_LB);  break;
+    case RV_INSN_lh:  emit_load(j, ir, idx, RV_MEM_LH);  break;
+    case RV_INSN_lw:  emit_load(j, ir, idx, RV_MEM_LW);  break;
+    case RV_INSN_lbu: emit_load(j, ir, idx, RV_MEM_LBU); break;
+    case RV_INSN_lhu: emit_load(j, ir, idx, RV_MEM_LHU); break;
+    case RV_INSN_sb:  emit_store(j, ir, idx, RV_MEM_SB); break;
+    case RV_INSN_sh:  emit_store(j, ir, idx, RV_MEM_SH); break;
+    case RV_INSN_sw:  emit_store(j, ir, idx, RV_MEM_SW); break;
+
+    case RV_INSN_addi:  emit_alu_i(j, ir, EXT_ADD);        break;
+    case RV_INSN_slti:  emit_set_cc(j, ir, CC_L, true);    break;
+    case RV_INSN_sltiu: emit_set_cc(j, ir, CC_B, true);    break;
+    case RV_INSN_xori:  emit_alu_i(j, ir, EXT_XOR);        break;
+    case RV_INSN_ori:   emit_alu_i(j, ir, EXT_OR);         break;
+    case RV_INSN_andi:  emit_alu_i(j, ir, EXT_AND);        break;
+    case RV_INSN_slli:  emit_shift_i(j, ir, EXT_SHL);      break;
+    case RV_INSN_srli:  emit_shift_i(j, ir, EXT_SHR);      break;
+    case RV_INSN_srai:  emit_shift_i(j, ir, EXT_SAR);      break;
+
+    case RV_INSN_add:  emit_alu(j, ir, OP_ADD);            break;
+    case RV_INSN_sub:  emit_alu(j, ir, OP_SUB);            break;
+    case RV_INSN_sll:  emit_shift(j, ir, EXT_SHL);         break;
+    case RV_INSN_slt:  emit_set_cc(j, ir, CC_L, false);    break;
+    case RV_INSN_sltu: emit_set_cc(j, ir, CC_B, false);    break;
+    case RV_INSN_xor:  emit_alu(j, ir, OP_XOR);            break;
+    case RV_INSN_srl:  emit_shift(j, ir, EXT_SHR);         break;
+    case RV_INSN_sra:  emit_shift(j, ir, EXT_SAR);         break;
+    case RV_INSN_or:   emit_alu(j, ir, OP_OR);             break;
+    case RV_INSN_and:  emit_alu(j, ir, OP_AND);            break;
+
+    case RV_INSN_mulh:   emit_mul_high(j, ir, true, true);   break;
+    case RV_INSN_mulhsu: emit_mul_high(j, ir, true, false);  break;
+    case RV_INSN_mulhu:  emit_mul_high(j, ir, false, false); break;
+    case RV_INSN_div:    emit_div(j, ir, helper_div);        break;
+    case RV_INSN_divu:   emit_div(j, ir, helper_divu);       break;
+    case RV_INSN_rem:    emit_div(j, ir, helper_rem);        break;
+    case RV_INSN_remu:   emit_div(j, ir, helper_remu);       break;
+
+    case RV_INSN_sh1add: emit_shadd(j, ir, 1);                 break;
+    case RV_INSN_sh2add: emit_shadd(j, ir, 2);                 break;
+    case RV_INSN_sh3add: emit_shadd(j, ir, 3);                 break;
+    case RV_INSN_andn:   emit_alu_not(j, ir, OP_AND);          break;
+    case RV_INSN_orn:    emit_alu_not(j, ir, OP_OR);           break;
+    case RV_INSN_xnor:   emit_alu_not(j, ir, OP_XOR);          break;
+    case RV_INSN_clz:    emit_bit_scan(j, ir, OP_BSR);         break;
+    case RV_INSN_ctz:    emit_bit_scan(j, ir, OP_BSF);         break;
+    case RV_INSN_cpop:   emit_unary(j, ir, helper_cpop);       break;
+    case RV_INSN_max:    emit_select(j, ir, CC_L);             break;
+    case RV_INSN_maxu:   emit_select(j, ir, CC_B);             break;
+    case RV_INSN_min:    emit_select(j, ir, CC_G);             break;
+    case RV_INSN_minu:   emit_select(j, ir, CC_A);             break;
+    case RV_INSN_sext_b: emit_extend(j, ir, OP_MOVSX8);        break;
+    case RV_INSN_sext_h: emit_extend(j, ir, OP_MOVSX16);       break;
+    case RV_INSN_zext_h: emit_extend(j, ir, OP_MOVZX16);       break;
+    case RV_INSN_rev8:   emit_extend(j, ir, OP_BSWAP);         break;
+    case RV_INSN_rol:    emit_shift(j, ir, EXT_ROL);           break;
+    case RV_INSN_ror:    emit_shift(j, ir, EXT_ROR);           break;
+    case RV_INSN_rori:   emit_shift_i(j, ir, EXT_ROR);         break;
+    case RV_INSN_orc_b:  emit_unary(j, ir, helper_orc_b);      break;
+    case RV_INSN_bclr:   emit_alu(j, ir, OP_BTR);              break;
+    case RV_INSN_bclri:  emit_bit_i(j, ir, EXT_BTR);           break;
+    case RV_INSN_bext:   emit_bit_extract(j, ir, false);       break;
+    case RV_INSN_bexti:  emit_bit_extract(j, ir, true);        break;
+    case RV_INSN_binv:   emit_alu(j, ir, OP_BTC);              break;
+    case RV_INSN_binvi:  emit_bit_i(j, ir, EXT_BTC);           break;
+    case RV_INSN_bset:   emit_alu(j, ir, OP_BTS);              break;
+    case RV_INSN_bseti:  emit_bit_i(j, ir, EXT_BTS);           break;
+    /* clang-format on */
+
+    case RV_INSN_mul:
+        emit_get_into(j, RAX, ir->rs1);
+        emit_rr(j, false, OP_IMUL, RAX, emit_get(j, ir->rs2, RCX));
+        emit_set(j, ir->rd, RAX);
+        break;
+    }
+    return false;
+}
+
+static void emit_faults(jit_t *j)
+{
+    for (uint32_t i = 0; i < j->n_faults; i++) {
+        patch(j->faults[i].rel, j->p);
+        emit_exit(j, j->faults[i].idx, false, insn_len(j, j->faults[i].idx));
+    }
+}
+
+void jit_init(block_cache_t *cache)
+{
+    void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    cache->code = code == MAP_FAILED ? NULL : code;
+    cache->code_used = 0;
+    cache->code_full = false;
+}
+
+bool jit_compile(block_cache_t *cache, block_t *block)
+{
+    if (!cache->code)
+        return false;
+
+    uint32_t n = 0;
+    while (n < block->n_insn && insn_supported(&block->ir[n]))
+        n++;
+    if (!n)
+        return false;
+
+    /* The epilogue goes first, so that exits jump backwards to it */
+    jit_t j = {.p = cache->code + cache->code_used};
+    j.end = j.p + 256 + n * JIT_MAX_INSN_CODE;
+    if (j.end > cache->code + JIT_CODE_SIZE) {
+        cache->code_full = true;
+        return false;
+    }
+    alloc_regs(&j, block->ir, n);
+    for (uint32_t i = 0; i < n; i++)
+        j.off[i + 1] = j.off[i] + (block->ir[i].rvc ? 2 : 4);
+    j.epilogue = j.p;
+    emit_epilogue(&j);
+    uint8_t *entry = j.p;
+    emit_prologue(&j);
+
+    bool exited = false;
+    for (uint32_t i = 0; i < n && !exited; i++)
+        exited = emit_insn(&j, &block->ir[i], i);
+    if (!exited)
+        emit_exit(&j, n - 1, false, insn_len(&j, n - 1));
+    emit_faults(&j);
+    assert(j.p <= j.end);
+
+    cache->code_used = j.p - cache->code;
+    block->jit = (void (*)(hart_t *)) entry;
+    block->jit_len = n;
+    return true;
+}
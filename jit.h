@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "riscv.h"
+
+/* Blocks are interpreted until they have been executed this many times, and
+ * are then compiled into host code.
+ */
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 256
+#endif
+
+/* Size of the per-hart host code buffer. Once it is exhausted, the whole block
+ * cache is flushed and compilation starts over.
+ */
+#define JIT_CODE_SIZE (8 * 1024 * 1024)
+
+/* Allocate the code buffer of "cache". On failure, the buffer is left unset
+ * and the hart simply keeps interpreting.
+ */
+void jit_init(block_cache_t *cache);
+
+/* Compile the longest leading run of supported instructions of "block" and set
+ * block->jit and block->jit_len. Return false if nothing was compiled; if that
+ * is because the code buffer ran out of space, cache->code_full is set.
+ */
+bool jit_compile(block_cache_t *cache, block_t *block);
+
+/* Memory accesses of compiled code go through the MMU of riscv.c. Like any
+ * other access they set vm->error on failure, which compiled code checks right
+ * after the call.
+ */
+uint32_t jit_load(hart_t *vm, uint32_t addr, uint32_t width);
+void jit_store(hart_t *vm, uint32_t addr, uint32_t width, uint32_t value);
+void jit_cbo_zero(hart_t *vm, uint32_t addr);
@@ -2,6 +2,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,9 +12,13 @@
 #include <unistd.h>
 
 #include "device.h"
+#include "forkserver.h"
 #include "mini-gdbstub/include/gdbstub.h"
 #include "riscv.h"
 #include "riscv_private.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "timeline.h"
 #include "virgl.h"
 #include "window.h"
 
@@ -20,6 +26,183 @@
 
 extern const struct window_backend g_window;
 
+/* With one host thread per hart, devices and SBI calls are serialised by the
+ * emulator lock. Otherwise, these are no-ops.
+ */
+static inline void emu_lock(emu_state_t *emu UNUSED)
+{
+#if SEMU_HAS(SMP_THREADS)
+    pthread_mutex_lock(&emu->lock);
+#endif
+}
+
+static inline void emu_unlock(emu_state_t *emu UNUSED)
+{
+#if SEMU_HAS(SMP_THREADS)
+    /* Anything done with the lock held may have raised an interrupt or posted
+     * a remote fence, so let the idle harts check again.
+     */
+    if (emu->n_parked)
+        pthread_cond_broadcast(&emu->wfi_cond);
+    pthread_mutex_unlock(&emu->lock);
+#endif
+}
+
+static inline bool emu_stopped(emu_state_t *emu)
+{
+    return __atomic_load_n(&emu->stopped, __ATOMIC_ACQUIRE);
+}
+
+/* Host I/O */
+enum {
+    IO_UART_IN = 1 << 0,
+    IO_NET_RX = 1 << 1,
+    IO_NET_TX = 1 << 2,
+};
+
+/* Return which of the fds that the I/O thread watches are known to be ready */
+static uint32_t emu_io_ready(emu_state_t *emu)
+{
+    uint32_t ready = 0;
+    if (__atomic_load_n(&emu->uart.in_ready, __ATOMIC_RELAXED))
+        ready |= IO_UART_IN;
+#if SEMU_HAS(VIRTIONET)
+    if (__atomic_load_n(&emu->vnet.queues[VNET_QUEUE_RX].fd_ready,
+                        __ATOMIC_RELAXED))
+        ready |= IO_NET_RX;
+    /* The network thread of the user backend takes care of its TX side */
+    if (emu->vnet.peer.type == NETDEV_IMPL_tap &&
+        __atomic_load_n(&emu->vnet.queues[VNET_QUEUE_TX].fd_ready,
+                        __ATOMIC_RELAXED))
+        ready |= IO_NET_TX;
+#endif
+    return ready;
+}
+
+/* Have the I/O thread watch again the fds that are no longer ready since
+ * emu_io_ready() returned "ready".
+ */
+static void emu_io_check(emu_state_t *emu, uint32_t ready)
+{
+    if (likely(!(ready & ~emu_io_ready(emu))))
+        return;
+    if (!__atomic_exchange_n(&emu->io_kicked, true, __ATOMIC_SEQ_CST)) {
+        char c = 0;
+        if (write(emu->io_wake[1], &c, 1) < 0 && errno != EAGAIN)
+            fprintf(stderr, "failed to wake the I/O thread: %s\n",
+                    strerror(errno));
+    }
+}
+
+static void emu_io_drain(int fd)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void *emu_io_thread(void *arg)
+{
+    emu_state_t *emu = (emu_state_t *) arg;
+    bool uart_closed = false;
+
+    while (true) {
+        struct pollfd pfd[3];
+        nfds_t n = 0;
+        int uart = -1;
+
+        /* Clear the kick before reading the flags, so that a flag cleared
+         * from now on kicks again.
+         */
+        __atomic_store_n(&emu->io_kicked, false, __ATOMIC_SEQ_CST);
+        uint32_t ready = emu_io_ready(emu);
+
+        pfd[n++] = (struct pollfd){emu->io_wake[0], POLLIN, 0};
+        if (!(ready & IO_UART_IN) && !uart_closed) {
+            uart = n;
+            pfd[n++] = (struct pollfd){emu->uart.in_fd, POLLIN, 0};
+        }
+#if SEMU_HAS(VIRTIONET)
+        int net = -1, net_fd = -1;
+        short events = 0;
+        if (emu->vnet.peer.type == NETDEV_IMPL_tap) {
+            net_tap_options_t *tap = (net_tap_options_t *) emu->vnet.peer.op;
+            net_fd = tap->tap_fd;
+            events = (ready & IO_NET_RX ? 0 : POLLIN) |
+                     (ready & IO_NET_TX ? 0 : POLLOUT);
+        } else if (emu->vnet.peer.type == NETDEV_IMPL_user) {
+            net_user_options_t *usr = (net_user_options_t *) emu->vnet.peer.op;
+            net_fd = usr->channel[SLIRP_READ_SIDE];
+            events = ready & IO_NET_RX ? 0 : POLLIN;
+        }
+        if (events) {
+            net = n;
+            pfd[n++] = (struct pollfd){net_fd, events, 0};
+        }
+#endif
+
+        if (poll(pfd, n, -1) < 0)
+            continue;
+        if (pfd[0].revents)
+            emu_io_drain(emu->io_wake[0]);
+
+        bool event = false;
+        if (uart >= 0 && (pfd[uart].revents & POLLIN)) {
+            __atomic_store_n(&emu->uart.in_ready, true, __ATOMIC_RELAXED);
+            event = true;
+        } else if (uart >= 0 && pfd[uart].revents) {
+            /* Hung up, so there is nothing left to wait for */
+            uart_closed = true;
+        }
+#if SEMU_HAS(VIRTIONET)
+        if (net >= 0 && (pfd[net].revents & POLLIN)) {
+            __atomic_store_n(&emu->vnet.queues[VNET_QUEUE_RX].fd_ready, true,
+                             __ATOMIC_RELAXED);
+            event = true;
+        }
+        if (net >= 0 && (pfd[net].revents & POLLOUT)) {
+            __atomic_store_n(&emu->vnet.queues[VNET_QUEUE_TX].fd_ready, true,
+                             __ATOMIC_RELAXED);
+            event = true;
+        }
+#endif
+        if (event) {
+            char c = 0;
+            if (write(emu->io_notify[1], &c, 1) < 0 && errno != EAGAIN)
+                fprintf(stderr, "failed to notify of I/O: %s\n",
+                        strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+static bool emu_io_init(emu_state_t *emu)
+{
+    /* Pick up input that is already pending before the harts start */
+    u8250_check_ready(&emu->uart);
+
+    if (pipe(emu->io_wake) || pipe(emu->io_notify)) {
+        fprintf(stderr, "Failed to create the I/O pipes: %s\n",
+                strerror(errno));
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(emu->io_wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(emu->io_notify[i], F_SETFL, O_NONBLOCK);
+    }
+    if (pthread_create(&emu->io_thread, NULL, emu_io_thread, emu)) {
+        fprintf(stderr, "Failed to create the I/O thread.\n");
+        return false;
+    }
+#if SEMU_HAS(VIRTIONET)
+    if (emu->vnet.peer.type == NETDEV_IMPL_user &&
+        !net_slirp_start((net_user_options_t *) emu->vnet.peer.op,
+                         emu->io_notify[1]))
+        return false;
+#endif
+    return true;
+}
+
 /* Define fetch separately since it is simpler (fixed width, already checked
  * alignment, only main RAM is executable).
  */
@@ -34,7 +217,9 @@ static void mem_fetch(hart_t *hart, uint32_t n_pages, uint32_t **page_addr)
     *page_addr = &data->ram[n_pages << (RV_PAGE_SHIFT - 2)];
 }
 
-/* Similarly, only main memory pages can be used as page tables. */
+/* Similarly, only main memory pages can be used as page tables, and loads
+ * and stores may only access those pages in place.
+ */
 static uint32_t *mem_page_table(const hart_t *hart, uint32_t ppn)
 {
     emu_state_t *data = PRIV(hart);
@@ -152,19 +337,15 @@ static void emu_update_vsnd_interrupts(vm_t *vm)
 }
 #endif
 
-static void mem_load(hart_t *hart,
-                     uint32_t addr,
-                     uint8_t width,
-                     uint32_t *value)
+static void mmio_load(hart_t *hart,
+                      uint32_t addr,
+                      uint8_t width,
+                      uint32_t *value)
 {
     emu_state_t *data = PRIV(hart);
-    /* RAM at 0x00000000 + RAM_SIZE */
-    if (addr < RAM_SIZE) {
-        ram_read(hart, data->ram, addr, width, value);
-        return;
-    }
-
     if ((addr >> 28) == 0xF) { /* MMIO at 0xF_______ */
+        STATS_INC(hart, mmio_loads[(addr >> 20) & MASK(8)]);
+        vm_event(hart, RV_EVENT_MMIO);
         /* 256 regions of 1MiB */
         switch ((addr >> 20) & MASK(8)) {
         case 0x0:
@@ -175,6 +356,9 @@ static void mem_load(hart_t *hart,
         case 0x40: /* UART */
             u8250_read(hart, &data->uart, addr & 0xFFFFF, width, value);
             emu_update_uart_interrupts(hart->vm);
+            /* semu_run() joins the hart threads, then the emulator exits */
+            if (unlikely(data->uart.quit))
+                __atomic_store_n(&data->stopped, true, __ATOMIC_RELEASE);
             return;
 #if SEMU_HAS(VIRTIONET)
         case 0x41: /* virtio-net */
@@ -236,19 +420,36 @@ static void mem_load(hart_t *hart,
     vm_set_exception(hart, RV_EXC_LOAD_FAULT, hart->exc_val);
 }
 
-static void mem_store(hart_t *hart,
-                      uint32_t addr,
-                      uint8_t width,
-                      uint32_t value)
+static void mem_load(hart_t *hart,
+                     uint32_t addr,
+                     uint8_t width,
+                     uint32_t *value)
 {
     emu_state_t *data = PRIV(hart);
     /* RAM at 0x00000000 + RAM_SIZE */
     if (addr < RAM_SIZE) {
-        ram_write(hart, data->ram, addr, width, value);
+        ram_read(hart, data->ram, addr, width, value);
         return;
     }
 
+    emu_lock(data);
+    uint32_t ready = emu_io_ready(data);
+    mmio_load(hart, addr, width, value);
+    emu_io_check(data, ready);
+    emu_unlock(data);
+}
+
+static void mmio_store(hart_t *hart,
+                       uint32_t addr,
+                       uint8_t width,
+                       uint32_t value)
+{
+    emu_state_t *data = PRIV(hart);
     if ((addr >> 28) == 0xF) { /* MMIO at 0xF_______ */
+        STATS_INC(hart, mmio_stores[(addr >> 20) & MASK(8)]);
+        vm_event(hart, RV_EVENT_MMIO);
+        if (unlikely(timeline_enabled))
+            timeline_mmio_store(hart, addr, value);
         /* 256 regions of 1MiB */
         switch ((addr >> 20) & MASK(8)) {
         case 0x0:
@@ -280,10 +481,12 @@ static void mem_store(hart_t *hart,
         case 0x44: /* mswi */
             aclint_mswi_write(hart, &data->mswi, addr & 0xFFFFF, width, value);
             aclint_mswi_update_interrupts(hart, &data->mswi);
+            data->preempt = true;
             return;
         case 0x45: /* sswi */
             aclint_sswi_write(hart, &data->sswi, addr & 0xFFFFF, width, value);
             aclint_sswi_update_interrupts(hart, &data->sswi);
+            data->preempt = true;
             return;
 #if SEMU_HAS(VIRTIORNG)
         case 0x46: /* virtio-rng */
@@ -320,6 +523,25 @@ static void mem_store(hart_t *hart,
     vm_set_exception(hart, RV_EXC_STORE_FAULT, hart->exc_val);
 }
 
+static void mem_store(hart_t *hart,
+                      uint32_t addr,
+                      uint8_t width,
+                      uint32_t value)
+{
+    emu_state_t *data = PRIV(hart);
+    /* RAM at 0x00000000 + RAM_SIZE */
+    if (addr < RAM_SIZE) {
+        ram_write(hart, data->ram, addr, width, value);
+        return;
+    }
+
+    emu_lock(data);
+    uint32_t ready = emu_io_ready(data);
+    mmio_store(hart, addr, width, value);
+    emu_io_check(data, ready);
+    emu_unlock(data);
+}
+
 /* SBI */
 #define SBI_IMPL_ID 0x999
 #define SBI_IMPL_VERSION 1
@@ -337,7 +559,7 @@ static inline sbi_ret_t handle_sbi_ecall_TIMER(hart_t *hart, int32_t fid)
         data->mtimer.mtimecmp[hart->mhartid] =
             (((uint64_t) hart->x_regs[RV_R_A1]) << 32) |
             (uint64_t) (hart->x_regs[RV_R_A0]);
-        hart->sip &= ~RV_INT_STI_BIT;
+        aclint_mtimer_rearm(&data->mtimer, hart->mhartid);
         return (sbi_ret_t){SBI_SUCCESS, 0};
     default:
         return (sbi_ret_t){SBI_ERR_NOT_SUPPORTED, 0};
@@ -351,13 +573,43 @@ static inline sbi_ret_t handle_sbi_ecall_RST(hart_t *hart, int32_t fid)
     case SBI_RST__SYSTEM_RESET:
         fprintf(stderr, "system reset: type=%u, reason=%u\n",
                 hart->x_regs[RV_R_A0], hart->x_regs[RV_R_A1]);
-        data->stopped = true;
+        __atomic_store_n(&data->stopped, true, __ATOMIC_RELEASE);
         return (sbi_ret_t){SBI_SUCCESS, 0};
     default:
         return (sbi_ret_t){SBI_ERR_NOT_SUPPORTED, 0};
     }
 }
 
+/* Collect the harts that are not stopped, which the scheduler of semu_step()
+ * takes turns running. Starting or stopping a hart preempts the running one.
+ */
+static void emu_update_runnable(emu_state_t *emu)
+{
+    emu->n_runnable = 0;
+    for (uint32_t i = 0; i < emu->vm.n_hart; i++) {
+        if (emu->vm.hart[i]->hsm_status != SBI_HSM_STATE_STOPPED)
+            emu->runnable[emu->n_runnable++] = emu->vm.hart[i];
+    }
+    emu->preempt = true;
+}
+
+/* Enter S-mode at "pc" with the MMU off and interrupts disabled, as both
+ * starting a hart and resuming it from a non-retentive suspend require.
+ */
+static void emu_hart_enter(hart_t *hart, uint32_t pc, uint32_t opaque)
+{
+    hart->satp = 0;
+    hart->page_table = NULL;
+    vm_flush_tlb(hart);
+    hart->sstatus_sie = 0;
+    hart->x_regs[RV_R_A0] = hart->mhartid;
+    hart->x_regs[RV_R_A1] = opaque;
+    hart->pc = pc;
+    hart->s_mode = true;
+    hart->wfi = false;
+    hart->wrs = false;
+}
+
 static inline sbi_ret_t handle_sbi_ecall_HSM(hart_t *hart, int32_t fid)
 {
     uint32_t hartid, start_addr, opaque, suspend_type, resume_addr;
@@ -367,25 +619,34 @@ static inline sbi_ret_t handle_sbi_ecall_HSM(hart_t *hart, int32_t fid)
         hartid = hart->x_regs[RV_R_A0];
         start_addr = hart->x_regs[RV_R_A1];
         opaque = hart->x_regs[RV_R_A2];
+        if (hartid >= vm->n_hart)
+            return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
+        /* Only a stopped hart may be entered. The caller holds the emulator
+         * lock, so the hart stays stopped until the broadcast below.
+         */
+        if (vm->hart[hartid]->hsm_status != SBI_HSM_STATE_STOPPED)
+            return (sbi_ret_t){SBI_ERR_ALREADY_AVAILABLE, 0};
         vm->hart[hartid]->hsm_status = SBI_HSM_STATE_STARTED;
-        vm->hart[hartid]->satp = 0;
-        vm->hart[hartid]->sstatus_sie = 0;
-        vm->hart[hartid]->x_regs[RV_R_A0] = hartid;
-        vm->hart[hartid]->x_regs[RV_R_A1] = opaque;
-        vm->hart[hartid]->pc = start_addr;
-        vm->hart[hartid]->s_mode = true;
+        emu_hart_enter(vm->hart[hartid], start_addr, opaque);
+        timeline_mark(vm->hart[hartid], "hart-start");
+        emu_update_runnable(PRIV(hart));
+#if SEMU_HAS(SMP_THREADS)
+        pthread_cond_broadcast(&PRIV(hart)->hsm_cond);
+#endif
         return (sbi_ret_t){SBI_SUCCESS, 0};
     case SBI_HSM__HART_STOP:
         hart->hsm_status = SBI_HSM_STATE_STOPPED;
+        emu_update_runnable(PRIV(hart));
         return (sbi_ret_t){SBI_SUCCESS, 0};
     case SBI_HSM__HART_GET_STATUS:
         hartid = hart->x_regs[RV_R_A0];
+        if (hartid >= vm->n_hart)
+            return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
         return (sbi_ret_t){SBI_SUCCESS, vm->hart[hartid]->hsm_status};
     case SBI_HSM__HART_SUSPEND:
         suspend_type = hart->x_regs[RV_R_A0];
         resume_addr = hart->x_regs[RV_R_A1];
         opaque = hart->x_regs[RV_R_A2];
-        hart->hsm_status = SBI_HSM_STATE_SUSPENDED;
         if (suspend_type == 0x00000000) {
             hart->hsm_resume_is_ret = true;
             hart->hsm_resume_pc = hart->pc;
@@ -393,7 +654,11 @@ static inline sbi_ret_t handle_sbi_ecall_HSM(hart_t *hart, int32_t fid)
             hart->hsm_resume_is_ret = false;
             hart->hsm_resume_pc = resume_addr;
             hart->hsm_resume_opaque = opaque;
+        } else {
+            return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
         }
+        /* The hart sleeps like WFI, see emu_resume_hart() */
+        hart->hsm_status = SBI_HSM_STATE_SUSPENDED;
         return (sbi_ret_t){SBI_SUCCESS, 0};
     default:
         return (sbi_ret_t){SBI_ERR_NOT_SUPPORTED, 0};
@@ -409,14 +674,22 @@ static inline sbi_ret_t handle_sbi_ecall_IPI(hart_t *hart, int32_t fid)
     case SBI_IPI__SEND_IPI:
         hart_mask = (uint64_t) hart->x_regs[RV_R_A0];
         hart_mask_base = (uint64_t) hart->x_regs[RV_R_A1];
-        if (hart_mask_base == 0xFFFFFFFFFFFFFFFF) {
+        if (hart_mask_base == UINT32_MAX) {
             for (uint32_t i = 0; i < hart->vm->n_hart; i++)
                 data->sswi.ssip[i] = 1;
         } else {
-            for (int i = hart_mask_base; hart_mask; hart_mask >>= 1, i++)
-                data->sswi.ssip[i] = hart_mask & 1;
+            if (hart_mask_base >= hart->vm->n_hart)
+                return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
+            /* Only raise, as another hart may have sent an IPI meanwhile */
+            for (uint32_t i = hart_mask_base; hart_mask && i < hart->vm->n_hart;
+                 hart_mask >>= 1, i++) {
+                if (hart_mask & 1)
+                    data->sswi.ssip[i] = 1;
+            }
         }
 
+        /* Let the targets run soon, since the caller may wait for them */
+        data->preempt = true;
         return (sbi_ret_t){SBI_SUCCESS, 0};
         break;
     default:
@@ -424,32 +697,24 @@ static inline sbi_ret_t handle_sbi_ecall_IPI(hart_t *hart, int32_t fid)
     }
 }
 
+/* Remote fences are posted to the target harts, the caller included, and
+ * each hart carries out its own before running further (see
+ * emu_handle_rfence()). This keeps a hart from flushing the caches of another
+ * one that may be running on another host thread.
+ */
 static inline sbi_ret_t handle_sbi_ecall_RFENCE(hart_t *hart, int32_t fid)
 {
-    /* TODO: Since the current implementation sequentially emulates
-     * multi-core execution, the implementation of RFENCE extension is not
-     * complete, for example, FENCE.I is currently ignored. To support
-     * multi-threaded system emulation, RFENCE extension has to be implemented
-     * completely.
-     */
     uint64_t hart_mask, hart_mask_base;
+    uint32_t req;
     switch (fid) {
     case 0:
-        return (sbi_ret_t){SBI_SUCCESS, 0};
+        req = RFENCE_FENCE_I;
+        break;
     case 1:
-        hart_mask = (uint64_t) hart->x_regs[RV_R_A0];
-        hart_mask_base = (uint64_t) hart->x_regs[RV_R_A1];
-        if (hart_mask_base == 0xFFFFFFFFFFFFFFFF) {
-            for (uint32_t i = 0; i < hart->vm->n_hart; i++) {
-                hart->vm->hart[i]->cache_fetch.n_pages = 0xFFFFFFFF;
-            }
-        } else {
-            for (int i = hart_mask_base; hart_mask; hart_mask >>= 1, i++) {
-                hart->vm->hart[i]->cache_fetch.n_pages = 0xFFFFFFFF;
-            }
-        }
-        return (sbi_ret_t){SBI_SUCCESS, 0};
     case 2:
+        /* Without ASID support, both flush every translation of the harts */
+        req = RFENCE_SFENCE_VMA;
+        break;
     case 3:
     case 4:
     case 5:
@@ -459,6 +724,163 @@ static inline sbi_ret_t handle_sbi_ecall_RFENCE(hart_t *hart, int32_t fid)
     default:
         return (sbi_ret_t){SBI_ERR_FAILED, 0};
     }
+
+    hart_mask = (uint64_t) hart->x_regs[RV_R_A0];
+    hart_mask_base = (uint64_t) hart->x_regs[RV_R_A1];
+    if (hart_mask_base == UINT32_MAX) {
+        for (uint32_t i = 0; i < hart->vm->n_hart; i++)
+            __atomic_fetch_or(&hart->vm->hart[i]->rfence_pending, req,
+                              __ATOMIC_RELEASE);
+    } else {
+        if (hart_mask_base >= hart->vm->n_hart)
+            return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
+        for (uint32_t i = hart_mask_base; hart_mask && i < hart->vm->n_hart;
+             hart_mask >>= 1, i++) {
+            if (hart_mask & 1)
+                __atomic_fetch_or(&hart->vm->hart[i]->rfence_pending, req,
+                                  __ATOMIC_RELEASE);
+        }
+    }
+#if SEMU_HAS(SMP_THREADS)
+    /* in case a target hart is itself waiting for a fence to complete */
+    pthread_cond_broadcast(&PRIV(hart)->rfence_cond);
+#endif
+    return (sbi_ret_t){SBI_SUCCESS, 0};
+}
+
+/* PMU counters 0 to 2 are cycle, time and instret, which always run, and the
+ * programmable ones of the hart follow.
+ */
+#define SBI_PMU_N_COUNTERS (PMU_FIRST_COUNTER + PMU_N_COUNTERS)
+
+/* Return the emulator event that counts the SBI event, or RV_N_EVENTS if none
+ * does. Raw events number the RV_EVENT_* ones, e.g. "perf stat -e r2" counts
+ * page walks.
+ */
+static uint32_t sbi_pmu_event(uint32_t event_idx, uint64_t event_data)
+{
+    uint32_t code = event_idx & MASK(16);
+    switch ((event_idx >> 16) & MASK(4)) {
+    case SBI_PMU_EVENT_TYPE_HW:
+        if (code == SBI_PMU_HW_CPU_CYCLES || code == SBI_PMU_HW_INSTRUCTIONS)
+            return RV_EVENT_INSTRET;
+        break;
+    case SBI_PMU_EVENT_TYPE_CACHE:
+        if (code == SBI_PMU_HW_CACHE_ITLB_READ_MISS)
+            return RV_EVENT_FETCH_MISS;
+        break;
+    case SBI_PMU_EVENT_TYPE_RAW:
+        if (event_data < RV_N_EVENTS)
+            return event_data;
+        break;
+    }
+    return RV_N_EVENTS;
+}
+
+/* Check that the counters "mask" starting at "base" exist */
+static bool sbi_pmu_valid(uint32_t base, uint32_t mask)
+{
+    return base < SBI_PMU_N_COUNTERS &&
+           !((uint64_t) mask >> (SBI_PMU_N_COUNTERS - base));
+}
+
+static sbi_ret_t sbi_pmu_config_matching(hart_t *hart)
+{
+    uint32_t base = hart->x_regs[RV_R_A0], mask = hart->x_regs[RV_R_A1];
+    uint32_t flags = hart->x_regs[RV_R_A2];
+    uint32_t event = sbi_pmu_event(
+        hart->x_regs[RV_R_A3],
+        hart->x_regs[RV_R_A4] | (uint64_t) hart->x_regs[RV_R_A5] << 32);
+    if (!sbi_pmu_valid(base, mask))
+        return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
+    if (event == RV_N_EVENTS)
+        return (sbi_ret_t){SBI_ERR_NOT_SUPPORTED, 0};
+
+    /* Pick the first free programmable counter, or with SKIP_MATCH the first
+     * one of the mask, which the caller has configured before.
+     */
+    uint32_t idx = SBI_PMU_N_COUNTERS;
+    for (uint32_t i = 0; mask >> i; i++) {
+        uint32_t n = base + i - PMU_FIRST_COUNTER;
+        if (!((mask >> i) & 1) || base + i < PMU_FIRST_COUNTER)
+            continue;
+        if ((flags & SBI_PMU_CFG_FLAG_SKIP_MATCH) ||
+            hart->pmu[n].event == RV_N_EVENTS) {
+            idx = n;
+            break;
+        }
+    }
+    if (idx == SBI_PMU_N_COUNTERS)
+        return (sbi_ret_t){SBI_ERR_NOT_SUPPORTED, 0};
+
+    if (!(flags & SBI_PMU_CFG_FLAG_SKIP_MATCH))
+        vm_pmu_configure(hart, idx, event);
+    if (flags & SBI_PMU_CFG_FLAG_CLEAR_VALUE)
+        vm_pmu_write(hart, idx, 0);
+    if (flags & SBI_PMU_CFG_FLAG_AUTO_START)
+        vm_pmu_start(hart, idx);
+    return (sbi_ret_t){SBI_SUCCESS, PMU_FIRST_COUNTER + idx};
+}
+
+static sbi_ret_t sbi_pmu_start_stop(hart_t *hart, bool start)
+{
+    uint32_t base = hart->x_regs[RV_R_A0], mask = hart->x_regs[RV_R_A1];
+    uint32_t flags = hart->x_regs[RV_R_A2];
+    uint64_t value =
+        hart->x_regs[RV_R_A3] | (uint64_t) hart->x_regs[RV_R_A4] << 32;
+    if (!sbi_pmu_valid(base, mask))
+        return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
+
+    sbi_ret_t ret = {SBI_SUCCESS, 0};
+    for (uint32_t i = 0; mask >> i; i++) {
+        if (!((mask >> i) & 1))
+            continue;
+        /* the fixed counters keep running */
+        if (base + i < PMU_FIRST_COUNTER)
+            continue;
+
+        uint32_t n = base + i - PMU_FIRST_COUNTER;
+        if (start && hart->pmu[n].event == RV_N_EVENTS)
+            return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
+        if (hart->pmu[n].running == start)
+            ret.error =
+                start ? SBI_ERR_ALREADY_STARTED : SBI_ERR_ALREADY_STOPPED;
+
+        if (start) {
+            if (flags & SBI_PMU_START_FLAG_SET_INIT_VALUE)
+                vm_pmu_write(hart, n, value);
+            vm_pmu_start(hart, n);
+        } else if (flags & SBI_PMU_STOP_FLAG_RESET) {
+            vm_pmu_configure(hart, n, RV_N_EVENTS);
+        } else {
+            vm_pmu_stop(hart, n);
+        }
+    }
+    return ret;
+}
+
+static inline sbi_ret_t handle_sbi_ecall_PMU(hart_t *hart, int32_t fid)
+{
+    uint32_t idx = hart->x_regs[RV_R_A0];
+    switch (fid) {
+    case SBI_PMU__NUM_COUNTERS:
+        return (sbi_ret_t){SBI_SUCCESS, SBI_PMU_N_COUNTERS};
+    case SBI_PMU__COUNTER_GET_INFO:
+        if (idx >= SBI_PMU_N_COUNTERS)
+            return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
+        /* a 64-bit hardware counter, read through its CSR */
+        return (sbi_ret_t){SBI_SUCCESS, (RV_CSR_CYCLE + idx) | (63 << 12)};
+    case SBI_PMU__COUNTER_CONFIG_MATCHING:
+        return sbi_pmu_config_matching(hart);
+    case SBI_PMU__COUNTER_START:
+        return sbi_pmu_start_stop(hart, true);
+    case SBI_PMU__COUNTER_STOP:
+        return sbi_pmu_start_stop(hart, false);
+    case SBI_PMU__COUNTER_FW_READ: /* there are no firmware counters */
+        return (sbi_ret_t){SBI_ERR_INVALID_PARAM, 0};
+    default:
+        return (sbi_ret_t){SBI_ERR_NOT_SUPPORTED, 0};
+    }
 }
 
 #define RV_MVENDORID 0x12345678
@@ -484,7 +906,8 @@ static inline sbi_ret_t handle_sbi_ecall_BASE(hart_t *hart, int32_t fid)
         int32_t eid = (int32_t) hart->x_regs[RV_R_A0];
         bool available = eid == SBI_EID_BASE || eid == SBI_EID_TIMER ||
                          eid == SBI_EID_RST || eid == SBI_EID_HSM ||
-                         eid == SBI_EID_IPI || eid == SBI_EID_RFENCE;
+                         eid == SBI_EID_IPI || eid == SBI_EID_RFENCE ||
+                         eid == SBI_EID_PMU || eid == SBI_EID_SEMU;
         return (sbi_ret_t){SBI_SUCCESS, available};
     }
     default:
@@ -492,8 +915,25 @@ static inline sbi_ret_t handle_sbi_ecall_BASE(hart_t *hart, int32_t fid)
     }
 }
 
-#define SBI_HANDLE(TYPE) \
-    ret = handle_sbi_ecall_##TYPE(hart, hart->x_regs[RV_R_A6])
+static inline sbi_ret_t handle_sbi_ecall_SEMU(hart_t *hart, int32_t fid)
+{
+    switch (fid) {
+    case SBI_SEMU__FORK_SERVER:
+        if (!forkserver_request(hart))
+            return (sbi_ret_t){SBI_ERR_DENIED, 0};
+        /* Clone from the instruction after the call */
+        hart->yield = true;
+        return (sbi_ret_t){SBI_SUCCESS, 0};
+    default:
+        return (sbi_ret_t){SBI_ERR_NOT_SUPPORTED, 0};
+    }
+}
+
+#define SBI_HANDLE(TYPE)                                           \
+    do {                                                           \
+        STATS_INC(hart, sbi_calls[STATS_SBI_##TYPE]);              \
+        ret = handle_sbi_ecall_##TYPE(hart, hart->x_regs[RV_R_A6]); \
+    } while (0)
 
 static void handle_sbi_ecall(hart_t *hart)
 {
@@ -517,7 +957,14 @@ static void handle_sbi_ecall(hart_t *hart)
     case SBI_EID_RFENCE:
         SBI_HANDLE(RFENCE);
         break;
+    case SBI_EID_PMU:
+        SBI_HANDLE(PMU);
+        break;
+    case SBI_EID_SEMU:
+        SBI_HANDLE(SEMU);
+        break;
     default:
+        STATS_INC(hart, sbi_calls[STATS_SBI_OTHER]);
         ret = (sbi_ret_t){SBI_ERR_NOT_SUPPORTED, 0};
     }
     hart->x_regs[RV_R_A0] = (uint32_t) ret.error;
@@ -578,11 +1025,33 @@ static void map_file(char **ram_loc, const char *name)
     close(fd);
 }
 
+/* Write out the profile, the statistics and the boot timeline, also when the
+ * emulator exits from the UART, see uart.c. With a thread per hart, that only
+ * happens once semu_run() has joined them, so nothing updates these anymore.
+ */
+static emu_state_t *exit_emu;
+static void emu_at_exit(void)
+{
+#if SEMU_HAS(PROFILER)
+    profile_write(&exit_emu->profile);
+#endif
+#if SEMU_HAS(STATS)
+    stats_dump(&exit_emu->vm);
+#endif
+    timeline_write();
+}
+
 static void usage(const char *execpath)
 {
     fprintf(
         stderr,
-        "Usage: %s -k linux-image [-b dtb] [-i initrd-image] [-d disk-image]\n",
+        "Usage: %s -k linux-image [-b dtb] [-i initrd-image] [-d disk-image]\n"
+        "       [-p folded-stacks [--profile-symbols System.map]...\n"
+        "        [--profile-interval instructions]] [--stats stats-file]\n"
+        "       [--timeline timeline-file [--timeline-marker string]]\n"
+        "       [--snapshot-save file [--snapshot-marker string]]\n"
+        "       [--snapshot-load file]\n"
+        "       [--fork-server socket [--fork-server-marker string]]\n",
         execpath);
 }
 
@@ -594,9 +1063,19 @@ static void handle_options(int argc,
                            char **disk_file,
                            char **net_dev,
                            int *hart_count,
-                           bool *debug)
+                           bool *debug,
+                           profile_config_t *profile,
+                           char **stats_file,
+                           timeline_config_t *timeline,
+                           snapshot_config_t *snapshot,
+                           forkserver_config_t *forkserver)
 {
     *kernel_file = *dtb_file = *initrd_file = *disk_file = *net_dev = NULL;
+    *stats_file = NULL;
+    memset(profile, 0, sizeof(*profile));
+    memset(timeline, 0, sizeof(*timeline));
+    memset(snapshot, 0, sizeof(*snapshot));
+    memset(forkserver, 0, sizeof(*forkserver));
 
     int optidx = 0;
     struct option opts[] = {
@@ -604,10 +1083,16 @@ static void handle_options(int argc,
         {"initrd", 1, NULL, 'i'},  {"disk", 1, NULL, 'd'},
         {"netdev", 1, NULL, 'n'},  {"smp", 1, NULL, 'c'},
         {"gdbstub", 0, NULL, 'g'}, {"help", 0, NULL, 'h'},
+        {"profile", 1, NULL, 'p'}, {"profile-symbols", 1, NULL, 'S'},
+        {"profile-interval", 1, NULL, 'I'}, {"stats", 1, NULL, 'T'},
+        {"timeline", 1, NULL, 'L'}, {"timeline-marker", 1, NULL, 'M'},
+        {"snapshot-save", 1, NULL, 'W'}, {"snapshot-marker", 1, NULL, 'E'},
+        {"snapshot-load", 1, NULL, 'R'}, {"fork-server", 1, NULL, 'F'},
+        {"fork-server-marker", 1, NULL, 'O'},
     };
 
     int c;
-    while ((c = getopt_long(argc, argv, "k:b:i:d:n:c:gh", opts, &optidx)) !=
+    while ((c = getopt_long(argc, argv, "k:b:i:d:n:c:p:gh", opts, &optidx)) !=
            -1) {
         switch (c) {
         case 'k':
@@ -631,6 +1116,44 @@ static void handle_options(int argc,
         case 'g':
             *debug = true;
             break;
+        case 'p':
+            profile->out = optarg;
+            break;
+        case 'S':
+            if (profile->n_symbols == PROFILE_MAX_SYMBOL_FILES) {
+                fprintf(stderr, "At most %d symbol files can be given.\n",
+                        PROFILE_MAX_SYMBOL_FILES);
+                exit(2);
+            }
+            profile->symbols[profile->n_symbols++] = optarg;
+            break;
+        case 'I':
+            profile->interval = atoi(optarg);
+            break;
+        case 'T':
+            *stats_file = optarg;
+            break;
+        case 'L':
+            timeline->out = optarg;
+            break;
+        case 'M':
+            timeline->marker = optarg;
+            break;
+        case 'W':
+            snapshot->save = optarg;
+            break;
+        case 'E':
+            snapshot->marker = optarg;
+            break;
+        case 'R':
+            snapshot->load = optarg;
+            break;
+        case 'F':
+            forkserver->socket = optarg;
+            break;
+        case 'O':
+            forkserver->marker = optarg;
+            break;
         case 'h':
             usage(argv[0]);
             exit(0);
@@ -639,7 +1162,7 @@ static void handle_options(int argc,
         }
     }
 
-    if (!*kernel_file) {
+    if (!*kernel_file && !snapshot->load) {
         fprintf(stderr,
                 "Linux kernel image file must "
                 "be provided via -k option.\n");
@@ -647,6 +1170,33 @@ static void handle_options(int argc,
         exit(2);
     }
 
+#if !SEMU_HAS(PROFILER)
+    if (profile->out) {
+        fprintf(stderr, "This build does not support profiling.\n");
+        exit(2);
+    }
+#endif
+#if !SEMU_HAS(STATS)
+    if (*stats_file) {
+        fprintf(stderr, "This build does not collect statistics.\n");
+        exit(2);
+    }
+#endif
+    /* Saving needs every hart to stop between two steps, see semu_run() */
+    if (snapshot->save && (SEMU_HAS(SMP_THREADS) || *debug)) {
+        fprintf(stderr,
+                "Snapshots are only saved by single-threaded builds and "
+                "without the gdbstub.\n");
+        exit(2);
+    }
+    /* So does forking, which only keeps the calling thread */
+    if (forkserver->socket && (SEMU_HAS(SMP_THREADS) || *debug)) {
+        fprintf(stderr,
+                "The fork server only runs in single-threaded builds and "
+                "without the gdbstub.\n");
+        exit(2);
+    }
+
     if (!*dtb_file)
         *dtb_file = "minimal.dtb";
 
@@ -663,6 +1213,7 @@ static void handle_options(int argc,
         hart->mem_load = mem_load;                \
         hart->mem_store = mem_store;              \
         hart->mem_page_table = mem_page_table;    \
+        hart->mem_ram_page = mem_page_table;      \
         hart->s_mode = true;                      \
         hart->hsm_status = SBI_HSM_STATE_STOPPED; \
         vm_init(hart);                            \
@@ -677,9 +1228,15 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
     char *netdev;
     int hart_count = 1;
     bool debug = false;
+    profile_config_t profile;
+    char *stats_file;
+    timeline_config_t timeline;
+    snapshot_config_t snapshot;
+    forkserver_config_t forkserver;
     vm_t *vm = &emu->vm;
     handle_options(argc, argv, &kernel_file, &dtb_file, &initrd_file,
-                   &disk_file, &netdev, &hart_count, &debug);
+                   &disk_file, &netdev, &hart_count, &debug, &profile,
+                   &stats_file, &timeline, &snapshot, &forkserver);
 
     /* Initialize the emulator */
     memset(emu, 0, sizeof(*emu));
@@ -700,25 +1257,34 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
      * *----------------*----------------*-------*
      */
     char *ram_loc = (char *) emu->ram;
-    /* Load Linux kernel image */
-    map_file(&ram_loc, kernel_file);
     /* Load at last 1 MiB to prevent kernel from overwriting it */
     uint32_t dtb_addr = RAM_SIZE - DTB_SIZE; /* Device tree */
-    ram_loc = ((char *) emu->ram) + dtb_addr;
-    map_file(&ram_loc, dtb_file);
-    /* Load optional initrd image at last 8 MiB before the dtb region to
-     * prevent kernel from overwritting it
-     */
-    if (initrd_file) {
-        uint32_t initrd_addr = dtb_addr - INITRD_SIZE; /* Init RAM disk */
-        ram_loc = ((char *) emu->ram) + initrd_addr;
-        map_file(&ram_loc, initrd_file);
+    /* A snapshot brings its own RAM */
+    if (!snapshot.load) {
+        /* Load Linux kernel image */
+        map_file(&ram_loc, kernel_file);
+        ram_loc = ((char *) emu->ram) + dtb_addr;
+        map_file(&ram_loc, dtb_file);
+        /* Load optional initrd image at last 8 MiB before the dtb region to
+         * prevent kernel from overwritting it
+         */
+        if (initrd_file) {
+            uint32_t initrd_addr = dtb_addr - INITRD_SIZE; /* Init RAM disk */
+            ram_loc = ((char *) emu->ram) + initrd_addr;
+            map_file(&ram_loc, initrd_file);
+        }
     }
 
     /* Hook for unmapping files */
     atexit(unmap_files);
 
     /* Set up RISC-V harts */
+    vm->n_pages = RAM_SIZE / RV_PAGE_SIZE;
+    vm->page_gen = calloc(vm->n_pages, sizeof(uint32_t));
+    if (!vm->page_gen) {
+        fprintf(stderr, "Failed to allocate code page state.\n");
+        return 1;
+    }
     vm->n_hart = hart_count;
     vm->hart = malloc(sizeof(hart_t *) * vm->n_hart);
     for (uint32_t i = 0; i < vm->n_hart; i++) {
@@ -730,6 +1296,7 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
         INIT_HART(newhart, emu, i);
         newhart->x_regs[RV_R_A0] = i;
         newhart->x_regs[RV_R_A1] = dtb_addr;
+        newhart->single_step = debug;
         if (i == 0)
             newhart->hsm_status = SBI_HSM_STATE_STARTED;
 
@@ -737,6 +1304,25 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
         vm->hart[i] = newhart;
     }
 
+#if SEMU_HAS(PROFILER)
+    if (profile_init(&emu->profile, &profile, vm->n_hart)) {
+        fprintf(stderr, "Failed to set up the profiler.\n");
+        return 1;
+    }
+#endif
+#if SEMU_HAS(STATS)
+    if (stats_init(stats_file))
+        return 1;
+#endif
+    if (timeline_init(&timeline, vm))
+        return 1;
+    if (snapshot_init(&snapshot))
+        return 1;
+    if (forkserver_init(&forkserver))
+        return 1;
+    exit_emu = emu;
+    atexit(emu_at_exit);
+
     /* Set up peripherals */
     emu->uart.in_fd = 0, emu->uart.out_fd = 1;
     capture_keyboard_input(); /* set up uart */
@@ -754,8 +1340,12 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
     virtio_rng_init();
 #endif
     /* Set up ACLINT */
-    semu_timer_init(&emu->mtimer.mtime, CLOCK_FREQ, hart_count);
+    semu_timer_init(&emu->mtimer.mtime, CLOCK_FREQ);
     emu->mtimer.mtimecmp = calloc(vm->n_hart, sizeof(uint64_t));
+    emu->mtimer.next_check = calloc(vm->n_hart, sizeof(uint64_t));
+    emu->runnable = calloc(vm->n_hart, sizeof(hart_t *));
+    emu_update_runnable(emu);
+    emu->boot_progress = calloc(vm->n_hart, sizeof(uint64_t));
     emu->mswi.msip = calloc(vm->n_hart, sizeof(uint32_t));
     emu->sswi.ssip = calloc(vm->n_hart, sizeof(uint32_t));
 #if SEMU_HAS(VIRTIOSND)
@@ -783,127 +1373,551 @@ static int semu_init(emu_state_t *emu, int argc, char **argv)
 
     emu->peripheral_update_ctr = 0;
     emu->debug = debug;
+#if SEMU_HAS(SMP_THREADS)
+    pthread_mutex_init(&emu->lock, NULL);
+    pthread_cond_init(&emu->hsm_cond, NULL);
+    pthread_cond_init(&emu->rfence_cond, NULL);
+    pthread_cond_init(&emu->wfi_cond, NULL);
+#endif
+
+    if (snapshot.load) {
+        if (snapshot_load(emu, snapshot.load))
+            return 1;
+        emu_update_runnable(emu);
+    }
+
+    if (!emu_io_init(emu))
+        return 1;
 
     return 0;
 }
 
-static int semu_step(emu_state_t *emu)
+/* Serve the devices whose host side the I/O thread found ready, and raise
+ * their pending interrupts
+ */
+static void emu_update_peripherals(emu_state_t *emu)
 {
     vm_t *vm = &emu->vm;
+    uint32_t ready = emu_io_ready(emu);
 
-    /* TODO: Add support for multi-threaded system emulation after the
-     * RFENCE extension is completely implemented.
-     */
-    for (uint32_t i = 0; i < vm->n_hart; i++) {
-        if (emu->peripheral_update_ctr-- == 0) {
-            emu->peripheral_update_ctr = 64;
-
-            u8250_check_ready(&emu->uart);
-            if (emu->uart.in_ready)
-                emu_update_uart_interrupts(vm);
+    if (ready & IO_UART_IN)
+        emu_update_uart_interrupts(vm);
 
 #if SEMU_HAS(VIRTIONET)
-            virtio_net_refresh_queue(&emu->vnet);
-            if (emu->vnet.InterruptStatus)
-                emu_update_vnet_interrupts(vm);
+    virtio_net_refresh_queue(&emu->vnet);
+    if (emu->vnet.InterruptStatus)
+        emu_update_vnet_interrupts(vm);
 #endif
 
 #if SEMU_HAS(VIRTIOBLK)
-            if (emu->vblk.InterruptStatus)
-                emu_update_vblk_interrupts(vm);
+    if (emu->vblk.InterruptStatus)
+        emu_update_vblk_interrupts(vm);
 #endif
 
 #if SEMU_HAS(VIRTIOSND)
-            if (emu->vsnd.InterruptStatus)
-                emu_update_vsnd_interrupts(vm);
+    if (emu->vsnd.InterruptStatus)
+        emu_update_vsnd_interrupts(vm);
 #endif
 
 #if SEMU_HAS(VIRTIOGPU)
-            if (emu->vgpu.InterruptStatus)
-                emu_update_vgpu_interrupts(vm);
+    if (emu->vgpu.InterruptStatus)
+        emu_update_vgpu_interrupts(vm);
 #endif
 
 #if SEMU_HAS(VIRTIOINPUT)
-            if (emu->vkeyboard.InterruptStatus)
-                emu_update_vinput_keyboard_interrupts(vm);
+    if (emu->vkeyboard.InterruptStatus)
+        emu_update_vinput_keyboard_interrupts(vm);
 
-            if (emu->vmouse.InterruptStatus)
-                emu_update_vinput_mouse_interrupts(vm);
+    if (emu->vmouse.InterruptStatus)
+        emu_update_vinput_mouse_interrupts(vm);
 #endif
 
 #if SEMU_HAS(VIRGL)
-            semu_virgl_fence_poll();
+    semu_virgl_fence_poll();
 #endif
+
+#if SEMU_HAS(STATS)
+    if (unlikely(stats_requested()))
+        stats_dump(vm);
+#endif
+
+    emu_io_check(emu, ready);
+}
+
+/* Carry out the remote fences posted to the hart. The bits are only cleared
+ * afterwards, since the requesting hart may be waiting for that.
+ */
+static void emu_handle_rfence(hart_t *hart)
+{
+    uint32_t req = __atomic_load_n(&hart->rfence_pending, __ATOMIC_ACQUIRE);
+    if (likely(!req))
+        return;
+
+    if (req & RFENCE_FENCE_I)
+        vm_flush_blocks(hart);
+    if (req & RFENCE_SFENCE_VMA)
+        vm_flush_tlb(hart);
+    __atomic_fetch_and(&hart->rfence_pending, ~req, __ATOMIC_RELEASE);
+
+#if SEMU_HAS(SMP_THREADS)
+    emu_state_t *emu = PRIV(hart);
+    emu_lock(emu);
+    pthread_cond_broadcast(&emu->rfence_cond);
+    emu_unlock(emu);
+#endif
+}
+
+#if SEMU_HAS(SMP_THREADS)
+/* Wait until the other started harts have carried out the remote fences
+ * posted to them. Meanwhile, keep serving the fences posted to this hart, so
+ * that two harts fencing each other cannot deadlock.
+ */
+static void emu_wait_rfence(hart_t *hart)
+{
+    emu_state_t *emu = PRIV(hart);
+    emu_lock(emu);
+    for (uint32_t i = 0; i < hart->vm->n_hart; i++) {
+        hart_t *target = hart->vm->hart[i];
+        while (__atomic_load_n(&target->rfence_pending, __ATOMIC_ACQUIRE) &&
+               target->hsm_status == SBI_HSM_STATE_STARTED &&
+               !emu_stopped(emu)) {
+            if (__atomic_load_n(&hart->rfence_pending, __ATOMIC_ACQUIRE)) {
+                emu_unlock(emu);
+                emu_handle_rfence(hart);
+                emu_lock(emu);
+                continue;
+            }
+            pthread_cond_wait(&emu->rfence_cond, &emu->lock);
         }
+    }
+    emu_unlock(emu);
+}
+#endif
 
-        emu_update_timer_interrupt(vm->hart[i]);
-        emu_update_swi_interrupt(vm->hart[i]);
+/* Idle harts are left alone for at most this long, which bounds the latency
+ * of devices that cannot be waited for, such as those served by their own
+ * host threads.
+ */
+#define EMU_IDLE_MAX_MS 10
 
-        vm_step(vm->hart[i]);
-        if (likely(!vm->hart[i]->error))
-            continue;
+/* Return true if the hart has nothing to run until an interrupt arrives or
+ * another hart starts it.
+ */
+static bool emu_hart_idle(hart_t *hart)
+{
+    switch (__atomic_load_n(&hart->hsm_status, __ATOMIC_RELAXED)) {
+    case SBI_HSM_STATE_STARTED:
+        return (hart->wfi && !vm_interrupt_pending(hart)) ||
+               vm_wrs_stalled(hart);
+    case SBI_HSM_STATE_SUSPENDED:
+        return !vm_interrupt_pending(hart);
+    default:
+        return true;
+    }
+}
+
+/* Resume a suspended hart once an interrupt is pending. Retentive suspend
+ * returns from the SBI call, non-retentive suspend restarts the hart at the
+ * resume address.
+ */
+static void emu_resume_hart(hart_t *hart)
+{
+    hart->hsm_status = SBI_HSM_STATE_STARTED;
+    if (!hart->hsm_resume_is_ret)
+        emu_hart_enter(hart, hart->hsm_resume_pc, hart->hsm_resume_opaque);
+}
+
+/* Return the host time in nanoseconds until the timer interrupt of the idle
+ * hart, capped at EMU_IDLE_MAX_MS.
+ */
+static uint64_t emu_timer_wait_ns(hart_t *hart)
+{
+    emu_state_t *emu = PRIV(hart);
+    uint64_t wait = EMU_IDLE_MAX_MS * 1000000ULL;
+    if (hart->hsm_status == SBI_HSM_STATE_STOPPED ||
+        !(hart->sie & RV_INT_STI_BIT))
+        return wait;
+
+    uint64_t freq = emu->mtimer.mtime.freq;
+    uint64_t now = semu_timer_get(&emu->mtimer.mtime);
+    uint64_t cmp = emu->mtimer.mtimecmp[hart->mhartid];
+    if (cmp <= now)
+        return 0;
+    uint64_t ticks = cmp - now < freq ? cmp - now : freq;
+    uint64_t ns = (ticks * 1000000000ULL + freq - 1) / freq;
+    return ns < wait ? ns : wait;
+}
 
-        if (vm->hart[i]->error == ERR_EXCEPTION &&
-            vm->hart[i]->exc_cause == RV_EXC_ECALL_S) {
-            handle_sbi_ecall(vm->hart[i]);
+/* Sleep until the I/O thread finds the host side of a device ready, or for at
+ * most "timeout_ms" milliseconds.
+ */
+static void emu_wait_io(emu_state_t *emu, int timeout_ms)
+{
+    struct pollfd pfd = {emu->io_notify[0], POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) > 0)
+        emu_io_drain(emu->io_notify[0]);
+}
+
+/* Return true if a device interrupt is waking up a hart other than "hart", or
+ * "hart" has released another one from WRS, e.g. by unlocking a spinlock.
+ */
+static bool emu_wakes_other(emu_state_t *emu, hart_t *hart)
+{
+    for (uint32_t i = 0; i < emu->n_runnable; i++) {
+        hart_t *other = emu->runnable[i];
+        if (other == hart)
             continue;
+        if ((other->wfi ||
+             other->hsm_status == SBI_HSM_STATE_SUSPENDED) &&
+            vm_interrupt_pending(other))
+            return true;
+        if (other->wrs && !vm_wrs_stalled(other))
+            return true;
+    }
+    return false;
+}
+
+/* Run the next block of the hart and handle the exception it stopped at, if
+ * any. Return nonzero on an emulation error.
+ */
+static int semu_step_hart(hart_t *hart)
+{
+    emu_state_t *emu = PRIV(hart);
+
+    emu_handle_rfence(hart);
+    /* An idle hart retires nothing, so it checks its timer on every step */
+    bool idle = hart->wfi || hart->wrs ||
+                hart->hsm_status == SBI_HSM_STATE_SUSPENDED;
+    if (idle || aclint_mtimer_check_due(hart, &emu->mtimer))
+        emu_update_timer_interrupt(hart);
+    emu_update_swi_interrupt(hart);
+
+    if (unlikely(hart->hsm_status == SBI_HSM_STATE_SUSPENDED) &&
+        vm_interrupt_pending(hart)) {
+        emu_lock(emu);
+        emu_resume_hart(hart);
+        emu_unlock(emu);
+    }
+
+#if SEMU_HAS(PROFILER)
+    if (unlikely(profile_due(&emu->profile, hart)))
+        profile_sample(&emu->profile, hart);
+#endif
+
+    bool booting = !boot_complete;
+    uint32_t satp = hart->satp;
+    uint64_t instret = hart->instret;
+    vm_step(hart);
+
+    if (unlikely(booting)) {
+        /* CSR writes and SRET end the block, so the step that turns on the
+         * MMU or enters U-mode ends with it.
+         */
+        if (unlikely(timeline_enabled)) {
+            if (!satp && hart->satp)
+                timeline_mark(hart, "mmu-on");
+            if (boot_complete)
+                timeline_boot_complete(hart);
         }
 
-        if (vm->hart[i]->error == ERR_EXCEPTION) {
-            hart_trap(vm->hart[i]);
-            continue;
+        /* Until the boot completes, time advances with the instructions the
+         * harts retire. Idle harts count each step as one instruction, so that
+         * time also passes while every hart waits for it.
+         */
+        if (!boot_complete) {
+            emu->boot_progress[hart->mhartid] +=
+                idle ? 1 : hart->instret - instret;
+            semu_timer_boot_progress(emu->boot_progress[hart->mhartid]);
         }
+    }
 
-        vm_error_report(vm->hart[i]);
-        return 2;
+    if (likely(!hart->error))
+        return 0;
+
+    if (hart->error == ERR_EXCEPTION && hart->exc_cause == RV_EXC_ECALL_S) {
+        emu_lock(emu);
+        handle_sbi_ecall(hart);
+        emu_unlock(emu);
+#if SEMU_HAS(SMP_THREADS)
+        if (hart->x_regs[RV_R_A7] == SBI_EID_RFENCE && !emu->debug)
+            emu_wait_rfence(hart);
+#endif
+        return 0;
+    }
+
+    if (hart->error == ERR_EXCEPTION) {
+        hart_trap(hart);
+        return 0;
+    }
+
+    vm_error_report(hart);
+    return 2;
+}
+
+#ifndef HART_QUANTUM
+#define HART_QUANTUM 1024
+#endif
+
+/* Give every runnable hart a turn. A hart runs for up to HART_QUANTUM
+ * instructions, which keeps its state hot in the host caches, but yields
+ * early once it goes idle, spins on PAUSE or may have woken up another hart.
+ * In debug mode, each turn is a single step.
+ */
+static int semu_step(emu_state_t *emu)
+{
+    for (uint32_t i = 0; i < emu->n_runnable; i++) {
+        hart_t *hart = emu->runnable[i];
+        uint64_t end = hart->instret + HART_QUANTUM;
+
+        emu->preempt = false;
+        do {
+            if (emu->peripheral_update_ctr-- == 0) {
+                emu->peripheral_update_ctr = 64;
+                emu_update_peripherals(emu);
+                emu->preempt |= emu_wakes_other(emu, hart);
+            }
+
+            int ret = semu_step_hart(hart);
+            if (ret)
+                return ret;
+        } while (!emu->debug && hart->instret < end && !emu->preempt &&
+                 !hart->yield && !emu_hart_idle(hart) && !emu->stopped);
+        hart->yield = false;
     }
 
     return 0;
 }
 
+#if SEMU_HAS(SMP_THREADS)
+/* Sleep while the hart is idle. Its timer is checked when it is due, and
+ * everything else that may wake the hart happens with the emulator lock held,
+ * which wakes it up on release.
+ */
+static void emu_park_hart(hart_t *hart)
+{
+    emu_state_t *emu = PRIV(hart);
+
+    emu_lock(emu);
+    emu->n_parked++;
+    while (!emu_stopped(emu) &&
+           !__atomic_load_n(&hart->rfence_pending, __ATOMIC_ACQUIRE)) {
+        emu_update_timer_interrupt(hart);
+        emu_update_swi_interrupt(hart);
+        if (!emu_hart_idle(hart))
+            break;
+
+        uint64_t wait = emu_timer_wait_ns(hart);
+        if (!wait)
+            break;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        wait += ts.tv_nsec;
+        ts.tv_sec += wait / 1000000000;
+        ts.tv_nsec = wait % 1000000000;
+        pthread_cond_timedwait(&emu->wfi_cond, &emu->lock, &ts);
+    }
+    emu->n_parked--;
+    emu_unlock(emu);
+}
+
+/* Return true if every hart is either stopped or parked. The caller holds the
+ * emulator lock.
+ */
+static bool emu_all_parked(emu_state_t *emu)
+{
+    uint32_t n = emu->n_parked;
+    for (uint32_t i = 0; i < emu->vm.n_hart; i++) {
+        if (emu->vm.hart[i]->hsm_status == SBI_HSM_STATE_STOPPED)
+            n++;
+    }
+    return n == emu->vm.n_hart;
+}
+
+static void *semu_hart_thread(void *arg)
+{
+    hart_t *hart = (hart_t *) arg;
+    emu_state_t *emu = PRIV(hart);
+
+    while (!emu_stopped(emu)) {
+        if (unlikely(__atomic_load_n(&hart->hsm_status, __ATOMIC_RELAXED) ==
+                     SBI_HSM_STATE_STOPPED)) {
+            /* Sleep until another hart starts this one */
+            emu_handle_rfence(hart);
+            emu_lock(emu);
+            while (hart->hsm_status == SBI_HSM_STATE_STOPPED &&
+                   !emu_stopped(emu))
+                pthread_cond_wait(&emu->hsm_cond, &emu->lock);
+            emu_unlock(emu);
+            continue;
+        }
+
+        if (unlikely(semu_step_hart(hart))) {
+            emu_lock(emu);
+            emu->exit_code = 2;
+            __atomic_store_n(&emu->stopped, true, __ATOMIC_RELEASE);
+            emu_unlock(emu);
+        }
+
+        /* Stores that end WRS do not take the emulator lock, so a stalled hart
+         * keeps polling for them, handing its host CPU over in between.
+         */
+        if (vm_wrs_stalled(hart))
+            sched_yield();
+        /* Before the boot completes, time only advances as harts run */
+        else if (boot_complete && emu_hart_idle(hart))
+            emu_park_hart(hart);
+    }
+    return NULL;
+}
+
+/* Run every hart on its own host thread. The main thread is left to poll the
+ * host side of the devices, which the harts would otherwise do in between
+ * instructions.
+ */
+static int semu_run(emu_state_t *emu)
+{
+    vm_t *vm = &emu->vm;
+    pthread_t *threads = calloc(vm->n_hart, sizeof(pthread_t));
+    if (!threads) {
+        fprintf(stderr, "Failed to allocate hart threads.\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < vm->n_hart; i++) {
+        if (pthread_create(&threads[i], NULL, semu_hart_thread, vm->hart[i])) {
+            fprintf(stderr, "Failed to create the thread of hart #%u.\n", i);
+            exit(1);
+        }
+    }
+
+    while (!emu_stopped(emu)) {
+        emu_lock(emu);
+        emu_update_peripherals(emu);
+        int timeout = emu_all_parked(emu) ? EMU_IDLE_MAX_MS : 1;
+        emu_unlock(emu);
+        emu_wait_io(emu, timeout);
+    }
+
+    /* Wake up the waiting harts so that their threads can exit */
+    emu_lock(emu);
+    pthread_cond_broadcast(&emu->hsm_cond);
+    pthread_cond_broadcast(&emu->rfence_cond);
+    pthread_cond_broadcast(&emu->wfi_cond);
+    emu_unlock(emu);
+    for (uint32_t i = 0; i < vm->n_hart; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    return emu->exit_code;
+}
+#else
+static bool emu_all_idle(emu_state_t *emu)
+{
+    for (uint32_t i = 0; i < emu->vm.n_hart; i++) {
+        if (!emu_hart_idle(emu->vm.hart[i]))
+            return false;
+    }
+    return true;
+}
+
+/* Sleep on the host until the next timer interrupt of an idle hart or input
+ * from a device, whichever comes first.
+ */
+static void emu_idle_wait(emu_state_t *emu)
+{
+    uint64_t wait = UINT64_MAX;
+    for (uint32_t i = 0; i < emu->vm.n_hart; i++) {
+        uint64_t ns = emu_timer_wait_ns(emu->vm.hart[i]);
+        if (ns < wait)
+            wait = ns;
+    }
+    if (!wait)
+        return;
+
+    emu_wait_io(emu, (wait + 999999) / 1000000);
+    emu_update_peripherals(emu);
+
+    /* With every hart idle, only a device may write the words that harts in
+     * WRS watch, which does not invalidate their reservations. Time them out.
+     */
+    for (uint32_t i = 0; i < emu->vm.n_hart; i++)
+        emu->vm.hart[i]->wrs = false;
+}
+
+/* Serve clones of the machine, see forkserver.h. Only returns in a clone,
+ * after giving it a console, I/O thread and network backend of its own.
+ */
+static void emu_fork_server(emu_state_t *emu)
+{
+    vm_t *vm = &emu->vm;
+
+    /* The guest time stands still while the server waits for clients */
+    uint64_t *time = calloc(vm->n_hart + 1, sizeof(uint64_t));
+    if (!time) {
+        fprintf(stderr, "Failed to allocate the fork server state.\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < vm->n_hart; i++)
+        time[i] = semu_timer_get(&vm->hart[i]->time);
+    time[vm->n_hart] = semu_timer_get(&emu->mtimer.mtime);
+
+    /* Let Ctrl-c stop the server */
+    reset_keyboard_input();
+    int console = forkserver_run();
+
+    for (uint32_t i = 0; i < vm->n_hart; i++)
+        semu_timer_rebase(&vm->hart[i]->time, time[i]);
+    semu_timer_rebase(&emu->mtimer.mtime, time[vm->n_hart]);
+    free(time);
+
+    /* The I/O thread of the parent is not part of the clone */
+    for (int i = 0; i < 2; i++) {
+        close(emu->io_wake[i]);
+        close(emu->io_notify[i]);
+    }
+    if (dup2(console, STDIN_FILENO) < 0 || dup2(console, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Failed to set up the console: %s\n", strerror(errno));
+        exit(1);
+    }
+    close(console);
+    emu->uart.in_ready = false;
+    emu->uart.exit_on_eof = true;
+#if SEMU_HAS(VIRTIONET)
+    emu->vnet.queues[VNET_QUEUE_RX].fd_ready = false;
+    emu->vnet.queues[VNET_QUEUE_TX].fd_ready = false;
+    if (!netdev_clone(&emu->vnet.peer))
+        fprintf(stderr, "No virtio-net functioned\n");
+#endif
+#if SEMU_HAS(VIRTIOBLK)
+    if (!virtio_blk_overlay(&emu->vblk))
+        exit(1);
+#endif
+    if (!emu_io_init(emu))
+        exit(1);
+}
+
 static int semu_run(emu_state_t *emu)
 {
     int ret;
 
     /* Emulate */
     while (!emu->stopped) {
-#if SEMU_HAS(VIRTIONET)
-        int i = 0;
-        if (emu->vnet.peer.type == NETDEV_IMPL_user && boot_complete) {
-            net_user_options_t *usr = (net_user_options_t *) emu->vnet.peer.op;
-
-            uint32_t timeout = -1;
-            usr->pfd_len = 1;
-            slirp_pollfds_fill_socket(usr->slirp, &timeout,
-                                      semu_slirp_add_poll_socket, usr);
-
-            /* Poll the internal pipe for incoming data. If data is
-             * available (POLL_IN), process it and forward it to the
-             * virtio-net device.
-             */
-            int pollout = poll(usr->pfd, usr->pfd_len, 1);
-            if (usr->pfd[0].revents & POLLIN) {
-                virtio_net_recv_from_peer(usr->peer);
-            }
-            slirp_pollfds_poll(usr->slirp, (pollout <= 0),
-                               semu_slirp_get_revents, usr);
-            for (i = 0; i < SLIRP_POLL_INTERVAL; i++) {
-                ret = semu_step(emu);
-                if (ret)
-                    return ret;
-            }
-        } else
-#endif
-        {
-            ret = semu_step(emu);
-            if (ret)
-                return ret;
-        }
+        ret = semu_step(emu);
+        if (ret)
+            return ret;
+        /* Every hart is between two steps here */
+        if (unlikely(snapshot_due()))
+            snapshot_save(emu);
+        if (unlikely(forkserver_due()))
+            emu_fork_server(emu);
+        /* Before the boot completes, time only advances as harts run */
+        if (boot_complete && emu_all_idle(emu))
+            emu_idle_wait(emu);
     }
 
     /* unreachable */
     return 0;
 }
+#endif
 
 static inline bool semu_is_interrupt(emu_state_t *emu)
 {
@@ -1023,11 +2037,13 @@ static int semu_run_debug(emu_state_t *emu)
 int main(int argc, char **argv)
 {
     int ret;
-    emu_state_t emu;
+    /* static, since the exit handlers may still refer to it */
+    static emu_state_t emu;
     ret = semu_init(&emu, argc, argv);
     if (ret)
         return ret;
 
+    timeline_mark(emu.vm.hart[0], "first-instruction");
     if (emu.debug)
         return semu_run_debug(&emu);
 
@@ -67,9 +67,11 @@ static int net_init_user(netdev_t *netdev)
                  fcntl(usr->channel[SLIRP_READ_SIDE], F_GETFL, 0) |
                      O_NONBLOCK) >= 0);
 
-    net_slirp_init(usr);
+    virtio_net_state_t *vnet = (virtio_net_state_t *) usr->peer;
+    vnet->queues[VNET_QUEUE_TX].fd_ready = true;
+    usr->tx_ready = &vnet->queues[VNET_QUEUE_TX].fd_ready;
 
-    return 0;
+    return net_slirp_init(usr);
 }
 
 bool netdev_init(netdev_t *netdev, const char *net_type)
@@ -99,3 +101,21 @@ bool netdev_init(netdev_t *netdev, const char *net_type)
 
     return true;
 }
+
+/* Give a forked process a backend of its own, of the same type. The old one
+ * still serves the parent, so the child only closes its copies of the fds.
+ */
+bool netdev_clone(netdev_t *netdev)
+{
+    if (netdev->type == NETDEV_IMPL_tap) {
+        net_tap_options_t *tap = (net_tap_options_t *) netdev->op;
+        close(tap->tap_fd);
+    } else if (netdev->type == NETDEV_IMPL_user) {
+        net_user_options_t *usr = (net_user_options_t *) netdev->op;
+        for (int i = 0; i < 2; i++) {
+            close(usr->channel[i]);
+            close(usr->wake[i]);
+        }
+    }
+    return netdev_init(netdev, netdev_impl_lookup[netdev->type]);
+}
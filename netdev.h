@@ -1,6 +1,8 @@
 #pragma once
 
 #include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "minislirp/src/libslirp.h"
@@ -24,9 +26,10 @@ typedef struct {
 } net_tap_options_t;
 
 /* SLIRP */
-#define SLIRP_POLL_INTERVAL 100000
 #define SLIRP_READ_SIDE 0
 #define SLIRP_WRITE_SIDE 1
+#define SLIRP_PKT_SIZE 1514
+#define SLIRP_TX_RING_SIZE 64 /* must be a power of 2 */
 typedef struct {
     semu_timer_t timer;
     Slirp *slirp;
@@ -36,6 +39,11 @@ typedef struct {
     int64_t expire_timer_msec;
 } slirp_timer;
 
+typedef struct {
+    uint16_t len;
+    uint8_t data[SLIRP_PKT_SIZE];
+} slirp_pkt_t;
+
 typedef struct {
     Slirp *slirp;
     int channel[2];
@@ -44,10 +52,25 @@ typedef struct {
     struct pollfd *pfd;
     slirp_timer *timer;
     void *peer;
+    /* Slirp runs on its own thread. Guest packets reach it through a
+     * single-producer, single-consumer ring, and its packets reach the guest
+     * through "channel".
+     */
+    pthread_t thread;
+    int wake[2];
+    bool kicked;
+    slirp_pkt_t *tx_ring;
+    uint32_t tx_head, tx_tail;
+    bool *tx_ready;
+    int notify_fd;
 } net_user_options_t;
 
 Slirp *slirp_create(net_user_options_t *usr, SlirpConfig *cfg);
 int net_slirp_init(net_user_options_t *usr);
+bool net_slirp_start(net_user_options_t *usr, int notify_fd);
+bool net_slirp_send(net_user_options_t *usr,
+                    const struct iovec *iovs,
+                    size_t niovs);
 int semu_slirp_add_poll_socket(slirp_os_socket fd, int events, void *opaque);
 int semu_slirp_get_revents(int idx, void *opaque);
 
@@ -58,3 +81,4 @@ typedef struct {
 } netdev_t;
 
 bool netdev_init(netdev_t *nedtev, const char *net_type);
+bool netdev_clone(netdev_t *netdev);
@@ -10,12 +10,8 @@ void plic_update_interrupts(vm_t *vm, plic_state_t *plic)
     plic->ip |= plic->active & ~plic->masked;
     plic->masked |= plic->active;
     /* Send interrupt to target */
-    for (uint32_t i = 0; i < vm->n_hart; i++) {
-        if (plic->ip & plic->ie[i])
-            vm->hart[i]->sip |= RV_INT_SEI_BIT;
-        else
-            vm->hart[i]->sip &= ~RV_INT_SEI_BIT;
-    }
+    for (uint32_t i = 0; i < vm->n_hart; i++)
+        vm_set_pending(vm->hart[i], RV_INT_SEI_BIT, plic->ip & plic->ie[i]);
 }
 
 static bool plic_reg_read(plic_state_t *plic, uint32_t addr, uint32_t *value)
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "profile.h"
+#include "riscv.h"
+#include "riscv_private.h"
+
+/* Symbol tables */
+
+static int profile_add_symbol(profile_t *prof,
+                              uint32_t *capacity,
+                              uint32_t addr,
+                              uint32_t size,
+                              const char *name)
+{
+    if (prof->n_symbols == *capacity) {
+        uint32_t n = *capacity ? *capacity * 2 : 1024;
+        profile_symbol_t *symbols =
+            realloc(prof->symbols, n * sizeof(profile_symbol_t));
+        if (!symbols)
+            return -1;
+        prof->symbols = symbols;
+        *capacity = n;
+    }
+    char *copy = strdup(name);
+    if (!copy)
+        return -1;
+    prof->symbols[prof->n_symbols++] = (profile_symbol_t){addr, size, copy};
+    return 0;
+}
+
+/* Load the text symbols of a System.map, i.e. "address type name" lines */
+static int profile_load_map(profile_t *prof, uint32_t *capacity, FILE *f)
+{
+    char line[512], name[256], type;
+    unsigned long addr;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx %c %255s", &addr, &type, name) != 3)
+            continue;
+        if (type != 't' && type != 'T' && type != 'w' && type != 'W')
+            continue;
+        if (profile_add_symbol(prof, capacity, addr, 0, name))
+            return -1;
+    }
+    return 0;
+}
+
+static inline uint32_t le16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline uint32_t le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* Load the function symbols of a 32-bit little-endian ELF image, from its
+ * symbol table or else its dynamic one. "elf" holds the "len" bytes of the
+ * file.
+ */
+static int profile_load_elf(profile_t *prof,
+                            uint32_t *capacity,
+                            const uint8_t *elf,
+                            size_t len)
+{
+    enum { SHT_SYMTAB = 2, SHT_DYNSYM = 11, STT_FUNC = 2 };
+    if (len < 52 || elf[4] != 1 /* ELFCLASS32 */ ||
+        elf[5] != 1 /* ELFDATA2LSB */)
+        return -1;
+
+    uint32_t shoff = le32(elf + 32);
+    uint32_t shentsize = le16(elf + 46), shnum = le16(elf + 48);
+    if (shentsize < 40 || shoff > len || shnum > (len - shoff) / shentsize)
+        return -1;
+
+    const uint8_t *symtab = NULL;
+    for (uint32_t i = 0; i < shnum; i++) {
+        const uint8_t *sh = elf + shoff + i * shentsize;
+        uint32_t type = le32(sh + 4);
+        if (type == SHT_SYMTAB || (type == SHT_DYNSYM && !symtab))
+            symtab = sh;
+    }
+    if (!symtab)
+        return -1;
+
+    uint32_t link = le32(symtab + 24);
+    if (link >= shnum)
+        return -1;
+    const uint8_t *strtab = elf + shoff + link * shentsize;
+    uint32_t sym_off = le32(symtab + 16), sym_size = le32(symtab + 20);
+    uint32_t str_off = le32(strtab + 16), str_size = le32(strtab + 20);
+    if (sym_off > len || sym_size > len - sym_off || str_off > len ||
+        str_size > len - str_off)
+        return -1;
+
+    for (uint32_t off = 0; off + 16 <= sym_size; off += 16) {
+        const uint8_t *sym = elf + sym_off + off;
+        uint32_t name = le32(sym), addr = le32(sym + 4);
+        if ((sym[12] & 0xF) != STT_FUNC || !addr || name >= str_size ||
+            !memchr(elf + str_off + name, 0, str_size - name))
+            continue;
+        if (profile_add_symbol(prof, capacity, addr, le32(sym + 8),
+                               (const char *) elf + str_off + name))
+            return -1;
+    }
+    return 0;
+}
+
+static int profile_load_symbols(profile_t *prof,
+                                uint32_t *capacity,
+                                const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "could not open %s\n", path);
+        return -1;
+    }
+
+    uint8_t magic[4] = {0};
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    int ret;
+    if (n == sizeof(magic) && !memcmp(magic, "\x7f" "ELF", 4)) {
+        fseek(f, 0, SEEK_END);
+        long len = ftell(f);
+        uint8_t *elf = len > 0 ? malloc(len) : NULL;
+        rewind(f);
+        ret = elf && fread(elf, 1, len, f) == (size_t) len
+                  ? profile_load_elf(prof, capacity, elf, len)
+                  : -1;
+        free(elf);
+    } else {
+        rewind(f);
+        ret = profile_load_map(prof, capacity, f);
+    }
+    fclose(f);
+    if (ret)
+        fprintf(stderr, "could not load the symbols of %s\n", path);
+    return ret;
+}
+
+static int profile_symbol_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const profile_symbol_t *) a)->addr;
+    uint32_t y = ((const profile_symbol_t *) b)->addr;
+    return (x > y) - (x < y);
+}
+
+/* Return the symbol that "addr" falls into, or NULL */
+static const profile_symbol_t *profile_lookup(const profile_t *prof,
+                                              uint32_t addr)
+{
+    uint32_t lo = 0, hi = prof->n_symbols;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (prof->symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return NULL;
+    const profile_symbol_t *sym = &prof->symbols[lo - 1];
+    if (sym->size && addr - sym->addr >= sym->size)
+        return NULL;
+    return sym;
+}
+
+int profile_init(profile_t *prof,
+                 const profile_config_t *config,
+                 uint32_t n_hart)
+{
+    memset(prof, 0, sizeof(*prof));
+    prof->config = *config;
+    if (!prof->config.interval)
+        prof->config.interval = PROFILE_DEFAULT_INTERVAL;
+    prof->n_hart = n_hart;
+    prof->harts = calloc(n_hart, sizeof(profile_hart_t));
+    if (!prof->harts)
+        return -1;
+    for (uint32_t i = 0; i < n_hart; i++)
+        prof->harts[i].next = config->out ? 0 : UINT64_MAX;
+
+    uint32_t capacity = 0;
+    for (uint32_t i = 0; i < config->n_symbols; i++) {
+        if (profile_load_symbols(prof, &capacity, config->symbols[i]))
+            return -1;
+    }
+    if (prof->n_symbols)
+        qsort(prof->symbols, prof->n_symbols, sizeof(profile_symbol_t),
+              profile_symbol_cmp);
+    return 0;
+}
+
+/* Sampling */
+
+static uint32_t profile_hash(const uint32_t *pc, uint32_t depth, bool user)
+{
+    uint32_t h = 2166136261u ^ user;
+    for (uint32_t i = 0; i < depth; i++)
+        h = (h ^ pc[i]) * 16777619u;
+    return h;
+}
+
+/* Return the slot of the stack in the table, which is free if the stack has
+ * not been seen yet.
+ */
+static profile_stack_t *profile_slot(profile_stack_t *stacks,
+                                     uint32_t capacity,
+                                     uint32_t hash,
+                                     const uint32_t *pc,
+                                     uint32_t depth,
+                                     bool user)
+{
+    for (uint32_t i = hash;; i++) {
+        profile_stack_t *s = &stacks[i & (capacity - 1)];
+        if (!s->depth ||
+            (s->hash == hash && s->depth == depth && s->user == user &&
+             !memcmp(s->pc, pc, depth * sizeof(uint32_t))))
+            return s;
+    }
+}
+
+/* Keep the table at most half full */
+static bool profile_grow(profile_hart_t *ph)
+{
+    if (2 * (ph->n_stacks + 1) <= ph->capacity)
+        return true;
+
+    uint32_t capacity = ph->capacity ? ph->capacity * 2 : 1024;
+    profile_stack_t *stacks = calloc(capacity, sizeof(profile_stack_t));
+    if (!stacks)
+        return false;
+    for (uint32_t i = 0; i < ph->capacity; i++) {
+        profile_stack_t *s = &ph->stacks[i];
+        if (s->depth)
+            *profile_slot(stacks, capacity, s->hash, s->pc, s->depth,
+                          s->user) = *s;
+    }
+    free(ph->stacks);
+    ph->stacks = stacks;
+    ph->capacity = capacity;
+    return true;
+}
+
+void profile_sample(profile_t *prof, hart_t *hart)
+{
+    profile_hart_t *ph = &prof->harts[hart->mhartid];
+    ph->next = hart->instret + prof->config.interval;
+
+    /* Each frame keeps the return address at fp - 4 and the frame pointer of
+     * its caller at fp - 8. Frames of callers lie at higher addresses.
+     */
+    uint32_t pc[PROFILE_MAX_DEPTH];
+    uint32_t depth = 0;
+    pc[depth++] = hart->pc;
+    uint32_t fp = hart->x_regs[RV_R_FP];
+
+    /* A leaf function need not set up a frame, so its caller only shows in ra.
+     * Otherwise, ra returns into the sampled function, or holds the return
+     * address of the innermost frame as well.
+     */
+    const profile_symbol_t *sym = profile_lookup(prof, hart->pc);
+    uint32_t ra = hart->x_regs[RV_R_RA], frame_ra;
+    if (sym && ra && profile_lookup(prof, ra - 1) != sym &&
+        !(vm_peek(hart, fp - 4, &frame_ra) && frame_ra == ra))
+        pc[depth++] = ra;
+
+    while (depth < PROFILE_MAX_DEPTH) {
+        uint32_t ra, caller_fp;
+        if (!vm_peek(hart, fp - 4, &ra) || !vm_peek(hart, fp - 8, &caller_fp) ||
+            !ra)
+            break;
+        pc[depth++] = ra;
+        if (caller_fp <= fp)
+            break;
+        fp = caller_fp;
+    }
+
+    if (!profile_grow(ph))
+        return;
+    bool user = !hart->s_mode;
+    uint32_t hash = profile_hash(pc, depth, user);
+    profile_stack_t *s =
+        profile_slot(ph->stacks, ph->capacity, hash, pc, depth, user);
+    if (!s->depth) {
+        s->hash = hash;
+        s->depth = depth;
+        s->user = user;
+        memcpy(s->pc, pc, depth * sizeof(uint32_t));
+        ph->n_stacks++;
+    }
+    s->count++;
+}
+
+/* Output */
+
+typedef struct {
+    char *line;
+    uint64_t count;
+} profile_line_t;
+
+static int profile_line_cmp(const void *a, const void *b)
+{
+    return strcmp(((const profile_line_t *) a)->line,
+                  ((const profile_line_t *) b)->line);
+}
+
+/* Return the symbol of frame "i" of the stack. A return address may be the
+ * first one past the calling function, so it is looked up one byte earlier.
+ */
+static const profile_symbol_t *profile_frame(const profile_t *prof,
+                                             const profile_stack_t *s,
+                                             uint32_t i)
+{
+    return profile_lookup(prof, i ? s->pc[i] - 1 : s->pc[i]);
+}
+
+/* Return the folded form of the stack, outermost frame first */
+static char *profile_fold(const profile_t *prof, const profile_stack_t *s)
+{
+    size_t size = 8 + PROFILE_MAX_DEPTH * 2;
+    for (uint32_t i = 0; i < s->depth; i++) {
+        const profile_symbol_t *sym = profile_frame(prof, s, i);
+        size += sym ? strlen(sym->name) : 10;
+    }
+
+    char *line = malloc(size);
+    if (!line)
+        return NULL;
+    char *p = line + sprintf(line, "%s", s->user ? "user" : "kernel");
+    for (uint32_t i = s->depth; i-- > 0;) {
+        const profile_symbol_t *sym = profile_frame(prof, s, i);
+        if (sym)
+            p += sprintf(p, ";%s", sym->name);
+        else
+            p += sprintf(p, ";0x%08x", s->pc[i]);
+    }
+    return line;
+}
+
+void profile_write(profile_t *prof)
+{
+    if (!prof->config.out)
+        return;
+
+    size_t n = 0;
+    for (uint32_t h = 0; h < prof->n_hart; h++)
+        n += prof->harts[h].n_stacks;
+    profile_line_t *lines = calloc(n ? n : 1, sizeof(profile_line_t));
+    if (!lines)
+        return;
+
+    /* Stacks that differ only in PCs within the same functions fold into the
+     * same line, so sort the lines to merge them.
+     */
+    n = 0;
+    for (uint32_t h = 0; h < prof->n_hart; h++) {
+        const profile_hart_t *ph = &prof->harts[h];
+        for (uint32_t i = 0; i < ph->capacity; i++) {
+            const profile_stack_t *s = &ph->stacks[i];
+            if (!s->depth)
+                continue;
+            char *line = profile_fold(prof, s);
+            if (line)
+                lines[n++] = (profile_line_t){line, s->count};
+        }
+    }
+    qsort(lines, n, sizeof(profile_line_t), profile_line_cmp);
+
+    FILE *f = fopen(prof->config.out, "w");
+    if (!f)
+        fprintf(stderr, "could not write the profile to %s\n",
+                prof->config.out);
+    for (size_t i = 0; i < n; i++) {
+        if (i + 1 < n && !strcmp(lines[i].line, lines[i + 1].line))
+            lines[i + 1].count += lines[i].count;
+        else if (f)
+            fprintf(f, "%s %llu\n", lines[i].line,
+                    (unsigned long long) lines[i].count);
+        free(lines[i].line);
+    }
+    if (f)
+        fclose(f);
+    free(lines);
+}
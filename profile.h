@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "riscv.h"
+
+/* Sampling profiler of the guest. Every "interval" instructions, a hart
+ * records the PC it is about to run, followed by the return addresses along
+ * its chain of frame pointers. On exit, the samples are resolved against the
+ * symbol tables and written as folded stacks, i.e. one line
+ * "root;caller;...;callee count" per distinct stack, which flame graph tools
+ * take as input. The root is "kernel" or "user", depending on the privilege
+ * mode of the hart.
+ */
+
+#define PROFILE_MAX_SYMBOL_FILES 8
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_DEFAULT_INTERVAL 10007
+
+typedef struct {
+    const char *out; /**< folded stacks file, NULL if not profiling */
+    /* System.map files or ELF images with a symbol table */
+    const char *symbols[PROFILE_MAX_SYMBOL_FILES];
+    uint32_t n_symbols;
+    uint32_t interval; /**< instructions between two samples of a hart */
+} profile_config_t;
+
+#if SEMU_HAS(PROFILER)
+typedef struct {
+    uint32_t addr;
+    uint32_t size; /**< 0 if unknown, the symbol then ends at the next one */
+    char *name;
+} profile_symbol_t;
+
+typedef struct {
+    uint64_t count;
+    uint32_t hash;
+    uint8_t depth; /**< 0 for a free slot */
+    bool user;
+    uint32_t pc[PROFILE_MAX_DEPTH]; /**< innermost frame first */
+} profile_stack_t;
+
+/* The distinct stacks that a hart was sampled at, in an open-addressing hash
+ * table. Each hart only touches its own, so the harts need not synchronize.
+ */
+typedef struct {
+    profile_stack_t *stacks;
+    uint32_t n_stacks, capacity;
+    uint64_t next; /**< instret of the next sample, UINT64_MAX if disabled */
+} profile_hart_t;
+
+typedef struct {
+    profile_config_t config;
+    profile_symbol_t *symbols; /**< sorted by address */
+    uint32_t n_symbols;
+    uint32_t n_hart;
+    profile_hart_t *harts;
+} profile_t;
+
+/* Load the symbol tables. Return nonzero on error. */
+int profile_init(profile_t *prof,
+                 const profile_config_t *config,
+                 uint32_t n_hart);
+
+/* Return true if the hart is due to be sampled. Without profiling, this is
+ * never the case, at the cost of a single comparison.
+ */
+static inline bool profile_due(const profile_t *prof, const hart_t *hart)
+{
+    return hart->instret >= prof->harts[hart->mhartid].next;
+}
+
+void profile_sample(profile_t *prof, hart_t *hart);
+
+/* Write out the folded stacks, if profiling */
+void profile_write(profile_t *prof);
+#endif
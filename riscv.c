@@ -1,9 +1,16 @@
+#include <fenv.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "device.h"
 #include "riscv.h"
 #include "riscv_private.h"
+#if SEMU_HAS(JIT)
+#include "jit.h"
+#endif
 
 /* Return the string representation of an error code identifier */
 static const char *vm_error_str(vm_error_t err)
@@ -157,6 +164,120 @@ static inline uint8_t decode_func5(uint32_t insn)
     return insn >> 27;
 }
 
+/* decode rs3 field of fused multiply-add instructions */
+static inline uint8_t decode_rs3(uint32_t insn)
+{
+    return insn >> 27;
+}
+
+/* Compressed (RVC) instruction fields. Immediates are scattered across the
+ * 16-bit encoding, and are gathered below in the order of the specification.
+ */
+
+static inline uint32_t sign_extend(uint32_t x, uint8_t bits)
+{
+    return (uint32_t) ((int32_t) (x << (32 - bits)) >> (32 - bits));
+}
+
+/* decode the 3-bit register fields, which select x8 to x15 */
+static inline uint8_t decode_c_rs1p(uint32_t insn)
+{
+    return 8 + ((insn >> 7) & MASK(3));
+}
+
+static inline uint8_t decode_c_rs2p(uint32_t insn)
+{
+    return 8 + ((insn >> 2) & MASK(3));
+}
+
+/* decode the 5-bit register fields */
+static inline uint8_t decode_c_rd(uint32_t insn)
+{
+    return (insn >> 7) & MASK(5);
+}
+
+static inline uint8_t decode_c_rs2(uint32_t insn)
+{
+    return (insn >> 2) & MASK(5);
+}
+
+/* decode CI-type immediate: imm[5] | imm[4:0] */
+static inline uint32_t decode_ci(uint32_t insn)
+{
+    return sign_extend(((insn >> 7) & 0x20) | ((insn >> 2) & 0x1F), 6);
+}
+
+/* decode C.ADDI16SP immediate: nzimm[9] | nzimm[4|6|8:7|5] */
+static inline uint32_t decode_ci_addi16sp(uint32_t insn)
+{
+    return sign_extend(((insn >> 3) & 0x200) | ((insn >> 2) & 0x10) |
+                           ((insn << 1) & 0x40) | ((insn << 4) & 0x180) |
+                           ((insn << 3) & 0x20),
+                       10);
+}
+
+/* decode C.LWSP immediate: uimm[5] | uimm[4:2|7:6] */
+static inline uint32_t decode_ci_lwsp(uint32_t insn)
+{
+    return ((insn >> 7) & 0x20) | ((insn >> 2) & 0x1C) | ((insn << 4) & 0xC0);
+}
+
+/* decode C.FLDSP immediate: uimm[5] | uimm[4:3|8:6] */
+static inline uint32_t decode_ci_ldsp(uint32_t insn)
+{
+    return ((insn >> 7) & 0x20) | ((insn >> 2) & 0x18) | ((insn << 4) & 0x1C0);
+}
+
+/* decode C.SWSP immediate: uimm[5:2|7:6] */
+static inline uint32_t decode_css(uint32_t insn)
+{
+    return ((insn >> 7) & 0x3C) | ((insn >> 1) & 0xC0);
+}
+
+/* decode C.FSDSP immediate: uimm[5:3|8:6] */
+static inline uint32_t decode_css_d(uint32_t insn)
+{
+    return ((insn >> 7) & 0x38) | ((insn >> 1) & 0x1C0);
+}
+
+/* decode C.ADDI4SPN immediate: nzuimm[5:4|9:6|2|3] */
+static inline uint32_t decode_ciw(uint32_t insn)
+{
+    return ((insn >> 7) & 0x30) | ((insn >> 1) & 0x3C0) | ((insn >> 4) & 0x4) |
+           ((insn >> 2) & 0x8);
+}
+
+/* decode CL/CS-type word immediate: uimm[5:3] | uimm[2|6] */
+static inline uint32_t decode_cl(uint32_t insn)
+{
+    return ((insn >> 7) & 0x38) | ((insn >> 4) & 0x4) | ((insn << 1) & 0x40);
+}
+
+/* decode CL/CS-type doubleword immediate: uimm[5:3] | uimm[7:6] */
+static inline uint32_t decode_cl_d(uint32_t insn)
+{
+    return ((insn >> 7) & 0x38) | ((insn << 1) & 0xC0);
+}
+
+/* decode CJ-type immediate: offset[11|4|9:8|10|6|7|3:1|5] */
+static inline uint32_t decode_cj(uint32_t insn)
+{
+    return sign_extend(((insn >> 1) & 0x800) | ((insn >> 7) & 0x10) |
+                           ((insn >> 1) & 0x300) | ((insn << 2) & 0x400) |
+                           ((insn >> 1) & 0x40) | ((insn << 1) & 0x80) |
+                           ((insn >> 2) & 0xE) | ((insn << 3) & 0x20),
+                       12);
+}
+
+/* decode CB-type branch immediate: offset[8|4:3] | offset[7:6|2:1|5] */
+static inline uint32_t decode_cb(uint32_t insn)
+{
+    return sign_extend(((insn >> 4) & 0x100) | ((insn >> 7) & 0x18) |
+                           ((insn << 1) & 0xC0) | ((insn >> 2) & 0x6) |
+                           ((insn << 3) & 0x20),
+                       9);
+}
+
 static inline uint32_t read_rs1(const hart_t *vm, uint32_t insn)
 {
     return vm->x_regs[decode_rs1(insn)];
@@ -174,12 +295,23 @@ static void mmu_invalidate(hart_t *vm)
     vm->cache_fetch.n_pages = 0xFFFFFFFF;
 }
 
+static void mmu_tlb_flush(hart_t *vm)
+{
+    memset(vm->dtlb, 0, sizeof(vm->dtlb));
+}
+
+void vm_flush_tlb(hart_t *vm)
+{
+    mmu_invalidate(vm);
+    mmu_tlb_flush(vm);
+}
+
 /* Pre-verify the root page table to minimize page table access during
  * translation time.
  */
 static void mmu_set(hart_t *vm, uint32_t satp)
 {
-    mmu_invalidate(vm);
+    vm_flush_tlb(vm);
     if (satp >> 31) {
         uint32_t *page_table = vm->mem_page_table(vm, satp & MASK(22));
         if (!page_table)
@@ -193,6 +325,15 @@ static void mmu_set(hart_t *vm, uint32_t satp)
     vm->satp = satp;
 }
 
+void vm_reload(hart_t *vm)
+{
+    vm->lr_reservation = 0;
+    vm->wrs = false;
+    vm->error = ERR_NONE;
+    mmu_set(vm, vm->satp);
+    vm_flush_blocks(vm);
+}
+
 #define PTE_ITER(page_table, vpn, additional_checks)    \
     *pte = &(page_table)[vpn];                          \
     switch ((**pte) & MASK(4)) {                        \
@@ -236,25 +377,30 @@ static bool mmu_lookup(const hart_t *vm,
     return true;
 }
 
-static void mmu_translate(hart_t *vm,
-                          uint32_t *addr,
-                          const uint32_t access_bits,
-                          const uint32_t set_bits,
-                          const bool skip_privilege_test,
-                          const uint8_t fault,
-                          const uint8_t pfault)
+/* Return the leaf PTE as updated by the access, or 0 if the address was not
+ * translated.
+ */
+static uint32_t mmu_translate(hart_t *vm,
+                              uint32_t *addr,
+                              const uint32_t access_bits,
+                              const uint32_t set_bits,
+                              const bool skip_privilege_test,
+                              const uint8_t fault,
+                              const uint8_t pfault)
 {
     /* NOTE: save virtual address, for physical accesses, to set exception. */
     vm->exc_val = *addr;
     if (!vm->page_table)
-        return;
+        return 0;
 
+    STATS_INC(vm, page_walks);
+    vm_event(vm, RV_EVENT_PAGE_WALK);
     uint32_t *pte_ref;
     uint32_t ppn;
     bool ok = mmu_lookup(vm, (*addr) >> RV_PAGE_SHIFT, &pte_ref, &ppn);
     if (unlikely(!ok)) {
         vm_set_exception(vm, fault, *addr);
-        return;
+        return 0;
     }
 
     uint32_t pte;
@@ -265,7 +411,7 @@ static void mmu_translate(hart_t *vm,
            skip_privilege_test) /* privilege matches */
           )) {
         vm_set_exception(vm, pfault, *addr);
-        return;
+        return 0;
     }
 
     uint32_t new_pte = pte | set_bits;
@@ -273,76 +419,378 @@ static void mmu_translate(hart_t *vm,
         *pte_ref = new_pte;
 
     *addr = ((*addr) & MASK(RV_PAGE_SHIFT)) | (ppn << RV_PAGE_SHIFT);
+    return new_pte;
+}
+
+bool vm_peek(const hart_t *vm, uint32_t addr, uint32_t *value)
+{
+    if (addr & 0b11)
+        return false;
+
+    uint32_t ppn = addr >> RV_PAGE_SHIFT;
+    if (vm->page_table) {
+        uint32_t *pte;
+        if (!mmu_lookup(vm, addr >> RV_PAGE_SHIFT, &pte, &ppn) || !pte ||
+            !(*pte & (1 << 1)))
+            return false;
+    }
+    uint32_t *page = vm->mem_ram_page(vm, ppn);
+    if (!page)
+        return false;
+    *value = page[(addr & MASK(RV_PAGE_SHIFT)) >> 2];
+    return true;
 }
 
 static void mmu_fence(hart_t *vm, uint32_t insn UNUSED)
 {
-    mmu_invalidate(vm);
+    vm_flush_tlb(vm);
+}
+
+/* Fill the data TLB for a load (TLB_READ) or store (TLB_WRITE) at virtual
+ * address "addr", walking the page table if paging is enabled. Entries are only
+ * filled once the walk has set the accessed bit, and only grant stores once the
+ * dirty bit is set too, so that a hit never has to update the PTE. Return the
+ * new entry, or NULL with vm->error set if the access faults.
+ */
+static const mmu_tlb_entry_t *mmu_tlb_fill(hart_t *vm,
+                                           uint32_t addr,
+                                           uint32_t perm)
+{
+    uint32_t vpn = addr >> RV_PAGE_SHIFT;
+    uint32_t pte;
+    if (!vm->page_table)
+        pte = (1 << 1) | (1 << 2) | (1 << 7);
+    else if (perm == TLB_WRITE)
+        pte = mmu_translate(vm, &addr, (1 << 2), (1 << 6) | (1 << 7),
+                            vm->sstatus_sum && vm->s_mode,
+                            RV_EXC_STORE_FAULT, RV_EXC_STORE_PFAULT);
+    else
+        pte = mmu_translate(vm, &addr,
+                            (1 << 1) | (vm->sstatus_mxr ? (1 << 3) : 0),
+                            (1 << 6), vm->sstatus_sum && vm->s_mode,
+                            RV_EXC_LOAD_FAULT, RV_EXC_LOAD_PFAULT);
+    if (vm->error)
+        return NULL;
+
+    /* Writable pages have R set as well, as W without R is reserved */
+    perm = TLB_READ;
+    if ((pte & (1 << 2)) && (pte & (1 << 7)))
+        perm |= TLB_WRITE;
+
+    /* Refill the entry of the page if there is one, otherwise evict the least
+     * recently filled entry of the set.
+     */
+    mmu_tlb_entry_t *set = vm->dtlb[vpn & MASK(TLB_SET_BITS)];
+    int way = 0;
+    while (way < TLB_WAYS && !(set[way].perm && set[way].vpn == vpn))
+        way++;
+    if (way == TLB_WAYS) {
+        memmove(&set[1], &set[0], (TLB_WAYS - 1) * sizeof(*set));
+        way = 0;
+    }
+    set[way].vpn = vpn;
+    set[way].ppn = addr >> RV_PAGE_SHIFT;
+    set[way].perm = perm;
+    set[way].page = vm->mem_ram_page(vm, set[way].ppn);
+    return &set[way];
+}
+
+/* Look up the data TLB entry granting "perm" at virtual address "addr",
+ * filling it on a miss.
+ */
+FORCE_INLINE const mmu_tlb_entry_t *mmu_translate_data(hart_t *vm,
+                                                      uint32_t addr,
+                                                      uint32_t perm)
+{
+    uint32_t vpn = addr >> RV_PAGE_SHIFT;
+    const mmu_tlb_entry_t *set = vm->dtlb[vpn & MASK(TLB_SET_BITS)];
+    for (int i = 0; i < TLB_WAYS; i++) {
+        if (likely(set[i].vpn == vpn && (set[i].perm & perm)))
+            return &set[i];
+    }
+    return mmu_tlb_fill(vm, addr, perm);
+}
+
+/* Naturally aligned accesses to RAM pages are carried out on the host page
+ * directly, in the same word-based layout as ram.c. Everything else goes
+ * through the environment callbacks. So do all loads and stores of JIT
+ * lockstep builds, which log and replay them there.
+ */
+static inline bool mmu_ram_direct(const mmu_tlb_entry_t *entry,
+                                  uint32_t addr,
+                                  uint8_t width)
+{
+#if SEMU_HAS(JIT) && SEMU_HAS(JIT_LOCKSTEP)
+    (void) entry, (void) addr, (void) width;
+    return false;
+#else
+    return entry->page && !(addr & ((1 << (width & 0b11)) - 1));
+#endif
+}
+
+static inline uint32_t mmu_ram_load(const uint32_t *page,
+                                    uint32_t off,
+                                    uint8_t width)
+{
+    uint32_t cell = page[off >> 2];
+    uint8_t shift = (off & 0b11) * 8;
+    switch (width) {
+    case RV_MEM_LW:
+        return cell;
+    case RV_MEM_LHU:
+        return (uint16_t) (cell >> shift);
+    case RV_MEM_LH:
+        return (uint32_t) (int32_t) (int16_t) (cell >> shift);
+    case RV_MEM_LBU:
+        return (uint8_t) (cell >> shift);
+    default: /* RV_MEM_LB */
+        return (uint32_t) (int32_t) (int8_t) (cell >> shift);
+    }
+}
+
+static inline void mmu_ram_store(uint32_t *page,
+                                 uint32_t off,
+                                 uint8_t width,
+                                 uint32_t value)
+{
+    uint32_t *cell = &page[off >> 2];
+    uint8_t shift = (off & 0b11) * 8;
+#if SEMU_HAS(SMP_THREADS) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* Another hart may concurrently update the rest of the word, so narrow
+     * stores must not rewrite it. RAM words are little-endian in host memory.
+     */
+    (void) shift;
+    switch (width) {
+    case RV_MEM_SW:
+        *cell = value;
+        break;
+    case RV_MEM_SH:
+        ((uint16_t *) page)[off >> 1] = value;
+        break;
+    default: /* RV_MEM_SB */
+        ((uint8_t *) page)[off] = value;
+        break;
+    }
+#else
+    switch (width) {
+    case RV_MEM_SW:
+        *cell = value;
+        break;
+    case RV_MEM_SH:
+        *cell = (*cell & ~(MASK(16) << shift)) | (value & MASK(16)) << shift;
+        break;
+    default: /* RV_MEM_SB */
+        *cell = (*cell & ~(MASK(8) << shift)) | (value & MASK(8)) << shift;
+        break;
+    }
+#endif
+}
+
+static inline uint32_t *lr_bucket(vm_t *vm, uint32_t paddr)
+{
+    return &vm->lr_buckets[(paddr >> 2) & (LR_BUCKETS - 1)];
+}
+
+/* Replace the LR reservation of "vm" with "reservation", or drop it if that is
+ * 0, and return the previous one. The bucket count is raised before the
+ * reservation becomes visible, so that a store never skips a reservation it
+ * could observe.
+ */
+static uint32_t lr_reserve(hart_t *vm, uint32_t reservation)
+{
+    if (reservation)
+        __atomic_fetch_add(lr_bucket(vm->vm, reservation), 1,
+                           __ATOMIC_SEQ_CST);
+    uint32_t old =
+        __atomic_exchange_n(&vm->lr_reservation, reservation, __ATOMIC_SEQ_CST);
+    if (old)
+        __atomic_fetch_sub(lr_bucket(vm->vm, old), 1, __ATOMIC_RELAXED);
+    return old;
+}
+
+/* Cancel the reservations of the word at "paddr". Whoever clears a reservation
+ * also drops its bucket count.
+ */
+static void lr_cancel(vm_t *vm, uint32_t paddr)
+{
+    for (uint32_t i = 0; i < vm->n_hart; i++) {
+        uint32_t *reservation = &vm->hart[i]->lr_reservation;
+        uint32_t seen = __atomic_load_n(reservation, __ATOMIC_RELAXED);
+        if ((seen & 1) && (seen & ~3) == (paddr & ~3) &&
+            __atomic_compare_exchange_n(reservation, &seen, 0, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            __atomic_fetch_sub(lr_bucket(vm, seen), 1, __ATOMIC_RELAXED);
+    }
 }
 
-static void mmu_fetch(hart_t *vm, uint32_t addr, uint32_t *value)
+/* Return the host address of the page holding "addr", translating it on a
+ * fetch cache miss. On failure, vm->error is set and NULL is returned.
+ */
+static uint32_t *mmu_fetch(hart_t *vm, uint32_t addr)
 {
     uint32_t vpn = addr >> RV_PAGE_SHIFT;
     if (unlikely(vpn != vm->cache_fetch.n_pages)) {
+        STATS_INC(vm, fetch_misses);
+        vm_event(vm, RV_EVENT_FETCH_MISS);
         mmu_translate(vm, &addr, (1 << 3), (1 << 6), false, RV_EXC_FETCH_FAULT,
                       RV_EXC_FETCH_PFAULT);
         if (vm->error)
-            return;
+            return NULL;
         uint32_t *page_addr;
         vm->mem_fetch(vm, addr >> RV_PAGE_SHIFT, &page_addr);
         if (vm->error)
-            return;
+            return NULL;
         vm->cache_fetch.n_pages = vpn;
         vm->cache_fetch.page_addr = page_addr;
+        vm->cache_fetch.ppn = addr >> RV_PAGE_SHIFT;
     }
-    *value = vm->cache_fetch.page_addr[(addr >> 2) & MASK(RV_PAGE_SHIFT - 2)];
+    return vm->cache_fetch.page_addr;
 }
 
-static void mmu_load(hart_t *vm,
-                     uint32_t addr,
-                     uint8_t width,
-                     uint32_t *value,
-                     bool reserved)
+FORCE_INLINE void mmu_load(hart_t *vm,
+                           uint32_t addr,
+                           uint8_t width,
+                           uint32_t *value,
+                           bool reserved)
 {
-    mmu_translate(vm, &addr, (1 << 1) | (vm->sstatus_mxr ? (1 << 3) : 0),
-                  (1 << 6), vm->sstatus_sum && vm->s_mode, RV_EXC_LOAD_FAULT,
-                  RV_EXC_LOAD_PFAULT);
-    if (vm->error)
+    const mmu_tlb_entry_t *entry = mmu_translate_data(vm, addr, TLB_READ);
+    if (unlikely(!entry))
         return;
-    vm->mem_load(vm, addr, width, value);
-    if (vm->error)
+
+    uint32_t off = addr & MASK(RV_PAGE_SHIFT);
+    if (likely(mmu_ram_direct(entry, addr, width))) {
+        *value = mmu_ram_load(entry->page, off, width);
+    } else {
+        /* NOTE: save virtual address, for physical accesses, to set
+         * exception.
+         */
+        vm->exc_val = addr;
+        vm->mem_load(vm, (entry->ppn << RV_PAGE_SHIFT) | off, width, value);
+        if (vm->error)
+            return;
+    }
+
+    if (unlikely(reserved)) {
+        vm->lr_value = *value;
+        lr_reserve(vm, (entry->ppn << RV_PAGE_SHIFT) | off | 1);
+    }
+}
+
+/* A store to "paddr" cancels the LR reservations of the word held by any hart,
+ * and stales the pre-decoded blocks of the page.
+ */
+FORCE_INLINE void mmu_store_notify(hart_t *vm, uint32_t paddr)
+{
+    if (unlikely(__atomic_load_n(lr_bucket(vm->vm, paddr), __ATOMIC_RELAXED)))
+        lr_cancel(vm->vm, paddr);
+
+    /* Only the first store after a translation pays for the update, since it
+     * clears bit 0.
+     */
+    uint32_t ppn = paddr >> RV_PAGE_SHIFT;
+    if (ppn < vm->vm->n_pages &&
+        unlikely(__atomic_load_n(&vm->vm->page_gen[ppn], __ATOMIC_RELAXED) &
+                 1))
+        __atomic_fetch_add(&vm->vm->page_gen[ppn], 1, __ATOMIC_RELEASE);
+}
+
+FORCE_INLINE void mmu_store(hart_t *vm,
+                            uint32_t addr,
+                            uint8_t width,
+                            uint32_t value)
+{
+    const mmu_tlb_entry_t *entry = mmu_translate_data(vm, addr, TLB_WRITE);
+    if (unlikely(!entry))
         return;
 
-    if (unlikely(reserved))
-        vm->lr_reservation = addr | 1;
+    uint32_t off = addr & MASK(RV_PAGE_SHIFT);
+    uint32_t paddr = (entry->ppn << RV_PAGE_SHIFT) | off;
+    mmu_store_notify(vm, paddr);
+
+    if (likely(mmu_ram_direct(entry, addr, width))) {
+        mmu_ram_store(entry->page, off, width, value);
+        return;
+    }
+    vm->exc_val = addr;
+    vm->mem_store(vm, paddr, width, value);
 }
 
-static bool mmu_store(hart_t *vm,
-                      uint32_t addr,
-                      uint8_t width,
-                      uint32_t value,
-                      bool cond)
+/* Return the host address of the RAM word that an atomic memory operation on
+ * "addr" targets, translated for writing as AMOs require. If the word is not
+ * in RAM, return NULL and set "paddr" so that the caller can fall back to the
+ * environment callbacks.
+ */
+static uint32_t *mmu_amo_word(hart_t *vm, uint32_t addr, uint32_t *paddr)
 {
-    mmu_translate(vm, &addr, (1 << 2), (1 << 6) | (1 << 7),
-                  vm->sstatus_sum && vm->s_mode, RV_EXC_STORE_FAULT,
-                  RV_EXC_STORE_PFAULT);
-    if (vm->error)
-        return false;
+    const mmu_tlb_entry_t *entry = mmu_translate_data(vm, addr, TLB_WRITE);
+    if (unlikely(!entry))
+        return NULL;
+
+    uint32_t off = addr & MASK(RV_PAGE_SHIFT);
+    *paddr = (entry->ppn << RV_PAGE_SHIFT) | off;
+    if (unlikely(!entry->page)) {
+        vm->exc_val = addr;
+        return NULL;
+    }
+    return &entry->page[off >> 2];
+}
 
-    if (unlikely(cond)) {
-        if ((vm->lr_reservation != (addr | 1)))
-            return false;
+#ifndef CBOZ_BLOCK_SIZE
+#define CBOZ_BLOCK_SIZE 64
+#endif
+_Static_assert(CBOZ_BLOCK_SIZE >= 4 && CBOZ_BLOCK_SIZE <= RV_PAGE_SIZE &&
+                   !(CBOZ_BLOCK_SIZE & (CBOZ_BLOCK_SIZE - 1)),
+               "CBOZ_BLOCK_SIZE must be a power of two up to the page size");
+
+/* Zicboz. The block holding "addr" is translated once, then zeroed in place if
+ * it is in RAM, or one word at a time through the environment otherwise.
+ */
+static void op_cbo_zero(hart_t *vm, uint32_t addr)
+{
+    if (!vm->s_mode && !(vm->senvcfg & RV_ENVCFG_CBZE)) {
+        vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+        return;
     }
 
-    for (uint32_t i = 0; i < vm->vm->n_hart; i++) {
-        if (unlikely(vm->vm->hart[i]->lr_reservation & 1) &&
-            (vm->vm->hart[i]->lr_reservation & ~3) == (addr & ~3))
-            vm->vm->hart[i]->lr_reservation = 0;
+    addr &= ~(CBOZ_BLOCK_SIZE - 1);
+    const mmu_tlb_entry_t *entry = mmu_translate_data(vm, addr, TLB_WRITE);
+    if (unlikely(!entry))
+        return;
+
+    uint32_t off = addr & MASK(RV_PAGE_SHIFT);
+    uint32_t paddr = (entry->ppn << RV_PAGE_SHIFT) | off;
+    for (uint32_t i = 0; i < CBOZ_BLOCK_SIZE; i += 4)
+        mmu_store_notify(vm, paddr + i);
+
+    if (likely(mmu_ram_direct(entry, addr, RV_MEM_SW))) {
+        memset(&entry->page[off >> 2], 0, CBOZ_BLOCK_SIZE);
+        return;
     }
-    vm->mem_store(vm, addr, width, value);
-    return true;
+    for (uint32_t i = 0; i < CBOZ_BLOCK_SIZE && !vm->error; i += 4) {
+        vm->exc_val = addr + i;
+        vm->mem_store(vm, paddr + i, RV_MEM_SW, 0);
+    }
+}
+
+#if SEMU_HAS(JIT)
+uint32_t jit_load(hart_t *vm, uint32_t addr, uint32_t width)
+{
+    uint32_t value = 0;
+    mmu_load(vm, addr, width, &value, false);
+    return value;
 }
 
+void jit_store(hart_t *vm, uint32_t addr, uint32_t width, uint32_t value)
+{
+    mmu_store(vm, addr, width, value);
+}
+
+void jit_cbo_zero(hart_t *vm, uint32_t addr)
+{
+    op_cbo_zero(vm, addr);
+}
+#endif
+
 /* exceptions, traps, interrupts */
 
 void vm_set_exception(hart_t *vm, uint32_t cause, uint32_t val)
@@ -354,6 +802,12 @@ void vm_set_exception(hart_t *vm, uint32_t cause, uint32_t val)
 
 void hart_trap(hart_t *vm)
 {
+    if (vm->exc_cause >> 31)
+        STATS_INC(vm, interrupts[vm->exc_cause & MASK(4)]);
+    else
+        STATS_INC(vm, exceptions[vm->exc_cause & MASK(4)]);
+    vm_event(vm, RV_EVENT_TRAP);
+
     /* Fill exception fields */
     vm->scause = vm->exc_cause;
     vm->stval = vm->exc_val;
@@ -366,6 +820,8 @@ void hart_trap(hart_t *vm)
     /* Set */
     vm->sstatus_sie = false;
     mmu_invalidate(vm);
+    if (!vm->s_mode)
+        mmu_tlb_flush(vm);
     vm->s_mode = true;
     vm->pc = vm->stvec_addr;
     if (vm->stvec_vectored)
@@ -379,6 +835,8 @@ static void op_sret(hart_t *vm)
     /* Restore from stack */
     vm->pc = vm->sepc;
     mmu_invalidate(vm);
+    if (vm->s_mode != vm->sstatus_spp)
+        mmu_tlb_flush(vm);
     vm->s_mode = vm->sstatus_spp;
     vm->sstatus_sie = vm->sstatus_spie;
 
@@ -416,7 +874,12 @@ static void op_privileged(hart_t *vm, uint32_t insn)
         op_sret(vm);
         break;
     case 0b000100000101: /* PRIV_WFI */
-                         /* TODO: Implement this */
+        vm->wfi = true;
+        break;
+    case 0b000000001101: /* PRIV_WRS_NTO */
+    case 0b000000011101: /* PRIV_WRS_STO */
+        /* without a valid reservation, there is nothing to wait for */
+        vm->wrs = __atomic_load_n(&vm->lr_reservation, __ATOMIC_RELAXED) & 1;
         break;
     default:
         vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
@@ -424,89 +887,320 @@ static void op_privileged(hart_t *vm, uint32_t insn)
     }
 }
 
-/* CSR instructions */
+/* Floating-point state. Instructions run on the host FPU, which stays in
+ * round-to-nearest-even mode between them. Each instruction which computes
+ * clears the host exception flags before it runs and folds them into fflags
+ * right after, see RV_EXEC_FP_OP(), so that fflags is always up to date.
+ */
 
-static inline void set_dest(hart_t *vm, uint32_t insn, uint32_t x)
+/* Return true if the floating-point unit is on, otherwise raise an illegal
+ * instruction exception.
+ */
+static inline bool fp_enabled(hart_t *vm)
 {
-    uint8_t rd = decode_rd(insn);
-    if (rd)
-        vm->x_regs[rd] = x;
+    if (likely(vm->sstatus_fs != RV_FS_OFF))
+        return true;
+    vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+    return false;
 }
 
-/* clang-format off */
-#define SIE_MASK (RV_INT_SEI_BIT | RV_INT_STI_BIT | RV_INT_SSI_BIT)
-#define SIP_MASK (0              | 0              | RV_INT_SSI_BIT)
-/* clang-format on */
+static inline void fp_flags_clear(void)
+{
+    if (unlikely(fetestexcept(FE_ALL_EXCEPT)))
+        feclearexcept(FE_ALL_EXCEPT);
+}
 
-static void csr_read(hart_t *vm, uint16_t addr, uint32_t *value)
+static inline void fp_flags_accrue(hart_t *vm)
 {
-    switch (addr) {
-    case RV_CSR_TIME:
-        *value = semu_timer_get(&vm->time);
-        return;
-    case RV_CSR_TIMEH:
-        *value = semu_timer_get(&vm->time) >> 32;
-        return;
-    case RV_CSR_INSTRET:
-        *value = vm->instret;
+    int ex = fetestexcept(FE_ALL_EXCEPT);
+    if (likely(!ex))
         return;
-    case RV_CSR_INSTRETH:
-        *value = vm->instret >> 32;
-        return;
-    default:
-        break;
-    }
+    feclearexcept(FE_ALL_EXCEPT);
+    vm->fflags |= ((ex & FE_INEXACT) ? RV_FFLAG_NX : 0) |
+                  ((ex & FE_UNDERFLOW) ? RV_FFLAG_UF : 0) |
+                  ((ex & FE_OVERFLOW) ? RV_FFLAG_OF : 0) |
+                  ((ex & FE_DIVBYZERO) ? RV_FFLAG_DZ : 0) |
+                  ((ex & FE_INVALID) ? RV_FFLAG_NV : 0);
+    vm->sstatus_fs = RV_FS_DIRTY;
+}
 
-    if (!vm->s_mode) {
-        vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+static void csr_read_fp(hart_t *vm, uint16_t addr, uint32_t *value)
+{
+    if (!fp_enabled(vm))
         return;
-    }
-
     switch (addr) {
-    case RV_CSR_SSTATUS:
-        *value = 0;
-        vm->sstatus_sie && (*value |= 1 << (1));
-        vm->sstatus_spie && (*value |= 1 << (5));
-        vm->sstatus_spp && (*value |= 1 << (8));
-        vm->sstatus_sum && (*value |= 1 << (18));
-        vm->sstatus_mxr && (*value |= 1 << (19));
-        break;
-    case RV_CSR_SIE:
-        *value = vm->sie;
-        break;
-    case RV_CSR_SIP:
-        *value = vm->sip;
-        break;
-    case RV_CSR_STVEC:
-        *value = 0;
-        *value = vm->stvec_addr;
-        vm->stvec_vectored && (*value |= 1 << (0));
-        break;
-    case RV_CSR_SATP:
-        *value = vm->satp;
+    case RV_CSR_FFLAGS:
+        *value = vm->fflags;
         break;
-    case RV_CSR_SCOUNTEREN:
-        *value = vm->scounteren;
-        break;
-    case RV_CSR_SSCRATCH:
-        *value = vm->sscratch;
-        break;
-    case RV_CSR_SEPC:
-        *value = vm->sepc;
+    case RV_CSR_FRM:
+        *value = vm->frm;
         break;
-    case RV_CSR_SCAUSE:
-        *value = vm->scause;
-        break;
-    case RV_CSR_STVAL:
-        *value = vm->stval;
+    default: /* RV_CSR_FCSR */
+        *value = (vm->frm << 5) | vm->fflags;
         break;
-    default:
-        vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
     }
 }
 
-static void csr_write(hart_t *vm, uint16_t addr, uint32_t value)
+static void csr_write_fp(hart_t *vm, uint16_t addr, uint32_t value)
 {
+    if (!fp_enabled(vm))
+        return;
+    switch (addr) {
+    case RV_CSR_FFLAGS:
+        vm->fflags = value & MASK(5);
+        break;
+    case RV_CSR_FRM:
+        vm->frm = value & MASK(3);
+        break;
+    default: /* RV_CSR_FCSR */
+        vm->fflags = value & MASK(5);
+        vm->frm = (value >> 5) & MASK(3);
+        break;
+    }
+    vm->sstatus_fs = RV_FS_DIRTY;
+}
+
+/* PMU. The counters count emulator events rather than cycles or cache misses
+ * of a real core, which makes them report the cost of emulating the guest.
+ */
+
+static inline uint64_t pmu_event_count(const hart_t *vm, uint32_t event)
+{
+    return event == RV_EVENT_INSTRET ? vm->instret : vm->events[event];
+}
+
+static void pmu_update_next(hart_t *vm, uint32_t event)
+{
+    uint64_t next = UINT64_MAX;
+    for (uint32_t i = 0; i < PMU_N_COUNTERS; i++) {
+        const pmu_counter_t *c = &vm->pmu[i];
+        if (c->running && c->event == event && c->wrap_at < next)
+            next = c->wrap_at;
+    }
+    vm->pmu_next[event] = next;
+}
+
+void vm_pmu_configure(hart_t *vm, uint32_t idx, uint32_t event)
+{
+    vm_pmu_stop(vm, idx);
+    vm->pmu[idx].event = event;
+    vm->pmu[idx].value = 0;
+}
+
+void vm_pmu_start(hart_t *vm, uint32_t idx)
+{
+    pmu_counter_t *c = &vm->pmu[idx];
+    if (c->running || c->event == RV_N_EVENTS)
+        return;
+    uint64_t count = pmu_event_count(vm, c->event);
+    c->running = true;
+    c->base = count - c->value;
+    /* the counter wraps around after another 2^64 - value events */
+    uint64_t left = -c->value;
+    c->wrap_at =
+        c->value && count <= UINT64_MAX - left ? count + left : UINT64_MAX;
+    vm->pmu_overflow &= ~(1U << (PMU_FIRST_COUNTER + idx));
+    pmu_update_next(vm, c->event);
+}
+
+void vm_pmu_stop(hart_t *vm, uint32_t idx)
+{
+    pmu_counter_t *c = &vm->pmu[idx];
+    if (!c->running)
+        return;
+    c->value = vm_pmu_read(vm, idx);
+    c->running = false;
+    pmu_update_next(vm, c->event);
+}
+
+uint64_t vm_pmu_read(const hart_t *vm, uint32_t idx)
+{
+    const pmu_counter_t *c = &vm->pmu[idx];
+    if (!c->running)
+        return c->value;
+    return pmu_event_count(vm, c->event) - c->base;
+}
+
+void vm_pmu_write(hart_t *vm, uint32_t idx, uint64_t value)
+{
+    bool running = vm->pmu[idx].running;
+    vm_pmu_stop(vm, idx);
+    vm->pmu[idx].value = value;
+    if (running) {
+        /* restarting must not clear the overflow bit */
+        uint32_t overflow = vm->pmu_overflow;
+        vm_pmu_start(vm, idx);
+        vm->pmu_overflow = overflow;
+    }
+}
+
+void vm_pmu_overflow(hart_t *vm, uint32_t event)
+{
+    uint64_t count = pmu_event_count(vm, event);
+    for (uint32_t i = 0; i < PMU_N_COUNTERS; i++) {
+        pmu_counter_t *c = &vm->pmu[i];
+        if (!c->running || c->event != event || c->wrap_at > count)
+            continue;
+        c->wrap_at = UINT64_MAX;
+        uint32_t bit = 1U << (PMU_FIRST_COUNTER + i);
+        if (!(vm->pmu_overflow & bit)) {
+            vm->pmu_overflow |= bit;
+            vm_set_pending(vm, RV_INT_LCOFI_BIT, true);
+        }
+    }
+    pmu_update_next(vm, event);
+}
+
+/* CSR instructions */
+
+static inline void set_dest(hart_t *vm, uint32_t insn, uint32_t x)
+{
+    uint8_t rd = decode_rd(insn);
+    if (rd)
+        vm->x_regs[rd] = x;
+}
+
+/* clang-format off */
+#define SIE_MASK \
+    (RV_INT_LCOFI_BIT | RV_INT_SEI_BIT | RV_INT_STI_BIT | RV_INT_SSI_BIT)
+#define SIP_MASK \
+    (RV_INT_LCOFI_BIT | 0              | 0              | RV_INT_SSI_BIT)
+/* clang-format on */
+
+#define PRIV(x) ((emu_state_t *) x->priv)
+
+/* Sstc. Without M-mode, stimecmp is the very comparator that the SBI timer
+ * extension programs, so writing it raises or clears STIP right away.
+ */
+static void csr_write_stimecmp(hart_t *vm, uint16_t addr, uint32_t value)
+{
+    emu_state_t *data = PRIV(vm);
+    uint64_t *cmp = &data->mtimer.mtimecmp[vm->mhartid];
+    if (addr == RV_CSR_STIMECMP)
+        *cmp = (*cmp & ~(uint64_t) UINT32_MAX) | value;
+    else
+        *cmp = (*cmp & UINT32_MAX) | (uint64_t) value << 32;
+    aclint_mtimer_update_interrupts(vm, &data->mtimer);
+}
+
+/* hpmcounter3 and up count what the SBI PMU extension assigns them, the
+ * others read as zero. U-mode may only read those that scounteren enables.
+ */
+static void csr_read_hpm(hart_t *vm, uint16_t addr, uint32_t *value)
+{
+    uint32_t n = addr & MASK(5);
+    if (!vm->s_mode && !(vm->scounteren & (1U << n)))
+        return vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+
+    uint32_t idx = n - PMU_FIRST_COUNTER;
+    uint64_t count = idx < PMU_N_COUNTERS ? vm_pmu_read(vm, idx) : 0;
+    *value = addr & 0x80 ? count >> 32 : count;
+}
+
+static void csr_read(hart_t *vm, uint16_t addr, uint32_t *value)
+{
+    if ((addr >= RV_CSR_HPMCOUNTER3 && addr <= RV_CSR_HPMCOUNTER31) ||
+        (addr >= RV_CSR_HPMCOUNTER3H && addr <= RV_CSR_HPMCOUNTER31H))
+        return csr_read_hpm(vm, addr, value);
+
+    switch (addr) {
+    case RV_CSR_TIME:
+        *value = semu_timer_get(&vm->time);
+        return;
+    case RV_CSR_TIMEH:
+        *value = semu_timer_get(&vm->time) >> 32;
+        return;
+    case RV_CSR_CYCLE: /* one instruction per cycle */
+    case RV_CSR_INSTRET:
+        *value = vm->instret;
+        return;
+    case RV_CSR_CYCLEH:
+    case RV_CSR_INSTRETH:
+        *value = vm->instret >> 32;
+        return;
+    case RV_CSR_FFLAGS:
+    case RV_CSR_FRM:
+    case RV_CSR_FCSR:
+        csr_read_fp(vm, addr, value);
+        return;
+    default:
+        break;
+    }
+
+    if (!vm->s_mode) {
+        vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+        return;
+    }
+
+    switch (addr) {
+    case RV_CSR_SSTATUS:
+        *value = 0;
+        vm->sstatus_sie && (*value |= 1 << (1));
+        vm->sstatus_spie && (*value |= 1 << (5));
+        vm->sstatus_spp && (*value |= 1 << (8));
+        vm->sstatus_sum && (*value |= 1 << (18));
+        vm->sstatus_mxr && (*value |= 1 << (19));
+        *value |= vm->sstatus_fs << 13;
+        vm->sstatus_fs == RV_FS_DIRTY && (*value |= 1U << (31));
+        break;
+    case RV_CSR_SIE:
+        *value = vm->sie;
+        break;
+    case RV_CSR_SIP:
+        *value = __atomic_load_n(&vm->sip, __ATOMIC_RELAXED);
+        break;
+    case RV_CSR_STVEC:
+        *value = 0;
+        *value = vm->stvec_addr;
+        vm->stvec_vectored && (*value |= 1 << (0));
+        break;
+    case RV_CSR_SATP:
+        *value = vm->satp;
+        break;
+    case RV_CSR_SCOUNTEREN:
+        *value = vm->scounteren;
+        break;
+    case RV_CSR_SENVCFG:
+        *value = vm->senvcfg;
+        break;
+    case RV_CSR_SSCRATCH:
+        *value = vm->sscratch;
+        break;
+    case RV_CSR_SEPC:
+        *value = vm->sepc;
+        break;
+    case RV_CSR_SCAUSE:
+        *value = vm->scause;
+        break;
+    case RV_CSR_STVAL:
+        *value = vm->stval;
+        break;
+    case RV_CSR_STIMECMP:
+        *value = PRIV(vm)->mtimer.mtimecmp[vm->mhartid];
+        break;
+    case RV_CSR_STIMECMPH:
+        *value = PRIV(vm)->mtimer.mtimecmp[vm->mhartid] >> 32;
+        break;
+    case RV_CSR_SCOUNTOVF:
+        *value = vm->pmu_overflow;
+        break;
+    default:
+        vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+    }
+}
+
+static void csr_write(hart_t *vm, uint16_t addr, uint32_t value)
+{
+    switch (addr) {
+    case RV_CSR_FFLAGS:
+    case RV_CSR_FRM:
+    case RV_CSR_FCSR:
+        csr_write_fp(vm, addr, value);
+        return;
+    default:
+        break;
+    }
+
     if (!vm->s_mode) {
         vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
         return;
@@ -517,6 +1211,11 @@ static void csr_write(hart_t *vm, uint16_t addr, uint32_t value)
         vm->sstatus_sie = (value & (1 << (1))) != 0;
         vm->sstatus_spie = (value & (1 << (5))) != 0;
         vm->sstatus_spp = (value & (1 << (8))) != 0;
+        vm->sstatus_fs = (value >> 13) & MASK(2);
+        /* cached data translations depend on SUM and MXR */
+        if (vm->sstatus_sum != ((value & (1 << (18))) != 0) ||
+            vm->sstatus_mxr != ((value & (1 << (19))) != 0))
+            mmu_tlb_flush(vm);
         vm->sstatus_sum = (value & (1 << (18))) != 0;
         vm->sstatus_mxr = (value & (1 << (19))) != 0;
         break;
@@ -525,9 +1224,9 @@ static void csr_write(hart_t *vm, uint16_t addr, uint32_t value)
         vm->sie = value;
         break;
     case RV_CSR_SIP:
-        value &= SIP_MASK;
-        value |= vm->sip & ~SIP_MASK;
-        vm->sip = value;
+        /* the other bits belong to devices, which may update them meanwhile */
+        vm_set_pending(vm, SIP_MASK & value, true);
+        vm_set_pending(vm, SIP_MASK & ~value, false);
         break;
     case RV_CSR_STVEC:
         vm->stvec_addr = value;
@@ -540,11 +1239,14 @@ static void csr_write(hart_t *vm, uint16_t addr, uint32_t value)
     case RV_CSR_SCOUNTEREN:
         vm->scounteren = value;
         break;
+    case RV_CSR_SENVCFG:
+        vm->senvcfg = value & RV_ENVCFG_CBZE;
+        break;
     case RV_CSR_SSCRATCH:
         vm->sscratch = value;
         break;
     case RV_CSR_SEPC:
-        vm->sepc = value;
+        vm->sepc = value & ~1;
         break;
     case RV_CSR_SCAUSE:
         vm->scause = value;
@@ -552,6 +1254,10 @@ static void csr_write(hart_t *vm, uint16_t addr, uint32_t value)
     case RV_CSR_STVAL:
         vm->stval = value;
         break;
+    case RV_CSR_STIMECMP:
+    case RV_CSR_STIMECMPH:
+        csr_write_stimecmp(vm, addr, value);
+        break;
     default:
         vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
     }
@@ -620,126 +1326,108 @@ static void op_system(hart_t *vm, uint32_t insn)
 
 /* Unprivileged instructions */
 
-static uint32_t op_mul(uint32_t insn, uint32_t a, uint32_t b)
-{
-    /* TODO: Test ifunc7 zeros */
-    switch (decode_func3(insn)) {
-    case 0b000: { /* MUL */
-        const int64_t _a = (int32_t) a;
-        const int64_t _b = (int32_t) b;
-        return ((uint64_t) (_a * _b)) & ((1ULL << 32) - 1);
-    }
-    case 0b001: { /* MULH */
-        const int64_t _a = (int32_t) a;
-        const int64_t _b = (int32_t) b;
-        return ((uint64_t) (_a * _b)) >> 32;
-    }
-    case 0b010: { /* MULHSU */
-        const int64_t _a = (int32_t) a;
-        const uint64_t _b = b;
-        return ((uint64_t) (_a * _b)) >> 32;
-    }
-    case 0b011: /* MULHU */
-        return (uint32_t) ((((uint64_t) a) * ((uint64_t) b)) >> 32);
-    case 0b100: /* DIV */
-        return b ? (a == 0x80000000 && (int32_t) b == -1)
-                       ? 0x80000000
-                       : (uint32_t) (((int32_t) a) / ((int32_t) b))
-                 : 0xFFFFFFFF;
-    case 0b101: /* DIVU */
-        return b ? (a / b) : 0xFFFFFFFF;
-    case 0b110: /* REM */
-        return b ? (a == 0x80000000 && (int32_t) b == -1)
-                       ? 0
-                       : (uint32_t) (((int32_t) a) % ((int32_t) b))
-                 : a;
-    case 0b111: /* REMU */
-        return b ? (a % b) : a;
-    }
-    __builtin_unreachable();
-}
-
-#define NEG_BIT (insn & (1 << 30))
-static uint32_t op_rv32i(uint32_t insn, bool is_reg, uint32_t a, uint32_t b)
-{
-    /* TODO: Test ifunc7 zeros */
-    switch (decode_func3(insn)) {
-    case 0b000: /* IFUNC_ADD */
-        return a + ((is_reg && NEG_BIT) ? -b : b);
-    case 0b010: /* IFUNC_SLT */
-        return ((int32_t) a) < ((int32_t) b);
-    case 0b011: /* IFUNC_SLTU */
-        return a < b;
-    case 0b100: /* IFUNC_XOR */
-        return a ^ b;
-    case 0b110: /* IFUNC_OR */
-        return a | b;
-    case 0b111: /* IFUNC_AND */
-        return a & b;
-    case 0b001: /* IFUNC_SLL */
-        return a << (b & MASK(5));
-    case 0b101: /* IFUNC_SRL */
-        return NEG_BIT ? (uint32_t) (((int32_t) a) >> (b & MASK(5))) /* SRA */
-                       : a >> (b & MASK(5)) /* SRL */;
-    }
-    __builtin_unreachable();
-}
-#undef NEG_BIT
-
-static bool op_jmp(hart_t *vm, uint32_t insn, uint32_t a, uint32_t b)
+/* Return the word that the read-modify-write AMO "funct5" stores, given the
+ * "value" in memory and the operand "value2".
+ */
+static inline uint32_t amo_apply(uint8_t funct5,
+                                 uint32_t value,
+                                 uint32_t value2)
 {
-    switch (decode_func3(insn)) {
-    case 0b000: /* BFUNC_BEQ */
-        return a == b;
-    case 0b001: /* BFUNC_BNE */
-        return a != b;
-    case 0b110: /* BFUNC_BLTU */
-        return a < b;
-    case 0b111: /* BFUNC_BGEU */
-        return a >= b;
-    case 0b100: /* BFUNC_BLT */
-        return ((int32_t) a) < ((int32_t) b);
-    case 0b101: /* BFUNC_BGE */
-        return ((int32_t) a) >= ((int32_t) b);
+    switch (funct5) {
+    case 0b00001: /* AMOSWAP */
+        return value2;
+    case 0b00000: /* AMOADD */
+        return value + value2;
+    case 0b00100: /* AMOXOR */
+        return value ^ value2;
+    case 0b01100: /* AMOAND */
+        return value & value2;
+    case 0b01000: /* AMOOR */
+        return value | value2;
+    case 0b10000: /* AMOMIN */
+        return ((int32_t) value) < ((int32_t) value2) ? value : value2;
+    case 0b10100: /* AMOMAX */
+        return ((int32_t) value) > ((int32_t) value2) ? value : value2;
+    case 0b11000: /* AMOMINU */
+        return value < value2 ? value : value2;
+    default: /* AMOMAXU */
+        return value > value2 ? value : value2;
     }
-    vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
-    return false;
 }
 
-static void do_jump(hart_t *vm, uint32_t addr)
+/* AMOs on RAM are carried out with host atomics, so that they stay atomic
+ * while other harts run on other host threads.
+ */
+static void op_amo_rmw(hart_t *vm, uint32_t insn, uint32_t addr)
 {
-    if (unlikely(addr & 0b11))
-        vm_set_exception(vm, RV_EXC_PC_MISALIGN, addr);
-    else
-        vm->pc = addr;
+    if (addr & 0b11)
+        return vm_set_exception(vm, RV_EXC_STORE_MISALIGN, addr);
+    uint8_t funct5 = decode_func5(insn);
+    uint32_t value, value2 = read_rs2(vm, insn), paddr;
+    uint32_t *word = mmu_amo_word(vm, addr, &paddr);
+    if (vm->error)
+        return;
+    mmu_store_notify(vm, paddr);
+
+    if (word) {
+        value = __atomic_load_n(word, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(word, &value,
+                                            amo_apply(funct5, value, value2),
+                                            true, __ATOMIC_SEQ_CST,
+                                            __ATOMIC_RELAXED))
+            ;
+    } else {
+        vm->mem_load(vm, paddr, RV_MEM_LW, &value);
+        if (vm->error)
+            return;
+        vm->mem_store(vm, paddr, RV_MEM_SW, amo_apply(funct5, value, value2));
+        if (vm->error)
+            return;
+    }
+    set_dest(vm, insn, value);
 }
 
-static void op_jump_link(hart_t *vm, uint32_t insn, uint32_t addr)
+/* SC succeeds if the reservation of LR is still held and the word still holds
+ * the value LR loaded. The latter catches stores of other host threads that
+ * race with the reservation check.
+ */
+static void op_sc(hart_t *vm, uint32_t insn, uint32_t addr)
 {
-    if (unlikely(addr & 0b11)) {
-        vm_set_exception(vm, RV_EXC_PC_MISALIGN, addr);
-    } else {
-        set_dest(vm, insn, vm->pc);
-        vm->pc = addr;
+    if (addr & 0b11)
+        return vm_set_exception(vm, RV_EXC_STORE_MISALIGN, addr);
+    uint32_t value = read_rs2(vm, insn), paddr;
+    uint32_t *word = mmu_amo_word(vm, addr, &paddr);
+    if (vm->error)
+        return;
+
+    uint32_t reservation = lr_reserve(vm, 0);
+    bool ok = reservation == (paddr | 1);
+    if (ok) {
+        mmu_store_notify(vm, paddr);
+        if (word) {
+            uint32_t expected = vm->lr_value;
+            ok = __atomic_compare_exchange_n(word, &expected, value, false,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED);
+        } else {
+            vm->mem_store(vm, paddr, RV_MEM_SW, value);
+            if (vm->error)
+                return;
+        }
     }
+    if (!ok) {
+        STATS_INC(vm, sc_failures);
+        vm_event(vm, RV_EVENT_SC_FAIL);
+    }
+    set_dest(vm, insn, ok ? 0 : 1);
 }
 
-#define AMO_OP(STORED_EXPR)                                   \
-    do {                                                      \
-        value2 = read_rs2(vm, insn);                          \
-        mmu_load(vm, addr, RV_MEM_LW, &value, false);         \
-        if (vm->error)                                        \
-            return;                                           \
-        set_dest(vm, insn, value);                            \
-        mmu_store(vm, addr, RV_MEM_SW, (STORED_EXPR), false); \
-    } while (0)
-
 static void op_amo(hart_t *vm, uint32_t insn)
 {
     if (unlikely(decode_func3(insn) != 0b010 /* amo.w */))
         return vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
     uint32_t addr = read_rs1(vm, insn);
-    uint32_t value, value2;
+    uint32_t value;
     switch (decode_func5(insn)) {
     case 0b00010: /* AMO_LR */
         if (addr & 0b11)
@@ -752,40 +1440,19 @@ static void op_amo(hart_t *vm, uint32_t insn)
         set_dest(vm, insn, value);
         break;
     case 0b00011: /* AMO_SC */
-        if (addr & 0b11)
-            return vm_set_exception(vm, RV_EXC_STORE_MISALIGN, addr);
-        bool ok = mmu_store(vm, addr, RV_MEM_SW, read_rs2(vm, insn), true);
-        if (vm->error)
-            return;
-        set_dest(vm, insn, ok ? 0 : 1);
+        op_sc(vm, insn, addr);
         break;
 
     case 0b00001: /* AMOSWAP */
-        AMO_OP(value2);
-        break;
     case 0b00000: /* AMOADD */
-        AMO_OP(value + value2);
-        break;
     case 0b00100: /* AMOXOR */
-        AMO_OP(value ^ value2);
-        break;
     case 0b01100: /* AMOAND */
-        AMO_OP(value & value2);
-        break;
     case 0b01000: /* AMOOR */
-        AMO_OP(value | value2);
-        break;
     case 0b10000: /* AMOMIN */
-        AMO_OP(((int32_t) value) < ((int32_t) value2) ? value : value2);
-        break;
     case 0b10100: /* AMOMAX */
-        AMO_OP(((int32_t) value) > ((int32_t) value2) ? value : value2);
-        break;
     case 0b11000: /* AMOMINU */
-        AMO_OP(value < value2 ? value : value2);
-        break;
     case 0b11100: /* AMOMAXU */
-        AMO_OP(value > value2 ? value : value2);
+        op_amo_rmw(vm, insn, addr);
         break;
     default:
         vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
@@ -793,105 +1460,1790 @@ static void op_amo(hart_t *vm, uint32_t insn)
     }
 }
 
-void vm_init(hart_t *vm)
+/* Handlers of pre-decoded instructions. When a handler runs, vm->pc has
+ * already been advanced past the instruction and vm->current_pc holds its
+ * address.
+ */
+
+static inline void set_rd(hart_t *vm, const rv_insn_t *ir, uint32_t x)
 {
-    mmu_invalidate(vm);
+    if (ir->rd)
+        vm->x_regs[ir->rd] = x;
 }
 
-#define PRIV(x) ((emu_state_t *) x->priv)
-void vm_step(hart_t *vm)
+#define RS1 (vm->x_regs[ir->rs1])
+#define RS2 (vm->x_regs[ir->rs2])
+#define IMM (ir->imm)
+
+#define RV_EXEC(inst, code)                                           \
+    static void do_##inst(hart_t *vm UNUSED, const rv_insn_t *ir UNUSED) \
+    {                                                                 \
+        code;                                                         \
+    }
+
+#define RV_EXEC_ALU(inst, expr) RV_EXEC(inst, set_rd(vm, ir, (expr)))
+
+/* With the C extension, instructions only need 2-byte alignment. Jump offsets
+ * are even and JALR clears bit 0, so no jump raises a misaligned exception.
+ */
+static void do_jump(hart_t *vm, uint32_t addr)
 {
-    if (vm->hsm_status != SBI_HSM_STATE_STARTED)
-        return;
+    vm->pc = addr;
+}
+
+static void op_jump_link(hart_t *vm, const rv_insn_t *ir, uint32_t addr)
+{
+    set_rd(vm, ir, vm->pc);
+    vm->pc = addr;
+}
 
+FORCE_INLINE void op_load(hart_t *vm, const rv_insn_t *ir, uint8_t width)
+{
+    uint32_t value;
+    mmu_load(vm, RS1 + IMM, width, &value, false);
     if (unlikely(vm->error))
         return;
+    set_rd(vm, ir, value);
+}
 
-    vm->current_pc = vm->pc;
-    if ((vm->sstatus_sie || !vm->s_mode) && (vm->sip & vm->sie)) {
-        uint32_t applicable = (vm->sip & vm->sie);
-        uint8_t idx = ilog2(applicable);
-        if (idx == 1) {
-            emu_state_t *data = PRIV(vm);
-            data->sswi.ssip[vm->mhartid] = 0;
-        }
-        vm->exc_cause = (1U << 31) | idx;
-        vm->stval = 0;
-        hart_trap(vm);
-    }
+RV_EXEC(nop, )
+RV_EXEC(illegal, vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0))
 
-    uint32_t insn;
-    mmu_fetch(vm, vm->pc, &insn);
-    if (unlikely(vm->error))
-        return;
+RV_EXEC_ALU(lui, IMM)
+RV_EXEC_ALU(auipc, IMM + vm->current_pc)
+RV_EXEC(jal, op_jump_link(vm, ir, IMM + vm->current_pc))
+RV_EXEC(jalr, op_jump_link(vm, ir, (IMM + RS1) & ~1))
 
-    vm->pc += 4;
-    /* Assume no integer overflow */
-    vm->instret++;
+/* clang-format off */
+RV_EXEC(beq,  if (RS1 == RS2) do_jump(vm, IMM + vm->current_pc))
+RV_EXEC(bne,  if (RS1 != RS2) do_jump(vm, IMM + vm->current_pc))
+RV_EXEC(blt,  if ((int32_t) RS1 < (int32_t) RS2)
+                  do_jump(vm, IMM + vm->current_pc))
+RV_EXEC(bge,  if ((int32_t) RS1 >= (int32_t) RS2)
+                  do_jump(vm, IMM + vm->current_pc))
+RV_EXEC(bltu, if (RS1 < RS2) do_jump(vm, IMM + vm->current_pc))
+RV_EXEC(bgeu, if (RS1 >= RS2) do_jump(vm, IMM + vm->current_pc))
+/* clang-format on */
 
-    uint32_t insn_opcode = insn & MASK(7), value;
-    switch (insn_opcode) {
-    case RV32_OP_IMM:
-        set_dest(vm, insn,
-                 op_rv32i(insn, false, read_rs1(vm, insn), decode_i(insn)));
-        break;
-    case RV32_OP:
-        if (!(insn & (1 << 25)))
-            set_dest(
-                vm, insn,
-                op_rv32i(insn, true, read_rs1(vm, insn), read_rs2(vm, insn)));
-        else
-            set_dest(vm, insn,
-                     op_mul(insn, read_rs1(vm, insn), read_rs2(vm, insn)));
-        break;
-    case RV32_LUI:
-        set_dest(vm, insn, decode_u(insn));
-        break;
-    case RV32_AUIPC:
-        set_dest(vm, insn, decode_u(insn) + vm->current_pc);
-        break;
-    case RV32_JAL:
-        op_jump_link(vm, insn, decode_j(insn) + vm->current_pc);
-        break;
-    case RV32_JALR:
-        op_jump_link(vm, insn, (decode_i(insn) + read_rs1(vm, insn)) & ~1);
-        break;
-    case RV32_BRANCH:
-        if (op_jmp(vm, insn, read_rs1(vm, insn), read_rs2(vm, insn)))
-            do_jump(vm, decode_b(insn) + vm->current_pc);
-        break;
-    case RV32_LOAD:
-        mmu_load(vm, read_rs1(vm, insn) + decode_i(insn), decode_func3(insn),
-                 &value, false);
-        if (unlikely(vm->error))
-            return;
-        set_dest(vm, insn, value);
-        break;
-    case RV32_STORE:
-        mmu_store(vm, read_rs1(vm, insn) + decode_s(insn), decode_func3(insn),
-                  read_rs2(vm, insn), false);
-        if (unlikely(vm->error))
-            return;
-        break;
-    case RV32_MISC_MEM:
-        switch (decode_func3(insn)) {
-        case 0b000: /* MM_FENCE */
-        case 0b001: /* MM_FENCE_I */
-                    /* TODO: implement for multi-threading */
-            break;
+RV_EXEC(lb, op_load(vm, ir, RV_MEM_LB))
+RV_EXEC(lh, op_load(vm, ir, RV_MEM_LH))
+RV_EXEC(lw, op_load(vm, ir, RV_MEM_LW))
+RV_EXEC(lbu, op_load(vm, ir, RV_MEM_LBU))
+RV_EXEC(lhu, op_load(vm, ir, RV_MEM_LHU))
+RV_EXEC(sb, mmu_store(vm, RS1 + IMM, RV_MEM_SB, RS2))
+RV_EXEC(sh, mmu_store(vm, RS1 + IMM, RV_MEM_SH, RS2))
+RV_EXEC(sw, mmu_store(vm, RS1 + IMM, RV_MEM_SW, RS2))
+
+RV_EXEC_ALU(addi, RS1 + IMM)
+RV_EXEC_ALU(slti, (int32_t) RS1 < (int32_t) IMM)
+RV_EXEC_ALU(sltiu, RS1 < IMM)
+RV_EXEC_ALU(xori, RS1 ^ IMM)
+RV_EXEC_ALU(ori, RS1 | IMM)
+RV_EXEC_ALU(andi, RS1 & IMM)
+RV_EXEC_ALU(slli, RS1 << (IMM & MASK(5)))
+RV_EXEC_ALU(srli, RS1 >> (IMM & MASK(5)))
+RV_EXEC_ALU(srai, (uint32_t) ((int32_t) RS1 >> (IMM & MASK(5))))
+
+RV_EXEC_ALU(add, RS1 + RS2)
+RV_EXEC_ALU(sub, RS1 - RS2)
+RV_EXEC_ALU(sll, RS1 << (RS2 & MASK(5)))
+RV_EXEC_ALU(slt, (int32_t) RS1 < (int32_t) RS2)
+RV_EXEC_ALU(sltu, RS1 < RS2)
+RV_EXEC_ALU(xor, RS1 ^ RS2)
+RV_EXEC_ALU(srl, RS1 >> (RS2 & MASK(5)))
+RV_EXEC_ALU(sra, (uint32_t) ((int32_t) RS1 >> (RS2 & MASK(5))))
+RV_EXEC_ALU(or, RS1 | RS2)
+RV_EXEC_ALU(and, RS1 & RS2)
+
+RV_EXEC_ALU(mul, RS1 * RS2)
+RV_EXEC_ALU(mulh, ((int64_t) (int32_t) RS1 * (int64_t) (int32_t) RS2) >> 32)
+RV_EXEC_ALU(mulhsu, ((uint64_t) (int64_t) (int32_t) RS1 * (uint64_t) RS2) >> 32)
+RV_EXEC_ALU(mulhu, ((uint64_t) RS1 * (uint64_t) RS2) >> 32)
+RV_EXEC_ALU(div,
+            RS2 ? (RS1 == 0x80000000 && (int32_t) RS2 == -1)
+                      ? 0x80000000
+                      : (uint32_t) ((int32_t) RS1 / (int32_t) RS2)
+                : 0xFFFFFFFF)
+RV_EXEC_ALU(divu, RS2 ? RS1 / RS2 : 0xFFFFFFFF)
+RV_EXEC_ALU(rem,
+            RS2 ? (RS1 == 0x80000000 && (int32_t) RS2 == -1)
+                      ? 0
+                      : (uint32_t) ((int32_t) RS1 % (int32_t) RS2)
+                : RS1)
+RV_EXEC_ALU(remu, RS2 ? RS1 % RS2 : RS1)
+
+/* Zba, Zbb and Zbs */
+
+static inline uint32_t rotr32(uint32_t x, uint32_t n)
+{
+    n &= MASK(5);
+    return (x >> n) | (x << ((32 - n) & MASK(5)));
+}
+
+/* Set each byte of the result to 0xFF if the byte of "x" is non-zero */
+static inline uint32_t orc_b(uint32_t x)
+{
+    uint32_t high = (((x & 0x7F7F7F7F) + 0x7F7F7F7F) | x) & 0x80808080;
+    return (high >> 7) * 0xFF;
+}
+
+/* clang-format off */
+RV_EXEC_ALU(sh1add, (RS1 << 1) + RS2)
+RV_EXEC_ALU(sh2add, (RS1 << 2) + RS2)
+RV_EXEC_ALU(sh3add, (RS1 << 3) + RS2)
+
+RV_EXEC_ALU(andn,   RS1 & ~RS2)
+RV_EXEC_ALU(orn,    RS1 | ~RS2)
+RV_EXEC_ALU(xnor,   ~(RS1 ^ RS2))
+RV_EXEC_ALU(clz,    RS1 ? __builtin_clz(RS1) : 32)
+RV_EXEC_ALU(ctz,    RS1 ? __builtin_ctz(RS1) : 32)
+RV_EXEC_ALU(cpop,   __builtin_popcount(RS1))
+RV_EXEC_ALU(max,    (int32_t) RS1 > (int32_t) RS2 ? RS1 : RS2)
+RV_EXEC_ALU(maxu,   RS1 > RS2 ? RS1 : RS2)
+RV_EXEC_ALU(min,    (int32_t) RS1 < (int32_t) RS2 ? RS1 : RS2)
+RV_EXEC_ALU(minu,   RS1 < RS2 ? RS1 : RS2)
+RV_EXEC_ALU(sext_b, (uint32_t) (int32_t) (int8_t) RS1)
+RV_EXEC_ALU(sext_h, (uint32_t) (int32_t) (int16_t) RS1)
+RV_EXEC_ALU(zext_h, RS1 & MASK(16))
+RV_EXEC_ALU(rol,    rotr32(RS1, -RS2))
+RV_EXEC_ALU(ror,    rotr32(RS1, RS2))
+RV_EXEC_ALU(rori,   rotr32(RS1, IMM))
+RV_EXEC_ALU(orc_b,  orc_b(RS1))
+RV_EXEC_ALU(rev8,   __builtin_bswap32(RS1))
+
+RV_EXEC_ALU(bclr,   RS1 & ~(1U << (RS2 & MASK(5))))
+RV_EXEC_ALU(bclri,  RS1 & ~(1U << (IMM & MASK(5))))
+RV_EXEC_ALU(bext,   (RS1 >> (RS2 & MASK(5))) & 1)
+RV_EXEC_ALU(bexti,  (RS1 >> (IMM & MASK(5))) & 1)
+RV_EXEC_ALU(binv,   RS1 ^ (1U << (RS2 & MASK(5))))
+RV_EXEC_ALU(binvi,  RS1 ^ (1U << (IMM & MASK(5))))
+RV_EXEC_ALU(bset,   RS1 | (1U << (RS2 & MASK(5))))
+RV_EXEC_ALU(bseti,  RS1 | (1U << (IMM & MASK(5))))
+/* clang-format on */
+
+#if SEMU_HAS(SMP_THREADS)
+/* With one host thread per hart, the host may reorder accesses across harts */
+RV_EXEC(fence, __atomic_thread_fence(__ATOMIC_SEQ_CST))
+#else
+RV_EXEC(fence, )
+#endif
+RV_EXEC(fencei, vm_flush_blocks(vm))
+#if SEMU_HAS(SMP_THREADS)
+/* Each hart has a host CPU of its own, so pass the hint on to it */
+#if defined(__x86_64__) || defined(__i386__)
+RV_EXEC(pause, __builtin_ia32_pause())
+#elif defined(__aarch64__)
+RV_EXEC(pause, __asm__ volatile("yield"))
+#else
+RV_EXEC(pause, )
+#endif
+#else
+RV_EXEC(pause, vm->yield = true)
+#endif
+RV_EXEC(cbo_zero, op_cbo_zero(vm, RS1))
+RV_EXEC(amo, op_amo(vm, IMM))
+RV_EXEC(system, op_system(vm, IMM))
+
+/* F and D extensions */
+
+#define F32_SIGN 0x80000000U
+#define F64_SIGN 0x8000000000000000ULL
+#define F32_CANONICAL_NAN 0x7FC00000U
+#define F64_CANONICAL_NAN 0x7FF8000000000000ULL
+#define F32_BOX 0xFFFFFFFF00000000ULL
+
+static const int fp_host_round[] = {
+    [RV_RM_RNE] = FE_TONEAREST,
+    [RV_RM_RTZ] = FE_TOWARDZERO,
+    [RV_RM_RDN] = FE_DOWNWARD,
+    [RV_RM_RUP] = FE_UPWARD,
+};
+
+/* Return the rounding mode "rm" of an instruction, or frm for DYN. Return -1
+ * and raise an illegal instruction exception if the mode is reserved.
+ */
+static inline int fp_rm(hart_t *vm, uint32_t rm)
+{
+    if (rm == RV_RM_DYN)
+        rm = vm->frm;
+    if (likely(rm <= RV_RM_RMM))
+        return rm;
+    vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+    return -1;
+}
+
+/* Switch the host to the rounding mode of an instruction, and back. Ties of
+ * RMM are rounded to even, as hosts have no such mode.
+ */
+static inline int fp_round_begin(hart_t *vm, uint32_t rm)
+{
+    int mode = fp_rm(vm, rm);
+    if (unlikely(mode > RV_RM_RNE && mode != RV_RM_RMM))
+        fesetround(fp_host_round[mode]);
+    return mode;
+}
+
+static inline void fp_round_end(int mode)
+{
+    if (unlikely(mode > RV_RM_RNE && mode != RV_RM_RMM))
+        fesetround(FE_TONEAREST);
+}
+
+/* Return the bits of a single-precision register, which reads as the
+ * canonical NaN unless properly NaN-boxed
+ */
+static inline uint32_t f32_bits(const hart_t *vm, uint8_t reg)
+{
+    uint64_t x = vm->f_regs[reg];
+    return (x & F32_BOX) == F32_BOX ? (uint32_t) x : F32_CANONICAL_NAN;
+}
+
+static inline float f32_get(const hart_t *vm, uint8_t reg)
+{
+    uint32_t bits = f32_bits(vm, reg);
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static inline void f32_set_bits(hart_t *vm, uint8_t reg, uint32_t bits)
+{
+    vm->f_regs[reg] = F32_BOX | bits;
+    vm->sstatus_fs = RV_FS_DIRTY;
+}
+
+/* Write the result of an operation, where any NaN becomes the canonical one */
+static inline void f32_set(hart_t *vm, uint8_t reg, float x)
+{
+    uint32_t bits = F32_CANONICAL_NAN;
+    if (likely(!isnan(x)))
+        memcpy(&bits, &x, sizeof(bits));
+    f32_set_bits(vm, reg, bits);
+}
+
+static inline double f64_get(const hart_t *vm, uint8_t reg)
+{
+    double x;
+    memcpy(&x, &vm->f_regs[reg], sizeof(x));
+    return x;
+}
+
+static inline void f64_set_bits(hart_t *vm, uint8_t reg, uint64_t bits)
+{
+    vm->f_regs[reg] = bits;
+    vm->sstatus_fs = RV_FS_DIRTY;
+}
+
+static inline void f64_set(hart_t *vm, uint8_t reg, double x)
+{
+    uint64_t bits = F64_CANONICAL_NAN;
+    if (likely(!isnan(x)))
+        memcpy(&bits, &x, sizeof(bits));
+    f64_set_bits(vm, reg, bits);
+}
+
+static inline bool f32_is_snan(uint32_t bits)
+{
+    return (bits & 0x7FC00000) == 0x7F800000 && (bits & MASK(22));
+}
+
+static inline bool f64_is_snan(uint64_t bits)
+{
+    return (bits & 0x7FF8000000000000ULL) == 0x7FF0000000000000ULL &&
+           (bits & 0x0007FFFFFFFFFFFFULL);
+}
+
+/* Loads and stores of doublewords are split into two words. They must not
+ * cross a page, so that the first access cannot succeed alone.
+ */
+static inline bool fp_access_ok(hart_t *vm, uint32_t addr, uint32_t cause)
+{
+    if (likely(!(addr & 0b11) &&
+               (addr & MASK(RV_PAGE_SHIFT)) <= RV_PAGE_SIZE - 8))
+        return true;
+    vm_set_exception(vm, cause, addr);
+    return false;
+}
+
+static void op_flw(hart_t *vm, const rv_insn_t *ir)
+{
+    uint32_t value;
+    mmu_load(vm, vm->x_regs[ir->rs1] + ir->imm, RV_MEM_LW, &value, false);
+    if (unlikely(vm->error))
+        return;
+    f32_set_bits(vm, ir->rd, value);
+}
+
+static void op_fld(hart_t *vm, const rv_insn_t *ir)
+{
+    uint32_t addr = vm->x_regs[ir->rs1] + ir->imm, lo, hi;
+    if (unlikely(!fp_access_ok(vm, addr, RV_EXC_LOAD_MISALIGN)))
+        return;
+    mmu_load(vm, addr, RV_MEM_LW, &lo, false);
+    if (unlikely(vm->error))
+        return;
+    mmu_load(vm, addr + 4, RV_MEM_LW, &hi, false);
+    if (unlikely(vm->error))
+        return;
+    f64_set_bits(vm, ir->rd, ((uint64_t) hi << 32) | lo);
+}
+
+static void op_fsd(hart_t *vm, const rv_insn_t *ir)
+{
+    uint32_t addr = vm->x_regs[ir->rs1] + ir->imm;
+    uint64_t value = vm->f_regs[ir->rs2];
+    if (unlikely(!fp_access_ok(vm, addr, RV_EXC_STORE_MISALIGN)))
+        return;
+    mmu_store(vm, addr, RV_MEM_SW, (uint32_t) value);
+    if (unlikely(vm->error))
+        return;
+    mmu_store(vm, addr + 4, RV_MEM_SW, (uint32_t) (value >> 32));
+}
+
+/* RISC-V requires infinity times zero to raise the invalid operation exception
+ * even if the addend is a quiet NaN, which hosts do not necessarily do.
+ */
+static inline void fp_check_fma(hart_t *vm, double a, double b, double c)
+{
+    if (unlikely(isnan(c)) && ((isinf(a) && b == 0) || (a == 0 && isinf(b)))) {
+        vm->fflags |= RV_FFLAG_NV;
+        vm->sstatus_fs = RV_FS_DIRTY;
+    }
+}
+
+/* Rounded arithmetic. "op" is the RV_INSN_* opcode of the instruction, which
+ * is a constant once inlined into the handler.
+ */
+FORCE_INLINE void op_f32_arith(hart_t *vm, const rv_insn_t *ir, uint8_t op)
+{
+    float a = f32_get(vm, ir->rs1), b = f32_get(vm, ir->rs2);
+    float c = f32_get(vm, ir->imm >> 3), r;
+    int mode = fp_round_begin(vm, ir->imm & MASK(3));
+    if (unlikely(mode < 0))
+        return;
+    switch (op) {
+    case RV_INSN_fmadd_s:
+    case RV_INSN_fmsub_s:
+    case RV_INSN_fnmsub_s:
+    case RV_INSN_fnmadd_s:
+        fp_check_fma(vm, a, b, c);
+        if (op == RV_INSN_fnmsub_s || op == RV_INSN_fnmadd_s)
+            a = -a;
+        if (op == RV_INSN_fmsub_s || op == RV_INSN_fnmadd_s)
+            c = -c;
+        r = fmaf(a, b, c);
+        break;
+    case RV_INSN_fadd_s:
+        r = a + b;
+        break;
+    case RV_INSN_fsub_s:
+        r = a - b;
+        break;
+    case RV_INSN_fmul_s:
+        r = a * b;
+        break;
+    case RV_INSN_fdiv_s:
+        r = a / b;
+        break;
+    default: /* fsqrt_s */
+        r = sqrtf(a);
+        break;
+    }
+    fp_round_end(mode);
+    f32_set(vm, ir->rd, r);
+}
+
+FORCE_INLINE void op_f64_arith(hart_t *vm, const rv_insn_t *ir, uint8_t op)
+{
+    double a = f64_get(vm, ir->rs1), b = f64_get(vm, ir->rs2);
+    double c = f64_get(vm, ir->imm >> 3), r;
+    int mode = fp_round_begin(vm, ir->imm & MASK(3));
+    if (unlikely(mode < 0))
+        return;
+    switch (op) {
+    case RV_INSN_fmadd_d:
+    case RV_INSN_fmsub_d:
+    case RV_INSN_fnmsub_d:
+    case RV_INSN_fnmadd_d:
+        fp_check_fma(vm, a, b, c);
+        if (op == RV_INSN_fnmsub_d || op == RV_INSN_fnmadd_d)
+            a = -a;
+        if (op == RV_INSN_fmsub_d || op == RV_INSN_fnmadd_d)
+            c = -c;
+        r = fma(a, b, c);
+        break;
+    case RV_INSN_fadd_d:
+        r = a + b;
+        break;
+    case RV_INSN_fsub_d:
+        r = a - b;
+        break;
+    case RV_INSN_fmul_d:
+        r = a * b;
+        break;
+    case RV_INSN_fdiv_d:
+        r = a / b;
+        break;
+    default: /* fsqrt_d */
+        r = sqrt(a);
+        break;
+    }
+    fp_round_end(mode);
+    f64_set(vm, ir->rd, r);
+}
+
+/* FSGNJ, FSGNJN and FSGNJX, selected by funct3 */
+static void op_fsgnj_s(hart_t *vm, const rv_insn_t *ir)
+{
+    uint32_t a = f32_bits(vm, ir->rs1), b = f32_bits(vm, ir->rs2);
+    uint32_t sign = ir->imm == 0b000 ? b : ir->imm == 0b001 ? ~b : a ^ b;
+    f32_set_bits(vm, ir->rd, (a & ~F32_SIGN) | (sign & F32_SIGN));
+}
+
+static void op_fsgnj_d(hart_t *vm, const rv_insn_t *ir)
+{
+    uint64_t a = vm->f_regs[ir->rs1], b = vm->f_regs[ir->rs2];
+    uint64_t sign = ir->imm == 0b000 ? b : ir->imm == 0b001 ? ~b : a ^ b;
+    f64_set_bits(vm, ir->rd, (a & ~F64_SIGN) | (sign & F64_SIGN));
+}
+
+/* FMIN and FMAX, selected by funct3. A NaN operand yields the other one, and
+ * -0.0 is less than +0.0.
+ */
+static void op_fminmax_s(hart_t *vm, const rv_insn_t *ir)
+{
+    uint32_t a = f32_bits(vm, ir->rs1), b = f32_bits(vm, ir->rs2), r;
+    float fa = f32_get(vm, ir->rs1), fb = f32_get(vm, ir->rs2);
+    bool max = ir->imm == 0b001;
+    if (f32_is_snan(a) || f32_is_snan(b))
+        vm->fflags |= RV_FFLAG_NV;
+    if (isnan(fa))
+        r = isnan(fb) ? F32_CANONICAL_NAN : b;
+    else if (isnan(fb))
+        r = a;
+    else if (fa == fb)
+        r = max ? a & b : a | b;
+    else
+        r = (fa < fb) != max ? a : b;
+    f32_set_bits(vm, ir->rd, r);
+}
+
+static void op_fminmax_d(hart_t *vm, const rv_insn_t *ir)
+{
+    uint64_t a = vm->f_regs[ir->rs1], b = vm->f_regs[ir->rs2], r;
+    double fa = f64_get(vm, ir->rs1), fb = f64_get(vm, ir->rs2);
+    bool max = ir->imm == 0b001;
+    if (f64_is_snan(a) || f64_is_snan(b))
+        vm->fflags |= RV_FFLAG_NV;
+    if (isnan(fa))
+        r = isnan(fb) ? F64_CANONICAL_NAN : b;
+    else if (isnan(fb))
+        r = a;
+    else if (fa == fb)
+        r = max ? a & b : a | b;
+    else
+        r = (fa < fb) != max ? a : b;
+    f64_set_bits(vm, ir->rd, r);
+}
+
+/* FLE, FLT and FEQ, selected by funct3. FEQ is quiet, i.e. only signaling
+ * NaNs make it raise the invalid operation exception.
+ */
+static void op_fcmp_s(hart_t *vm, const rv_insn_t *ir)
+{
+    float a = f32_get(vm, ir->rs1), b = f32_get(vm, ir->rs2);
+    if (isnan(a) || isnan(b)) {
+        if (ir->imm != 0b010 || f32_is_snan(f32_bits(vm, ir->rs1)) ||
+            f32_is_snan(f32_bits(vm, ir->rs2))) {
+            vm->fflags |= RV_FFLAG_NV;
+            vm->sstatus_fs = RV_FS_DIRTY;
+        }
+        set_rd(vm, ir, 0);
+        return;
+    }
+    set_rd(vm, ir,
+           ir->imm == 0b000   ? a <= b
+           : ir->imm == 0b001 ? a < b
+                              : a == b);
+}
+
+static void op_fcmp_d(hart_t *vm, const rv_insn_t *ir)
+{
+    double a = f64_get(vm, ir->rs1), b = f64_get(vm, ir->rs2);
+    if (isnan(a) || isnan(b)) {
+        if (ir->imm != 0b010 || f64_is_snan(vm->f_regs[ir->rs1]) ||
+            f64_is_snan(vm->f_regs[ir->rs2])) {
+            vm->fflags |= RV_FFLAG_NV;
+            vm->sstatus_fs = RV_FS_DIRTY;
+        }
+        set_rd(vm, ir, 0);
+        return;
+    }
+    set_rd(vm, ir,
+           ir->imm == 0b000   ? a <= b
+           : ir->imm == 0b001 ? a < b
+                              : a == b);
+}
+
+/* FCVT.W and FCVT.WU, selected by rs2. Out of range values and NaNs saturate
+ * and raise the invalid operation exception. The exceptions are worked out
+ * here instead of taken from the host, which raises others while rounding.
+ */
+static void op_fcvt_w(hart_t *vm, const rv_insn_t *ir, double x)
+{
+    int mode = fp_rm(vm, ir->imm);
+    if (unlikely(mode < 0))
+        return;
+
+    double r;
+    switch (mode) {
+    case RV_RM_RTZ:
+        r = trunc(x);
+        break;
+    case RV_RM_RDN:
+        r = floor(x);
+        break;
+    case RV_RM_RUP:
+        r = ceil(x);
+        break;
+    case RV_RM_RMM:
+        r = round(x);
+        break;
+    default:
+        r = nearbyint(x);
+        break;
+    }
+
+    bool is_unsigned = ir->rs2 & 1;
+    uint32_t value;
+    if (isnan(x)) {
+        value = is_unsigned ? UINT32_MAX : INT32_MAX;
+    } else if (r < (is_unsigned ? 0.0 : -2147483648.0)) {
+        value = is_unsigned ? 0 : (uint32_t) INT32_MIN;
+    } else if (r > (is_unsigned ? 4294967295.0 : 2147483647.0)) {
+        value = is_unsigned ? UINT32_MAX : INT32_MAX;
+    } else {
+        if (r != x) {
+            vm->fflags |= RV_FFLAG_NX;
+            vm->sstatus_fs = RV_FS_DIRTY;
+        }
+        set_rd(vm, ir, is_unsigned ? (uint32_t) r : (uint32_t) (int32_t) r);
+        return;
+    }
+    vm->fflags |= RV_FFLAG_NV;
+    vm->sstatus_fs = RV_FS_DIRTY;
+    set_rd(vm, ir, value);
+}
+
+/* FCVT.S.W and FCVT.S.WU, selected by rs2 */
+static void op_fcvt_s_w(hart_t *vm, const rv_insn_t *ir)
+{
+    uint32_t x = vm->x_regs[ir->rs1];
+    int mode = fp_round_begin(vm, ir->imm);
+    if (unlikely(mode < 0))
+        return;
+    float r = (ir->rs2 & 1) ? (float) x : (float) (int32_t) x;
+    fp_round_end(mode);
+    f32_set(vm, ir->rd, r);
+}
+
+static void op_fcvt_d_w(hart_t *vm, const rv_insn_t *ir)
+{
+    uint32_t x = vm->x_regs[ir->rs1];
+    if (unlikely(fp_rm(vm, ir->imm) < 0))
+        return;
+    f64_set(vm, ir->rd, (ir->rs2 & 1) ? (double) x : (double) (int32_t) x);
+}
+
+static void op_fcvt_s_d(hart_t *vm, const rv_insn_t *ir)
+{
+    double x = f64_get(vm, ir->rs1);
+    int mode = fp_round_begin(vm, ir->imm);
+    if (unlikely(mode < 0))
+        return;
+    float r = (float) x;
+    fp_round_end(mode);
+    f32_set(vm, ir->rd, r);
+}
+
+static void op_fcvt_d_s(hart_t *vm, const rv_insn_t *ir)
+{
+    float x = f32_get(vm, ir->rs1);
+    if (unlikely(fp_rm(vm, ir->imm) < 0))
+        return;
+    f64_set(vm, ir->rd, (double) x);
+}
+
+/* Return the FCLASS mask of a value given its fields */
+static uint32_t fp_class(bool sign,
+                         bool exp_zero,
+                         bool exp_max,
+                         bool frac_zero,
+                         bool quiet)
+{
+    if (exp_max) {
+        if (!frac_zero)
+            return quiet ? 1 << 9 : 1 << 8; /* quiet or signaling NaN */
+        return sign ? 1 << 0 : 1 << 7;      /* infinity */
+    }
+    if (exp_zero) {
+        if (frac_zero)
+            return sign ? 1 << 3 : 1 << 4; /* zero */
+        return sign ? 1 << 2 : 1 << 5;     /* subnormal */
+    }
+    return sign ? 1 << 1 : 1 << 6; /* normal */
+}
+
+static void op_fclass_s(hart_t *vm, const rv_insn_t *ir)
+{
+    uint32_t x = f32_bits(vm, ir->rs1), exp = (x >> 23) & MASK(8);
+    set_rd(vm, ir,
+           fp_class(x >> 31, !exp, exp == MASK(8), !(x & MASK(23)),
+                    x & (1 << 22)));
+}
+
+static void op_fclass_d(hart_t *vm, const rv_insn_t *ir)
+{
+    uint64_t x = vm->f_regs[ir->rs1];
+    uint32_t exp = (x >> 52) & MASK(11);
+    set_rd(vm, ir,
+           fp_class(x >> 63, !exp, exp == MASK(11),
+                    !(x & 0x000FFFFFFFFFFFFFULL), x & (1ULL << 51)));
+}
+
+/* Every floating-point instruction is illegal while sstatus.FS is Off. The
+ * host exceptions of those which compute are collected right around them, as
+ * the emulator raises its own in between, e.g. when it works out the time.
+ */
+#define RV_EXEC_FP(inst, code) RV_EXEC(inst, if (fp_enabled(vm)) { code; })
+#define RV_EXEC_FP_OP(inst, code) \
+    RV_EXEC_FP(inst, fp_flags_clear(); code; fp_flags_accrue(vm))
+
+/* clang-format off */
+RV_EXEC_FP(flw, op_flw(vm, ir))
+RV_EXEC_FP(fsw, mmu_store(vm, RS1 + IMM, RV_MEM_SW, vm->f_regs[ir->rs2]))
+RV_EXEC_FP(fld, op_fld(vm, ir))
+RV_EXEC_FP(fsd, op_fsd(vm, ir))
+
+RV_EXEC_FP_OP(fmadd_s,   op_f32_arith(vm, ir, RV_INSN_fmadd_s))
+RV_EXEC_FP_OP(fmsub_s,   op_f32_arith(vm, ir, RV_INSN_fmsub_s))
+RV_EXEC_FP_OP(fnmsub_s,  op_f32_arith(vm, ir, RV_INSN_fnmsub_s))
+RV_EXEC_FP_OP(fnmadd_s,  op_f32_arith(vm, ir, RV_INSN_fnmadd_s))
+RV_EXEC_FP_OP(fadd_s,    op_f32_arith(vm, ir, RV_INSN_fadd_s))
+RV_EXEC_FP_OP(fsub_s,    op_f32_arith(vm, ir, RV_INSN_fsub_s))
+RV_EXEC_FP_OP(fmul_s,    op_f32_arith(vm, ir, RV_INSN_fmul_s))
+RV_EXEC_FP_OP(fdiv_s,    op_f32_arith(vm, ir, RV_INSN_fdiv_s))
+RV_EXEC_FP_OP(fsqrt_s,   op_f32_arith(vm, ir, RV_INSN_fsqrt_s))
+RV_EXEC_FP(fsgnj_s,      op_fsgnj_s(vm, ir))
+RV_EXEC_FP_OP(fminmax_s, op_fminmax_s(vm, ir))
+RV_EXEC_FP_OP(fcmp_s,    op_fcmp_s(vm, ir))
+RV_EXEC_FP(fcvt_w_s,     op_fcvt_w(vm, ir, f32_get(vm, ir->rs1)))
+RV_EXEC_FP_OP(fcvt_s_w,  op_fcvt_s_w(vm, ir))
+RV_EXEC_FP(fmv_x_w,      set_rd(vm, ir, vm->f_regs[ir->rs1]))
+RV_EXEC_FP(fmv_w_x,      f32_set_bits(vm, ir->rd, RS1))
+RV_EXEC_FP(fclass_s,     op_fclass_s(vm, ir))
+
+RV_EXEC_FP_OP(fmadd_d,   op_f64_arith(vm, ir, RV_INSN_fmadd_d))
+RV_EXEC_FP_OP(fmsub_d,   op_f64_arith(vm, ir, RV_INSN_fmsub_d))
+RV_EXEC_FP_OP(fnmsub_d,  op_f64_arith(vm, ir, RV_INSN_fnmsub_d))
+RV_EXEC_FP_OP(fnmadd_d,  op_f64_arith(vm, ir, RV_INSN_fnmadd_d))
+RV_EXEC_FP_OP(fadd_d,    op_f64_arith(vm, ir, RV_INSN_fadd_d))
+RV_EXEC_FP_OP(fsub_d,    op_f64_arith(vm, ir, RV_INSN_fsub_d))
+RV_EXEC_FP_OP(fmul_d,    op_f64_arith(vm, ir, RV_INSN_fmul_d))
+RV_EXEC_FP_OP(fdiv_d,    op_f64_arith(vm, ir, RV_INSN_fdiv_d))
+RV_EXEC_FP_OP(fsqrt_d,   op_f64_arith(vm, ir, RV_INSN_fsqrt_d))
+RV_EXEC_FP(fsgnj_d,      op_fsgnj_d(vm, ir))
+RV_EXEC_FP_OP(fminmax_d, op_fminmax_d(vm, ir))
+RV_EXEC_FP_OP(fcmp_d,    op_fcmp_d(vm, ir))
+RV_EXEC_FP(fcvt_w_d,     op_fcvt_w(vm, ir, f64_get(vm, ir->rs1)))
+RV_EXEC_FP_OP(fcvt_d_w,  op_fcvt_d_w(vm, ir))
+RV_EXEC_FP(fclass_d,     op_fclass_d(vm, ir))
+RV_EXEC_FP_OP(fcvt_s_d,  op_fcvt_s_d(vm, ir))
+RV_EXEC_FP_OP(fcvt_d_s,  op_fcvt_d_s(vm, ir))
+/* clang-format on */
+
+#undef RS1
+#undef RS2
+#undef IMM
+
+#if SEMU_HAS(THREADED_DISPATCH)
+/* Dispatch labels of block_execute(), published by its first call */
+static const void *const *insn_labels;
+#else
+static void (*const insn_impl[N_RV_INSNS])(hart_t *, const rv_insn_t *) = {
+#define _(inst) [RV_INSN_##inst] = do_##inst,
+    RV_INSN_LIST
+#undef _
+};
+#endif
+
+/* Decode the compressed instruction "insn" by expanding it into the operands
+ * of its 32-bit equivalent. Return true if the instruction ends a block.
+ */
+static bool insn_decode_c(rv_insn_t *ir, uint32_t insn)
+{
+    uint8_t funct3 = insn >> 13;
+    uint8_t rd = decode_c_rd(insn), rs2 = decode_c_rs2(insn);
+
+    ir->opcode = RV_INSN_illegal;
+    ir->rd = ir->rs1 = ir->rs2 = 0;
+    ir->imm = 0;
+
+    switch ((insn & MASK(2)) << 3 | funct3) {
+    case 0b00000: /* C.ADDI4SPN */
+        ir->imm = decode_ciw(insn);
+        if (ir->imm) {
+            ir->opcode = RV_INSN_addi;
+            ir->rd = decode_c_rs2p(insn);
+            ir->rs1 = 2;
+        }
+        break;
+    case 0b00001: /* C.FLD */
+    case 0b00011: /* C.FLW */
+        ir->opcode = funct3 == 0b001 ? RV_INSN_fld : RV_INSN_flw;
+        ir->rd = decode_c_rs2p(insn);
+        ir->rs1 = decode_c_rs1p(insn);
+        ir->imm = funct3 == 0b001 ? decode_cl_d(insn) : decode_cl(insn);
+        break;
+    case 0b00101: /* C.FSD */
+    case 0b00111: /* C.FSW */
+        ir->opcode = funct3 == 0b101 ? RV_INSN_fsd : RV_INSN_fsw;
+        ir->rs1 = decode_c_rs1p(insn);
+        ir->rs2 = decode_c_rs2p(insn);
+        ir->imm = funct3 == 0b101 ? decode_cl_d(insn) : decode_cl(insn);
+        break;
+    case 0b00010: /* C.LW */
+        ir->opcode = RV_INSN_lw;
+        ir->rd = decode_c_rs2p(insn);
+        ir->rs1 = decode_c_rs1p(insn);
+        ir->imm = decode_cl(insn);
+        break;
+    case 0b00110: /* C.SW */
+        ir->opcode = RV_INSN_sw;
+        ir->rs1 = decode_c_rs1p(insn);
+        ir->rs2 = decode_c_rs2p(insn);
+        ir->imm = decode_cl(insn);
+        break;
+    case 0b01000: /* C.ADDI, C.NOP */
+        ir->opcode = RV_INSN_addi;
+        ir->rd = ir->rs1 = rd;
+        ir->imm = decode_ci(insn);
+        break;
+    case 0b01001: /* C.JAL */
+    case 0b01101: /* C.J */
+        ir->opcode = RV_INSN_jal;
+        ir->rd = funct3 == 0b001;
+        ir->imm = decode_cj(insn);
+        return true;
+    case 0b01010: /* C.LI */
+        ir->opcode = RV_INSN_addi;
+        ir->rd = rd;
+        ir->imm = decode_ci(insn);
+        break;
+    case 0b01011:
+        if (rd == 2) { /* C.ADDI16SP */
+            ir->imm = decode_ci_addi16sp(insn);
+            if (ir->imm) {
+                ir->opcode = RV_INSN_addi;
+                ir->rd = ir->rs1 = 2;
+            }
+        } else { /* C.LUI */
+            ir->imm = decode_ci(insn) << 12;
+            if (ir->imm) {
+                ir->opcode = RV_INSN_lui;
+                ir->rd = rd;
+            }
+        }
+        break;
+    case 0b01100: { /* MISC-ALU */
+        static const uint8_t arith_ops[4] = {
+            [0b00] = RV_INSN_sub,
+            [0b01] = RV_INSN_xor,
+            [0b10] = RV_INSN_or,
+            [0b11] = RV_INSN_and,
+        };
+        ir->rd = ir->rs1 = decode_c_rs1p(insn);
+        ir->imm = decode_ci(insn);
+        switch ((insn >> 10) & MASK(2)) {
+        case 0b00: /* C.SRLI, shamt[5] must be zero on RV32 */
+            if (!(insn & (1 << 12)))
+                ir->opcode = RV_INSN_srli;
+            break;
+        case 0b01: /* C.SRAI */
+            if (!(insn & (1 << 12)))
+                ir->opcode = RV_INSN_srai;
+            break;
+        case 0b10: /* C.ANDI */
+            ir->opcode = RV_INSN_andi;
+            break;
+        case 0b11: /* C.SUB, C.XOR, C.OR, C.AND */
+            ir->imm = 0;
+            ir->rs2 = decode_c_rs2p(insn);
+            if (!(insn & (1 << 12)))
+                ir->opcode = arith_ops[(insn >> 5) & MASK(2)];
+            break;
+        }
+        break;
+    }
+    case 0b01110: /* C.BEQZ */
+    case 0b01111: /* C.BNEZ */
+        ir->opcode = funct3 == 0b110 ? RV_INSN_beq : RV_INSN_bne;
+        ir->rs1 = decode_c_rs1p(insn);
+        ir->imm = decode_cb(insn);
+        return true;
+    case 0b10000: /* C.SLLI */
+        if (!(insn & (1 << 12))) {
+            ir->opcode = RV_INSN_slli;
+            ir->rd = ir->rs1 = rd;
+            ir->imm = rs2;
+        }
+        break;
+    case 0b10001: /* C.FLDSP */
+        ir->opcode = RV_INSN_fld;
+        ir->rd = rd;
+        ir->rs1 = 2;
+        ir->imm = decode_ci_ldsp(insn);
+        break;
+    case 0b10011: /* C.FLWSP */
+        ir->opcode = RV_INSN_flw;
+        ir->rd = rd;
+        ir->rs1 = 2;
+        ir->imm = decode_ci_lwsp(insn);
+        break;
+    case 0b10010: /* C.LWSP */
+        if (rd) {
+            ir->opcode = RV_INSN_lw;
+            ir->rd = rd;
+            ir->rs1 = 2;
+            ir->imm = decode_ci_lwsp(insn);
+        }
+        break;
+    case 0b10100:
+        if (rs2) { /* C.MV, C.ADD */
+            ir->opcode = RV_INSN_add;
+            ir->rd = rd;
+            ir->rs1 = insn & (1 << 12) ? rd : 0;
+            ir->rs2 = rs2;
+            break;
+        }
+        if (rd) { /* C.JR, C.JALR */
+            ir->opcode = RV_INSN_jalr;
+            ir->rd = !!(insn & (1 << 12));
+            ir->rs1 = rd;
+            return true;
+        }
+        if (insn & (1 << 12)) { /* C.EBREAK */
+            ir->opcode = RV_INSN_system;
+            ir->imm = 0x00100073;
+            return true;
+        }
+        break;
+    case 0b10101: /* C.FSDSP */
+        ir->opcode = RV_INSN_fsd;
+        ir->rs1 = 2;
+        ir->rs2 = rs2;
+        ir->imm = decode_css_d(insn);
+        break;
+    case 0b10110: /* C.SWSP */
+    case 0b10111: /* C.FSWSP */
+        ir->opcode = funct3 == 0b110 ? RV_INSN_sw : RV_INSN_fsw;
+        ir->rs1 = 2;
+        ir->rs2 = rs2;
+        ir->imm = decode_css(insn);
+        break;
+    default: /* reserved encodings */
+        break;
+    }
+    return ir->opcode == RV_INSN_illegal;
+}
+
+/* Decode the OP-FP instruction "insn", whose register fields are already in
+ * "ir", and set the opcode and immediate.
+ */
+static void insn_decode_fp(rv_insn_t *ir, uint32_t insn)
+{
+    /* opcodes indexed by funct5[1:0] and fmt */
+    static const uint8_t arith_ops[4][2] = {
+        [0b00] = {RV_INSN_fadd_s, RV_INSN_fadd_d},
+        [0b01] = {RV_INSN_fsub_s, RV_INSN_fsub_d},
+        [0b10] = {RV_INSN_fmul_s, RV_INSN_fmul_d},
+        [0b11] = {RV_INSN_fdiv_s, RV_INSN_fdiv_d},
+    };
+
+    uint8_t funct3 = decode_func3(insn), fmt = (insn >> 25) & MASK(2);
+    bool d = fmt == 0b01;
+
+    ir->opcode = RV_INSN_illegal;
+    ir->imm = funct3;
+    if (fmt > 0b01)
+        return;
+
+    switch (decode_func5(insn)) {
+    case 0b00000: /* FADD */
+    case 0b00001: /* FSUB */
+    case 0b00010: /* FMUL */
+    case 0b00011: /* FDIV */
+        ir->opcode = arith_ops[decode_func5(insn)][d];
+        break;
+    case 0b01011: /* FSQRT */
+        if (!ir->rs2)
+            ir->opcode = d ? RV_INSN_fsqrt_d : RV_INSN_fsqrt_s;
+        break;
+    case 0b00100: /* FSGNJ, FSGNJN, FSGNJX */
+        if (funct3 <= 0b010)
+            ir->opcode = d ? RV_INSN_fsgnj_d : RV_INSN_fsgnj_s;
+        break;
+    case 0b00101: /* FMIN, FMAX */
+        if (funct3 <= 0b001)
+            ir->opcode = d ? RV_INSN_fminmax_d : RV_INSN_fminmax_s;
+        break;
+    case 0b01000: /* FCVT.S.D, FCVT.D.S */
+        if (ir->rs2 == !d)
+            ir->opcode = d ? RV_INSN_fcvt_d_s : RV_INSN_fcvt_s_d;
+        break;
+    case 0b10100: /* FLE, FLT, FEQ */
+        if (funct3 <= 0b010)
+            ir->opcode = d ? RV_INSN_fcmp_d : RV_INSN_fcmp_s;
+        break;
+    case 0b11000: /* FCVT.W, FCVT.WU */
+        if (ir->rs2 <= 1)
+            ir->opcode = d ? RV_INSN_fcvt_w_d : RV_INSN_fcvt_w_s;
+        break;
+    case 0b11010: /* FCVT.S.W, FCVT.S.WU, FCVT.D.W, FCVT.D.WU */
+        if (ir->rs2 <= 1)
+            ir->opcode = d ? RV_INSN_fcvt_d_w : RV_INSN_fcvt_s_w;
+        break;
+    case 0b11100: /* FMV.X.W, FCLASS */
+        if (ir->rs2)
+            break;
+        if (funct3 == 0b001)
+            ir->opcode = d ? RV_INSN_fclass_d : RV_INSN_fclass_s;
+        else if (funct3 == 0b000 && !d)
+            ir->opcode = RV_INSN_fmv_x_w;
+        break;
+    case 0b11110: /* FMV.W.X */
+        if (!ir->rs2 && funct3 == 0b000 && !d)
+            ir->opcode = RV_INSN_fmv_w_x;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Return the opcode of the OP instruction "insn", selected by funct7 and
+ * funct3
+ */
+static uint8_t insn_decode_op(uint32_t insn)
+{
+    /* opcodes indexed by funct3 */
+    static const uint8_t op_ops[8] = {
+        [0b000] = RV_INSN_add,
+        [0b001] = RV_INSN_sll,
+        [0b010] = RV_INSN_slt,
+        [0b011] = RV_INSN_sltu,
+        [0b100] = RV_INSN_xor,
+        [0b101] = RV_INSN_srl,
+        [0b110] = RV_INSN_or,
+        [0b111] = RV_INSN_and,
+    };
+    static const uint8_t mul_ops[8] = {
+        [0b000] = RV_INSN_mul,
+        [0b001] = RV_INSN_mulh,
+        [0b010] = RV_INSN_mulhsu,
+        [0b011] = RV_INSN_mulhu,
+        [0b100] = RV_INSN_div,
+        [0b101] = RV_INSN_divu,
+        [0b110] = RV_INSN_rem,
+        [0b111] = RV_INSN_remu,
+    };
+    static const uint8_t alt_ops[8] = {
+        [0b000] = RV_INSN_sub,
+        [0b001] = RV_INSN_illegal,
+        [0b010] = RV_INSN_illegal,
+        [0b011] = RV_INSN_illegal,
+        [0b100] = RV_INSN_xnor,
+        [0b101] = RV_INSN_sra,
+        [0b110] = RV_INSN_orn,
+        [0b111] = RV_INSN_andn,
+    };
+    static const uint8_t minmax_ops[8] = {
+        [0b000] = RV_INSN_illegal,
+        [0b001] = RV_INSN_illegal,
+        [0b010] = RV_INSN_illegal,
+        [0b011] = RV_INSN_illegal,
+        [0b100] = RV_INSN_min,
+        [0b101] = RV_INSN_minu,
+        [0b110] = RV_INSN_max,
+        [0b111] = RV_INSN_maxu,
+    };
+
+    uint8_t funct3 = decode_func3(insn);
+    switch (insn >> 25) {
+    case 0b0000000:
+        return op_ops[funct3];
+    case 0b0000001:
+        return mul_ops[funct3];
+    case 0b0100000:
+        return alt_ops[funct3];
+    case 0b0000101:
+        return minmax_ops[funct3];
+    case 0b0010000: /* SH1ADD, SH2ADD, SH3ADD */
+        if (funct3 == 0b010)
+            return RV_INSN_sh1add;
+        if (funct3 == 0b100)
+            return RV_INSN_sh2add;
+        if (funct3 == 0b110)
+            return RV_INSN_sh3add;
+        break;
+    case 0b0110000: /* ROL, ROR */
+        if (funct3 == 0b001)
+            return RV_INSN_rol;
+        if (funct3 == 0b101)
+            return RV_INSN_ror;
+        break;
+    case 0b0100100: /* BCLR, BEXT */
+        if (funct3 == 0b001)
+            return RV_INSN_bclr;
+        if (funct3 == 0b101)
+            return RV_INSN_bext;
+        break;
+    case 0b0110100: /* BINV */
+        if (funct3 == 0b001)
+            return RV_INSN_binv;
+        break;
+    case 0b0010100: /* BSET */
+        if (funct3 == 0b001)
+            return RV_INSN_bset;
+        break;
+    case 0b0000100: /* ZEXT.H */
+        if (funct3 == 0b100 && !decode_rs2(insn))
+            return RV_INSN_zext_h;
+        break;
+    default:
+        break;
+    }
+    return RV_INSN_illegal;
+}
+
+/* Return the opcode of the OP-IMM instruction "insn" whose funct3 is 001 or
+ * 101, i.e. a shift by an immediate or a unary operation. imm[11:5] selects
+ * the instruction, and the shift amount field further selects unary ones.
+ */
+static uint8_t insn_decode_op_imm_shift(uint32_t insn)
+{
+    uint8_t shamt = decode_rs2(insn);
+    bool left = decode_func3(insn) == 0b001;
+
+    switch (insn >> 25) {
+    case 0b0000000:
+        return left ? RV_INSN_slli : RV_INSN_srli;
+    case 0b0100000:
+        return left ? RV_INSN_illegal : RV_INSN_srai;
+    case 0b0010100: /* BSETI, ORC.B */
+        if (left)
+            return RV_INSN_bseti;
+        return shamt == 0b00111 ? RV_INSN_orc_b : RV_INSN_illegal;
+    case 0b0100100: /* BCLRI, BEXTI */
+        return left ? RV_INSN_bclri : RV_INSN_bexti;
+    case 0b0110100: /* BINVI, REV8 */
+        if (left)
+            return RV_INSN_binvi;
+        return shamt == 0b11000 ? RV_INSN_rev8 : RV_INSN_illegal;
+    case 0b0110000: /* CLZ, CTZ, CPOP, SEXT.B, SEXT.H, RORI */
+        if (!left)
+            return RV_INSN_rori;
+        switch (shamt) {
+        case 0b00000:
+            return RV_INSN_clz;
+        case 0b00001:
+            return RV_INSN_ctz;
+        case 0b00010:
+            return RV_INSN_cpop;
+        case 0b00100:
+            return RV_INSN_sext_b;
+        case 0b00101:
+            return RV_INSN_sext_h;
         default:
-            vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+    return RV_INSN_illegal;
+}
+
+/* Decode "insn" into "ir". Return true if the instruction ends a block. */
+static bool insn_decode(rv_insn_t *ir, uint32_t insn)
+{
+    /* opcodes indexed by funct3 */
+    static const uint8_t load_ops[8] = {
+        [0b000] = RV_INSN_lb,
+        [0b001] = RV_INSN_lh,
+        [0b010] = RV_INSN_lw,
+        [0b011] = RV_INSN_illegal,
+        [0b100] = RV_INSN_lbu,
+        [0b101] = RV_INSN_lhu,
+        [0b110] = RV_INSN_illegal,
+        [0b111] = RV_INSN_illegal,
+    };
+    static const uint8_t store_ops[8] = {
+        [0b000] = RV_INSN_sb,
+        [0b001] = RV_INSN_sh,
+        [0b010] = RV_INSN_sw,
+        [0b011] = RV_INSN_illegal,
+        [0b100] = RV_INSN_illegal,
+        [0b101] = RV_INSN_illegal,
+        [0b110] = RV_INSN_illegal,
+        [0b111] = RV_INSN_illegal,
+    };
+    static const uint8_t branch_ops[8] = {
+        [0b000] = RV_INSN_beq,
+        [0b001] = RV_INSN_bne,
+        [0b010] = RV_INSN_illegal,
+        [0b011] = RV_INSN_illegal,
+        [0b100] = RV_INSN_blt,
+        [0b101] = RV_INSN_bge,
+        [0b110] = RV_INSN_bltu,
+        [0b111] = RV_INSN_bgeu,
+    };
+    static const uint8_t op_imm_ops[8] = {
+        [0b000] = RV_INSN_addi,
+        [0b001] = RV_INSN_slli,
+        [0b010] = RV_INSN_slti,
+        [0b011] = RV_INSN_sltiu,
+        [0b100] = RV_INSN_xori,
+        [0b101] = RV_INSN_srli,
+        [0b110] = RV_INSN_ori,
+        [0b111] = RV_INSN_andi,
+    };
+    /* opcodes indexed by the major opcode bits 3:2 and fmt */
+    static const uint8_t fma_ops[4][2] = {
+        [0b00] = {RV_INSN_fmadd_s, RV_INSN_fmadd_d},
+        [0b01] = {RV_INSN_fmsub_s, RV_INSN_fmsub_d},
+        [0b10] = {RV_INSN_fnmsub_s, RV_INSN_fnmsub_d},
+        [0b11] = {RV_INSN_fnmadd_s, RV_INSN_fnmadd_d},
+    };
+
+    uint8_t funct3 = decode_func3(insn);
+    bool ends_block = false;
+
+    ir->rvc = (insn & MASK(2)) != 0b11;
+    if (ir->rvc) {
+        ends_block = insn_decode_c(ir, insn);
+        goto done;
+    }
+
+    ir->rd = decode_rd(insn);
+    ir->rs1 = decode_rs1(insn);
+    ir->rs2 = decode_rs2(insn);
+    ir->imm = 0;
+
+    switch (insn & MASK(7)) {
+    case RV32_OP_IMM:
+        ir->opcode = (funct3 & 0b11) == 0b01 ? insn_decode_op_imm_shift(insn)
+                                             : op_imm_ops[funct3];
+        ir->imm = decode_i(insn);
+        break;
+    case RV32_OP:
+        ir->opcode = insn_decode_op(insn);
+        break;
+    case RV32_LUI:
+        ir->opcode = RV_INSN_lui;
+        ir->imm = decode_u(insn);
+        break;
+    case RV32_AUIPC:
+        ir->opcode = RV_INSN_auipc;
+        ir->imm = decode_u(insn);
+        break;
+    case RV32_JAL:
+        ir->opcode = RV_INSN_jal;
+        ir->imm = decode_j(insn);
+        ends_block = true;
+        break;
+    case RV32_JALR:
+        ir->opcode = RV_INSN_jalr;
+        ir->imm = decode_i(insn);
+        ends_block = true;
+        break;
+    case RV32_BRANCH:
+        ir->opcode = branch_ops[funct3];
+        ir->imm = decode_b(insn);
+        ends_block = true;
+        break;
+    case RV32_LOAD:
+        ir->opcode = load_ops[funct3];
+        ir->imm = decode_i(insn);
+        break;
+    case RV32_STORE:
+        ir->opcode = store_ops[funct3];
+        ir->imm = decode_s(insn);
+        break;
+    case RV32_MISC_MEM:
+        switch (funct3) {
+        case 0b000: /* MM_FENCE */
+            /* PAUSE is a FENCE with only W as predecessor */
+            if (insn == 0x0100000F) {
+                ir->opcode = RV_INSN_pause;
+                ends_block = true;
+                break;
+            }
+            ir->opcode = RV_INSN_fence;
+            break;
+        case 0b001: /* MM_FENCE_I */
+            ir->opcode = RV_INSN_fencei;
+            ends_block = true;
+            break;
+        case 0b010: /* MM_CBO, of which only CBO.ZERO is implemented */
+            if (decode_i_unsigned(insn) == 0b100 && !decode_rd(insn))
+                ir->opcode = RV_INSN_cbo_zero;
+            else
+                ir->opcode = RV_INSN_illegal;
+            break;
+        default:
+            ir->opcode = RV_INSN_illegal;
             break;
         }
         break;
     case RV32_AMO:
-        op_amo(vm, insn);
+        ir->opcode = RV_INSN_amo;
+        ir->imm = insn;
+        break;
+    case RV32_LOAD_FP:
+        ir->opcode = funct3 == 0b010   ? RV_INSN_flw
+                     : funct3 == 0b011 ? RV_INSN_fld
+                                       : RV_INSN_illegal;
+        ir->imm = decode_i(insn);
+        break;
+    case RV32_STORE_FP:
+        ir->opcode = funct3 == 0b010   ? RV_INSN_fsw
+                     : funct3 == 0b011 ? RV_INSN_fsd
+                                       : RV_INSN_illegal;
+        ir->imm = decode_s(insn);
+        break;
+    case RV32_MADD:
+    case RV32_MSUB:
+    case RV32_NMSUB:
+    case RV32_NMADD:
+        if (((insn >> 25) & MASK(2)) > 0b01) {
+            ir->opcode = RV_INSN_illegal;
+            break;
+        }
+        ir->opcode = fma_ops[(insn >> 2) & MASK(2)][(insn >> 25) & 1];
+        ir->imm = (decode_rs3(insn) << 3) | funct3;
+        break;
+    case RV32_OP_FP:
+        insn_decode_fp(ir, insn);
         break;
     case RV32_SYSTEM:
-        op_system(vm, insn);
+        /* CSR accesses and privileged instructions may change the address
+         * translation or trap, so nothing is allowed to follow them.
+         */
+        ir->opcode = RV_INSN_system;
+        ir->imm = insn;
+        ends_block = true;
         break;
     default:
-        vm_set_exception(vm, RV_EXC_ILLEGAL_INSN, 0);
+        ir->opcode = RV_INSN_illegal;
         break;
     }
+
+    if (ir->opcode == RV_INSN_illegal)
+        ends_block = true;
+done:
+#if SEMU_HAS(THREADED_DISPATCH)
+    ir->label = insn_labels[ir->opcode];
+#else
+    ir->impl = insn_impl[ir->opcode];
+#endif
+    return ends_block;
+}
+
+/* Pre-decoded block cache */
+
+/* Return the 16-bit parcel at offset "off" of the code page */
+static inline uint32_t insn_half(const uint32_t *page, uint32_t off)
+{
+    return (page[off >> 2] >> ((off & 2) * 8)) & MASK(16);
+}
+
+static inline uint32_t block_hash(uint32_t paddr)
+{
+    return (paddr >> 2) & MASK(BLOCK_MAP_BITS);
+}
+
+void vm_flush_blocks(hart_t *vm)
+{
+    block_cache_t *cache = &vm->block_cache;
+    memset(cache->map, 0, sizeof(cache->map));
+    cache->n_blocks = 0;
+    cache->n_insns = 0;
+#if SEMU_HAS(JIT)
+    cache->code_used = 0;
+    cache->code_full = false;
+#endif
+}
+
+static block_t *block_translate(hart_t *vm,
+                                uint32_t paddr,
+                                const uint32_t *page)
+{
+    STATS_INC(vm, block_misses);
+    block_cache_t *cache = &vm->block_cache;
+    if (unlikely(cache->n_blocks == BLOCK_POOL_SIZE ||
+                 cache->n_insns + BLOCK_MAX_INSN > BLOCK_INSN_POOL_SIZE))
+        vm_flush_blocks(vm);
+
+    /* Mark the page as holding code before decoding it, so that any store
+     * from now on stales the block.
+     */
+    uint32_t *gen = &vm->vm->page_gen[paddr >> RV_PAGE_SHIFT];
+
+    block_t *block = &cache->blocks[cache->n_blocks++];
+    block->paddr = paddr;
+    block->gen = __atomic_or_fetch(gen, 1, __ATOMIC_ACQ_REL);
+    block->ir = &cache->insns[cache->n_insns];
+    block->n_insn = 0;
+#if SEMU_HAS(JIT)
+    block->hits = 0;
+    block->jit = NULL;
+#endif
+
+    /* A 32-bit instruction straddling the end of the page is left out, so
+     * that a block spans a single page. On its own, it makes an empty block.
+     */
+    const uint32_t max_insn = vm->single_step ? 1 : BLOCK_MAX_INSN;
+    for (uint32_t off = paddr & MASK(RV_PAGE_SHIFT);
+         off < RV_PAGE_SIZE && block->n_insn < max_insn;) {
+        uint32_t insn = insn_half(page, off);
+        if ((insn & MASK(2)) == 0b11) {
+            if (off + 2 == RV_PAGE_SIZE)
+                break;
+            insn |= insn_half(page, off + 2) << 16;
+        }
+        rv_insn_t *ir = &block->ir[block->n_insn++];
+        bool ends_block = insn_decode(ir, insn);
+        off += ir->rvc ? 2 : 4;
+        if (ends_block)
+            break;
+    }
+    cache->n_insns += block->n_insn;
+
+    uint32_t idx = block_hash(paddr);
+    block->hash_next = cache->map[idx];
+    cache->map[idx] = block;
+    return block;
+}
+
+/* Find the block starting at vm->pc, translating it on a miss */
+static block_t *block_find(hart_t *vm)
+{
+    const uint32_t *page = mmu_fetch(vm, vm->pc);
+    if (unlikely(vm->error))
+        return NULL;
+
+    uint32_t ppn = vm->cache_fetch.ppn;
+    uint32_t paddr = (ppn << RV_PAGE_SHIFT) | (vm->pc & MASK(RV_PAGE_SHIFT));
+    block_t **link = &vm->block_cache.map[block_hash(paddr)];
+    for (block_t *block; (block = *link); link = &block->hash_next) {
+        if (block->paddr != paddr)
+            continue;
+        if (likely(block->gen ==
+                   __atomic_load_n(&vm->vm->page_gen[ppn], __ATOMIC_ACQUIRE)))
+            return block;
+        /* The page was written since, drop the stale block */
+        *link = block->hash_next;
+        break;
+    }
+    return block_translate(vm, paddr, page);
+}
+
+#if SEMU_HAS(THREADED_DISPATCH)
+/* Direct threaded dispatch: each pre-decoded instruction carries the address
+ * of its handler label, and every handler ends in its own indirect jump to the
+ * next one. The host branch predictor thus keeps a separate history for each
+ * guest instruction class instead of sharing a single call site.
+ *
+ * Calling it with a NULL "ir" publishes the label table for insn_decode().
+ */
+static void block_execute(hart_t *vm,
+                          const rv_insn_t *ir,
+                          const rv_insn_t *end)
+{
+    static const void *const labels[N_RV_INSNS] = {
+#define _(inst) [RV_INSN_##inst] = &&insn_##inst,
+        RV_INSN_LIST
+#undef _
+    };
+
+    if (unlikely(!ir)) {
+        insn_labels = labels;
+        return;
+    }
+
+#define DISPATCH()                 \
+    do {                           \
+        vm->current_pc = vm->pc;   \
+        vm->pc += ir->rvc ? 2 : 4; \
+        vm->instret++;             \
+        goto *ir->label;           \
+    } while (0)
+
+    DISPATCH();
+
+#define _(inst)                             \
+    insn_##inst : do_##inst(vm, ir);        \
+    if (unlikely(vm->error) || ++ir == end) \
+        return;                             \
+    DISPATCH();
+    RV_INSN_LIST
+#undef _
+#undef DISPATCH
+}
+#else
+/* Run the pre-decoded instructions from "ir" up to "end" */
+static void block_execute(hart_t *vm,
+                          const rv_insn_t *ir,
+                          const rv_insn_t *end)
+{
+    for (; ir < end; ir++) {
+        vm->current_pc = vm->pc;
+        vm->pc += ir->rvc ? 2 : 4;
+        /* Assume no integer overflow */
+        vm->instret++;
+        ir->impl(vm, ir);
+        if (unlikely(vm->error))
+            return;
+    }
+}
+#endif
+
+/* Run the 32-bit instruction at vm->pc whose upper half lies on the next page.
+ * It is decoded again on every execution, as a cached block would not notice
+ * stores to the second page.
+ */
+static void insn_execute_split(hart_t *vm)
+{
+    const uint32_t *page = mmu_fetch(vm, vm->pc);
+    if (unlikely(vm->error))
+        return;
+    uint32_t insn = insn_half(page, RV_PAGE_SIZE - 2);
+
+    /* A fault on the second page reports the address of the upper half */
+    page = mmu_fetch(vm, vm->pc + 2);
+    if (unlikely(vm->error))
+        return;
+    insn |= insn_half(page, 0) << 16;
+
+    rv_insn_t ir;
+    insn_decode(&ir, insn);
+    block_execute(vm, &ir, &ir + 1);
+}
+
+/* Interpret "block" from "ir" to its end */
+static inline void block_run(hart_t *vm,
+                             const block_t *block,
+                             const rv_insn_t *ir)
+{
+    block_execute(vm, ir, block->ir + block->n_insn);
+}
+
+#if SEMU_HAS(JIT) && SEMU_HAS(JIT_LOCKSTEP)
+#if SEMU_HAS(SMP_THREADS)
+/* Replaying the log races with the other harts touching the same memory */
+#error "JIT lockstep testing requires a single host thread"
+#endif
+
+/* Lockstep differential testing of the JIT. The compiled code runs first and
+ * every memory access it makes is logged. The hart is then rewound and the
+ * interpreter replays the same instructions against the log, so that device
+ * side effects happen only once, and both results are compared.
+ */
+typedef struct {
+    uint32_t x_regs[32];
+    uint32_t pc, current_pc;
+    uint64_t instret;
+    vm_error_t error;
+    uint32_t exc_cause, exc_val;
+} lockstep_state_t;
+
+typedef struct {
+    uint32_t addr, value;
+    uint8_t width;
+    bool store;
+    vm_error_t error;
+    uint32_t exc_cause, exc_val;
+} lockstep_access_t;
+
+static __thread struct {
+    lockstep_access_t log[BLOCK_MAX_INSN];
+    uint32_t n_log, pos;
+    bool diverged;
+    void (*mem_load)(hart_t *vm, uint32_t addr, uint8_t width, uint32_t *value);
+    void (*mem_store)(hart_t *vm, uint32_t addr, uint8_t width, uint32_t value);
+} lockstep;
+
+static void lockstep_save(const hart_t *vm, lockstep_state_t *s)
+{
+    memcpy(s->x_regs, vm->x_regs, sizeof(s->x_regs));
+    s->pc = vm->pc;
+    s->current_pc = vm->current_pc;
+    s->instret = vm->instret;
+    s->error = vm->error;
+    s->exc_cause = vm->exc_cause;
+    s->exc_val = vm->exc_val;
+}
+
+static void lockstep_restore(hart_t *vm, const lockstep_state_t *s)
+{
+    memcpy(vm->x_regs, s->x_regs, sizeof(s->x_regs));
+    vm->pc = s->pc;
+    vm->current_pc = s->current_pc;
+    vm->instret = s->instret;
+    vm->error = s->error;
+    vm->exc_cause = s->exc_cause;
+    vm->exc_val = s->exc_val;
+}
+
+static void lockstep_record(hart_t *vm,
+                            uint32_t addr,
+                            uint8_t width,
+                            uint32_t value,
+                            bool store)
+{
+    lockstep_access_t *a = &lockstep.log[lockstep.n_log++];
+    a->addr = addr;
+    a->width = width;
+    a->value = value;
+    a->store = store;
+    a->error = vm->error;
+    a->exc_cause = vm->exc_cause;
+    a->exc_val = vm->exc_val;
+}
+
+static void lockstep_record_load(hart_t *vm,
+                                 uint32_t addr,
+                                 uint8_t width,
+                                 uint32_t *value)
+{
+    lockstep.mem_load(vm, addr, width, value);
+    lockstep_record(vm, addr, width, *value, false);
+}
+
+static void lockstep_record_store(hart_t *vm,
+                                  uint32_t addr,
+                                  uint8_t width,
+                                  uint32_t value)
+{
+    lockstep.mem_store(vm, addr, width, value);
+    lockstep_record(vm, addr, width, value, true);
+}
+
+/* Return the next logged access if it matches, flagging a divergence
+ * otherwise.
+ */
+static const lockstep_access_t *lockstep_replay(uint32_t addr,
+                                                uint8_t width,
+                                                uint32_t value,
+                                                bool store)
+{
+    const lockstep_access_t *a = &lockstep.log[lockstep.pos];
+    if (lockstep.pos == lockstep.n_log || a->addr != addr ||
+        a->width != width || a->store != store ||
+        (store && a->value != value)) {
+        fprintf(stderr,
+                "lockstep: interpreter %s 0x%08x (width %u, value 0x%08x) "
+                "does not match the JIT\n",
+                store ? "store" : "load", addr, width, value);
+        lockstep.diverged = true;
+        return NULL;
+    }
+    lockstep.pos++;
+    return a;
+}
+
+static void lockstep_replay_access(hart_t *vm, const lockstep_access_t *a)
+{
+    if (a && a->error) {
+        vm->error = a->error;
+        vm->exc_cause = a->exc_cause;
+        vm->exc_val = a->exc_val;
+    }
+}
+
+static void lockstep_replay_load(hart_t *vm,
+                                 uint32_t addr,
+                                 uint8_t width,
+                                 uint32_t *value)
+{
+    const lockstep_access_t *a = lockstep_replay(addr, width, 0, false);
+    *value = a ? a->value : 0;
+    lockstep_replay_access(vm, a);
+}
+
+static void lockstep_replay_store(hart_t *vm,
+                                  uint32_t addr,
+                                  uint8_t width,
+                                  uint32_t value)
+{
+    lockstep_replay_access(vm, lockstep_replay(addr, width, value, true));
+}
+
+static bool lockstep_equal(const lockstep_state_t *a,
+                           const lockstep_state_t *b)
+{
+    return !memcmp(a->x_regs, b->x_regs, sizeof(a->x_regs)) &&
+           a->pc == b->pc && a->current_pc == b->current_pc &&
+           a->instret == b->instret && a->error == b->error &&
+           a->exc_cause == b->exc_cause && a->exc_val == b->exc_val;
+}
+
+static void lockstep_report(const lockstep_state_t *jit,
+                            const lockstep_state_t *interp)
+{
+    for (int i = 0; i < 32; i++) {
+        if (jit->x_regs[i] != interp->x_regs[i])
+            fprintf(stderr, "  x%-2d  jit 0x%08x  interpreter 0x%08x\n", i,
+                    jit->x_regs[i], interp->x_regs[i]);
+    }
+    fprintf(stderr, "  pc   jit 0x%08x  interpreter 0x%08x\n", jit->pc,
+            interp->pc);
+    fprintf(stderr, "  cur  jit 0x%08x  interpreter 0x%08x\n",
+            jit->current_pc, interp->current_pc);
+    fprintf(stderr, "  ret  jit %llu  interpreter %llu\n",
+            (unsigned long long) jit->instret,
+            (unsigned long long) interp->instret);
+    fprintf(stderr, "  err  jit %d/%u/0x%08x  interpreter %d/%u/0x%08x\n",
+            jit->error, jit->exc_cause, jit->exc_val, interp->error,
+            interp->exc_cause, interp->exc_val);
+}
+
+static void jit_execute(hart_t *vm, const block_t *block)
+{
+    lockstep_state_t entry, jit, interp;
+    lockstep_save(vm, &entry);
+
+    lockstep.mem_load = vm->mem_load;
+    lockstep.mem_store = vm->mem_store;
+    lockstep.n_log = 0;
+    vm->mem_load = lockstep_record_load;
+    vm->mem_store = lockstep_record_store;
+    block->jit(vm);
+    lockstep_save(vm, &jit);
+
+    lockstep_restore(vm, &entry);
+    lockstep.pos = 0;
+    lockstep.diverged = false;
+    vm->mem_load = lockstep_replay_load;
+    vm->mem_store = lockstep_replay_store;
+    block_execute(vm, block->ir, block->ir + block->jit_len);
+    lockstep_save(vm, &interp);
+
+    vm->mem_load = lockstep.mem_load;
+    vm->mem_store = lockstep.mem_store;
+    if (lockstep.diverged || lockstep.pos != lockstep.n_log ||
+        !lockstep_equal(&jit, &interp)) {
+        fprintf(stderr,
+                "lockstep: hart %u diverged in the block at 0x%08x "
+                "(%u of %u instructions compiled)\n",
+                vm->mhartid, entry.pc, block->jit_len, block->n_insn);
+        lockstep_report(&jit, &interp);
+        abort();
+    }
+}
+#elif SEMU_HAS(JIT)
+static inline void jit_execute(hart_t *vm, const block_t *block)
+{
+    block->jit(vm);
+}
+#endif
+
+void vm_init(hart_t *vm)
+{
+    vm_flush_tlb(vm);
+#if SEMU_HAS(JIT)
+    jit_init(&vm->block_cache);
+#endif
+    vm_flush_blocks(vm);
+#if SEMU_HAS(THREADED_DISPATCH)
+    block_execute(vm, NULL, NULL);
+#endif
+    for (uint32_t i = 0; i < PMU_N_COUNTERS; i++)
+        vm->pmu[i].event = RV_N_EVENTS;
+    for (uint32_t i = 0; i < RV_N_EVENTS; i++)
+        vm->pmu_next[i] = UINT64_MAX;
+}
+
+void vm_step(hart_t *vm)
+{
+    if (vm->hsm_status != SBI_HSM_STATE_STARTED)
+        return;
+
+    if (unlikely(vm->error))
+        return;
+
+    if (unlikely(vm->wfi)) {
+        if (!vm_interrupt_pending(vm))
+            return;
+        vm->wfi = false;
+    }
+    if (unlikely(vm->wrs)) {
+        if (vm_wrs_stalled(vm))
+            return;
+        vm->wrs = false;
+    }
+
+    if (unlikely(vm->instret >= vm->pmu_next[RV_EVENT_INSTRET]))
+        vm_pmu_overflow(vm, RV_EVENT_INSTRET);
+
+    vm->current_pc = vm->pc;
+    uint32_t sip = __atomic_load_n(&vm->sip, __ATOMIC_RELAXED);
+    if ((vm->sstatus_sie || !vm->s_mode) && (sip & vm->sie)) {
+        uint32_t applicable = (sip & vm->sie);
+        /* counter overflows come last */
+        if (applicable & ~RV_INT_LCOFI_BIT)
+            applicable &= ~RV_INT_LCOFI_BIT;
+        uint8_t idx = ilog2(applicable);
+        if (idx == 1) {
+            emu_state_t *data = PRIV(vm);
+            __atomic_store_n(&data->sswi.ssip[vm->mhartid], 0,
+                             __ATOMIC_RELAXED);
+        }
+        vm->exc_cause = (1U << 31) | idx;
+        vm->stval = 0;
+        hart_trap(vm);
+    }
+
+    block_t *block = block_find(vm);
+    if (unlikely(vm->error))
+        return;
+    if (unlikely(!block->n_insn)) {
+        insn_execute_split(vm);
+        return;
+    }
+
+#if SEMU_HAS(JIT)
+    /* Compiled code may cover only the leading part of the block, in which
+     * case the interpreter picks up the rest.
+     */
+    if (block->jit) {
+        jit_execute(vm, block);
+        if (unlikely(vm->error) || block->jit_len == block->n_insn)
+            return;
+        block_run(vm, block, block->ir + block->jit_len);
+        return;
+    }
+    if (unlikely(++block->hits == JIT_THRESHOLD) && !vm->single_step)
+        jit_compile(&vm->block_cache, block);
+#endif
+
+    block_run(vm, block, block->ir);
+
+#if SEMU_HAS(JIT)
+    /* The block may not be dropped while it runs, so a full code buffer is
+     * only recycled here.
+     */
+    if (unlikely(vm->block_cache.code_full))
+        vm_flush_blocks(vm);
+#endif
 }
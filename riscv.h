@@ -34,15 +34,37 @@ typedef enum {
 typedef struct {
     uint32_t n_pages;
     uint32_t *page_addr;
+    uint32_t ppn; /**< physical page backing page_addr */
 } mmu_cache_t;
 
+/* Data TLB entry. "perm" holds the accesses (TLB_READ and TLB_WRITE) that the
+ * page allowed when the entry was filled, under the privilege mode, SUM and MXR
+ * in effect at that time. An entry with no permission is unused. Without
+ * paging, entries hold identity translations.
+ */
+typedef struct {
+    uint32_t vpn;
+    uint32_t ppn;
+    uint32_t perm;
+    uint32_t *page; /**< host address of a RAM page, NULL for MMIO */
+} mmu_tlb_entry_t;
+
+enum {
+    TLB_READ = 1 << 0,
+    TLB_WRITE = 1 << 1,
+    TLB_SET_BITS = 6,
+    TLB_WAYS = 2,
+};
+
 /* To use the emulator, start by initializing a hart_t object with zero values,
  * invoke vm_init(), and set the required environment-supplied callbacks. You
  * may also set other necessary fields such as argument registers and s_mode,
  * ensuring that all field restrictions are met to avoid undefined behavior.
  *
  * Once the emulator is set up, execute the emulation loop by calling
- * "vm_step()" repeatedly. Each call attempts to execute a single instruction.
+ * "vm_step()" repeatedly. Each call attempts to execute a single basic block,
+ * i.e. a run of instructions ending at the first control transfer, system
+ * instruction or page boundary.
  *
  * If the execution completes successfully, the "vm->error" field will be set
  * to ERR_NONE. However, if an error occurs during execution, the emulator will
@@ -54,11 +76,130 @@ typedef struct {
 typedef struct __hart_internal hart_t;
 typedef struct __vm_internel vm_t;
 
+/* Instructions are decoded once into the form below and then executed from
+ * the per-hart block cache. "impl" points to the handler of the instruction
+ * (or "label" to its code with threaded dispatch), while the remaining fields
+ * hold the already extracted operands.
+ */
+typedef struct __rv_insn rv_insn_t;
+struct __rv_insn {
+#if SEMU_HAS(THREADED_DISPATCH)
+    const void *label;
+#else
+    void (*impl)(hart_t *vm, const rv_insn_t *ir);
+#endif
+    /* sign-extended immediate, or the raw encoding for instructions that are
+     * decoded again at execution time (SYSTEM and AMO)
+     */
+    uint32_t imm;
+    uint8_t rd, rs1, rs2;
+    uint8_t opcode : 7; /**< see RV_INSN_LIST in riscv_private.h */
+    uint8_t rvc : 1;    /**< expanded from a 16-bit compressed encoding */
+};
+
+/* A basic block is a straight run of pre-decoded instructions within one
+ * physical page. It ends at the first instruction which may redirect the pc or
+ * change the translation context.
+ */
+typedef struct __block block_t;
+struct __block {
+    uint32_t paddr; /**< physical address of the first instruction */
+    uint32_t gen;   /**< generation of the code page at translation time */
+    uint32_t n_insn;
+    rv_insn_t *ir;
+    block_t *hash_next;
+#if SEMU_HAS(JIT)
+    uint32_t hits;    /**< number of interpreted executions */
+    uint32_t jit_len; /**< leading instructions covered by "jit" */
+    void (*jit)(hart_t *vm);
+#endif
+};
+
+enum {
+    BLOCK_MAX_INSN = 64,
+    BLOCK_MAP_BITS = 14,
+    BLOCK_POOL_SIZE = 1 << 16,
+    BLOCK_INSN_POOL_SIZE = 1 << 18,
+};
+
+/* Blocks and instructions are carved out of fixed pools. Once either pool is
+ * exhausted, the whole cache is flushed and refilled on demand.
+ */
+typedef struct {
+    block_t *map[1 << BLOCK_MAP_BITS]; /**< hash chains keyed by paddr */
+    block_t blocks[BLOCK_POOL_SIZE];
+    rv_insn_t insns[BLOCK_INSN_POOL_SIZE];
+    uint32_t n_blocks, n_insns;
+#if SEMU_HAS(JIT)
+    uint8_t *code; /**< host code of compiled blocks, see jit.h */
+    uint32_t code_used;
+    bool code_full;
+#endif
+} block_cache_t;
+
+/* Emulator events that the PMU counts, see vm_event() */
+enum {
+    RV_EVENT_INSTRET, /**< instructions retired, counted by instret itself */
+    RV_EVENT_TRAP,    /**< traps taken, see hart_trap() */
+    RV_EVENT_PAGE_WALK,
+    RV_EVENT_FETCH_MISS, /**< fetches from another page than the last */
+    RV_EVENT_MMIO,       /**< loads and stores that reach a device */
+    RV_EVENT_SC_FAIL,
+    RV_N_EVENTS,
+};
+
+/* The programmable counters hpmcounter3 and up */
+#define PMU_FIRST_COUNTER 3
+#ifndef PMU_N_COUNTERS
+#define PMU_N_COUNTERS 8
+#endif
+
+typedef struct {
+    uint32_t event; /**< RV_EVENT_*, RV_N_EVENTS if the counter is free */
+    bool running;
+    /* A stopped counter holds its count in "value". A running one counts the
+     * event from "base" on, and wraps around once the event count reaches
+     * "wrap_at", or never if that is UINT64_MAX.
+     */
+    uint64_t value;
+    uint64_t base;
+    uint64_t wrap_at;
+} pmu_counter_t;
+
+#if SEMU_HAS(STATS)
+/* Event counters of a hart, see stats.h. Only the hart itself updates them. */
+typedef struct {
+    uint64_t exceptions[16]; /**< traps by exception code */
+    uint64_t interrupts[16]; /**< traps by interrupt code */
+    uint64_t fetch_misses;   /**< fetches from another page than the last */
+    uint64_t block_misses;   /**< blocks decoded */
+    uint64_t page_walks;
+    uint64_t mmio_loads[256], mmio_stores[256]; /**< by 1 MiB region */
+    uint64_t sbi_calls[16]; /**< by extension, see STATS_SBI_* */
+    uint64_t sc_failures;
+} hart_stats_t;
+
+#define STATS_INC(vm, counter) ((vm)->stats.counter++)
+#else
+#define STATS_INC(vm, counter) ((void) 0)
+#endif
+
 struct __hart_internal {
     uint32_t x_regs[32];
 
-    /* LR reservation virtual address. last bit is 1 if valid */
+    /* Floating-point registers. Single-precision values are NaN-boxed, i.e.
+     * the upper 32 bits are all ones.
+     */
+    uint64_t f_regs[32];
+    uint8_t fflags; /**< accrued exceptions */
+    uint8_t frm;    /**< dynamic rounding mode */
+
+    /* LR reservation physical address. last bit is 1 if valid. "lr_value" is
+     * the word that LR loaded, which SC compares against to detect an
+     * intervening store from another host thread.
+     */
     uint32_t lr_reservation;
+    uint32_t lr_value;
 
     /* Assumed to contain an aligned address at all times */
     uint32_t pc;
@@ -87,6 +228,11 @@ struct __hart_internal {
 
     mmu_cache_t cache_fetch;
 
+    /* Set-associative data TLB indexed by the low bits of the VPN. Within a
+     * set, entries are kept from the most to the least recently filled.
+     */
+    mmu_tlb_entry_t dtlb[1 << TLB_SET_BITS][TLB_WAYS];
+
     /* Supervisor state */
     bool s_mode;
     bool sstatus_spp; /**< state saved at trap */
@@ -97,18 +243,39 @@ struct __hart_internal {
     bool sstatus_mxr; /**< alter MMU access rules */
     bool sstatus_sum;
     bool sstatus_sie; /**< interrupt state */
+    uint8_t sstatus_fs; /**< floating-point unit state, see RV_FS_* */
     uint32_t sie;
     uint32_t sip;
+    /* Set by WFI. The hart stays stalled until one of the interrupts enabled
+     * in sie becomes pending, whether or not sstatus.SIE is set.
+     */
+    bool wfi;
+    /* Set by WRS.NTO and WRS.STO if the LR reservation is valid. The hart stays
+     * stalled until a store invalidates the reservation or one of the
+     * interrupts enabled in sie becomes pending. The environment may end the
+     * stall early by clearing the flag, which both variants allow.
+     */
+    bool wrs;
+    /* Set by PAUSE, as the hart spins waiting for another one. The environment
+     * ends the turn of the hart early and clears the flag.
+     */
+    bool yield;
     uint32_t stvec_addr; /**< trap config */
     bool stvec_vectored;
     uint32_t sscratch; /**< misc */
     uint32_t scounteren;
+    uint32_t senvcfg; /**< see RV_ENVCFG_* */
     uint32_t satp; /**< MMU */
     uint32_t *page_table;
 
     /* Machine state */
     uint32_t mhartid;
 
+    /* Limit translated blocks to a single instruction, so that each call of
+     * vm_step() retires exactly one instruction as the gdbstub expects.
+     */
+    bool single_step;
+
     void *priv; /**< environment supplied */
 
     /* Memory access sets the vm->error to indicate failure. On successful
@@ -124,6 +291,12 @@ struct __hart_internal {
      */
     uint32_t *(*mem_page_table)(const hart_t *vm, uint32_t ppn);
 
+    /* Return the host address of the physical page if it is RAM that aligned
+     * loads and stores may access in place, bypassing mem_load and mem_store.
+     * Return NULL for any other page, such as MMIO.
+     */
+    uint32_t *(*mem_ram_page)(const hart_t *vm, uint32_t ppn);
+
     /* Point to the associated vm_t for better access to other harts. For
      * example, if hart 0 needs to send an IPI to hart 1, the IPI signal can be
      * sent to hart 1 through the *vm pointer.
@@ -133,18 +306,79 @@ struct __hart_internal {
     bool hsm_resume_is_ret;
     int32_t hsm_resume_pc;
     int32_t hsm_resume_opaque;
+
+    /* Remote fences (RFENCE_*) that other harts requested through SBI. The
+     * environment carries them out between two calls of vm_step() and clears
+     * the bits once done.
+     */
+    uint32_t rfence_pending;
+
+    block_cache_t block_cache;
+
+    /* Counts of the RV_EVENT_* events, and the counters of the PMU. A counter
+     * that wraps around sets its bit in "pmu_overflow", i.e. scountovf, and
+     * raises LCOFIP (Sscofpmf). "pmu_next" is the lowest "wrap_at" among the
+     * running counters of each event.
+     */
+    uint64_t events[RV_N_EVENTS];
+    pmu_counter_t pmu[PMU_N_COUNTERS];
+    uint32_t pmu_overflow;
+    uint64_t pmu_next[RV_N_EVENTS];
+
+#if SEMU_HAS(STATS)
+    hart_stats_t stats;
+#endif
 };
 
+#define LR_BUCKETS 64
+
 struct __vm_internel {
     uint32_t n_hart;
     hart_t **hart;
+
+    /* State of each physical page that mem_fetch() can return, shared by all
+     * harts. Bit 0 is set while pre-decoded blocks may exist for the page, and
+     * the first store after that bumps the value. A block whose recorded
+     * generation no longer matches is therefore stale.
+     */
+    uint32_t n_pages;
+    uint32_t *page_gen;
+
+    /* Number of valid LR reservations whose word hashes to each bucket. A
+     * store only looks for reservations to cancel if its bucket is in use.
+     */
+    uint32_t lr_buckets[LR_BUCKETS];
+};
+
+enum {
+    RFENCE_FENCE_I = 1 << 0,
+    RFENCE_SFENCE_VMA = 1 << 1,
 };
 
 void vm_init(hart_t *vm);
 
-/* Emulate the next instruction. This is a no-op if the error is already set. */
+/* Emulate the next basic block. This is a no-op if the error is already set.
+ * Execution stops early at the first instruction that sets the error.
+ */
 void vm_step(hart_t *vm);
 
+/* Discard all pre-decoded blocks of the hart. This is what FENCE.I does, and
+ * the environment calls it for remote fences or after writing guest code
+ * behind the back of the store path (e.g. DMA).
+ */
+void vm_flush_blocks(hart_t *vm);
+
+/* Drop all cached address translations of the hart, as SFENCE.VMA does. The
+ * environment calls it to carry out remote fences.
+ */
+void vm_flush_tlb(hart_t *vm);
+
+/* Rebuild the host state that derives from the architectural state of the
+ * hart, i.e. its caches and root page table, after the environment replaced
+ * that state wholesale, such as from a snapshot. The LR reservation is lost.
+ */
+void vm_reload(hart_t *vm);
+
 /* Raise a RISC-V exception. This is equivalent to setting vm->error to
  * ERR_EXCEPTION and setting the accompanying fields. It is provided as
  * a function for convenience and to prevent mistakes such as forgetting to
@@ -152,6 +386,63 @@ void vm_step(hart_t *vm);
  */
 void vm_set_exception(hart_t *vm, uint32_t cause, uint32_t val);
 
+/* Read the aligned word at virtual address "addr" as the hart sees it, but
+ * without side effects: no accessed bit is set and no exception is raised.
+ * Return false if the word is not mapped to RAM.
+ */
+bool vm_peek(const hart_t *vm, uint32_t addr, uint32_t *value);
+
+/* Raise or clear the interrupt pending bits "mask" of sip. Devices may call
+ * this from another thread than the one running the hart, so the bits are
+ * updated atomically, and only when they change.
+ */
+static inline void vm_set_pending(hart_t *vm, uint32_t mask, bool pending)
+{
+    uint32_t sip = __atomic_load_n(&vm->sip, __ATOMIC_RELAXED);
+    if (pending && (sip & mask) != mask)
+        __atomic_fetch_or(&vm->sip, mask, __ATOMIC_RELAXED);
+    else if (!pending && (sip & mask))
+        __atomic_fetch_and(&vm->sip, ~mask, __ATOMIC_RELAXED);
+}
+
+/* Assign the event to PMU counter "idx", or RV_N_EVENTS to free it. The counter
+ * is stopped and cleared.
+ */
+void vm_pmu_configure(hart_t *vm, uint32_t idx, uint32_t event);
+
+/* Start or stop PMU counter "idx". Starting clears its overflow bit. */
+void vm_pmu_start(hart_t *vm, uint32_t idx);
+void vm_pmu_stop(hart_t *vm, uint32_t idx);
+
+uint64_t vm_pmu_read(const hart_t *vm, uint32_t idx);
+void vm_pmu_write(hart_t *vm, uint32_t idx, uint64_t value);
+
+/* Flag the counters of the event that have wrapped around */
+void vm_pmu_overflow(hart_t *vm, uint32_t event);
+
+/* Count an occurrence of the event, other than RV_EVENT_INSTRET */
+static inline void vm_event(hart_t *vm, uint32_t event)
+{
+    if (unlikely(++vm->events[event] >= vm->pmu_next[event]))
+        vm_pmu_overflow(vm, event);
+}
+
+/* Return true if an interrupt enabled in sie is pending, which ends WFI */
+static inline bool vm_interrupt_pending(const hart_t *vm)
+{
+    return __atomic_load_n(&vm->sip, __ATOMIC_RELAXED) & vm->sie;
+}
+
+/* Return true while WRS keeps the hart stalled. Another hart may invalidate
+ * the reservation at any time.
+ */
+static inline bool vm_wrs_stalled(const hart_t *vm)
+{
+    return vm->wrs &&
+           (__atomic_load_n(&vm->lr_reservation, __ATOMIC_RELAXED) & 1) &&
+           !vm_interrupt_pending(vm);
+}
+
 /* Delegate the currently set exception to S-mode as a trap. This function does
  * not check if vm->error is EXC_EXCEPTION; it assumes that "exc_cause" and
  * "exc_val" are correctly set. It sets vm->error to ERR_NONE.
@@ -14,6 +14,98 @@ enum {
     RV32_MISC_MEM = 0b0001111,
     RV32_SYSTEM = 0b1110011,
     RV32_AMO = 0b0101111,
+    /* F and D extensions */
+    RV32_LOAD_FP = 0b0000111,
+    RV32_STORE_FP = 0b0100111,
+    RV32_MADD = 0b1000011,
+    RV32_MSUB = 0b1000111,
+    RV32_NMSUB = 0b1001011,
+    RV32_NMADD = 0b1001111,
+    RV32_OP_FP = 0b1010011,
+};
+
+/* Instructions known to the pre-decoder. Each entry has a handler "do_<name>"
+ * in riscv.c and a matching RV_INSN_<name> opcode.
+ */
+/* clang-format off */
+#define RV_INSN_LIST                                                  \
+    _(nop) _(illegal)                                                 \
+    _(lui) _(auipc) _(jal) _(jalr)                                    \
+    _(beq) _(bne) _(blt) _(bge) _(bltu) _(bgeu)                       \
+    _(lb) _(lh) _(lw) _(lbu) _(lhu) _(sb) _(sh) _(sw)                 \
+    _(addi) _(slti) _(sltiu) _(xori) _(ori) _(andi)                   \
+    _(slli) _(srli) _(srai)                                           \
+    _(add) _(sub) _(sll) _(slt) _(sltu) _(xor) _(srl) _(sra)          \
+    _(or) _(and)                                                      \
+    _(mul) _(mulh) _(mulhsu) _(mulhu) _(div) _(divu) _(rem) _(remu)   \
+    _(fence) _(fencei) _(pause) _(cbo_zero) _(amo) _(system)          \
+    RV_INSN_LIST_B                                                    \
+    RV_INSN_LIST_FP
+
+/* Zba, Zbb and Zbs bit-manipulation extensions */
+#define RV_INSN_LIST_B                                                \
+    _(sh1add) _(sh2add) _(sh3add)                                     \
+    _(andn) _(orn) _(xnor) _(clz) _(ctz) _(cpop)                      \
+    _(max) _(maxu) _(min) _(minu) _(sext_b) _(sext_h) _(zext_h)       \
+    _(rol) _(ror) _(rori) _(orc_b) _(rev8)                            \
+    _(bclr) _(bclri) _(bext) _(bexti) _(binv) _(binvi) _(bset) _(bseti)
+
+/* F and D extensions. Fused multiply-adds keep rs3 in bits 7:3 of the
+ * immediate, and every instruction taking a rounding mode keeps it in bits 2:0.
+ * Sign injection, min/max and comparisons keep their funct3 there instead.
+ */
+#define RV_INSN_LIST_FP                                               \
+    _(flw) _(fsw) _(fld) _(fsd)                                       \
+    _(fmadd_s) _(fmsub_s) _(fnmsub_s) _(fnmadd_s)                     \
+    _(fadd_s) _(fsub_s) _(fmul_s) _(fdiv_s) _(fsqrt_s)                \
+    _(fsgnj_s) _(fminmax_s) _(fcmp_s) _(fcvt_w_s) _(fcvt_s_w)         \
+    _(fmv_x_w) _(fmv_w_x) _(fclass_s)                                 \
+    _(fmadd_d) _(fmsub_d) _(fnmsub_d) _(fnmadd_d)                     \
+    _(fadd_d) _(fsub_d) _(fmul_d) _(fdiv_d) _(fsqrt_d)                \
+    _(fsgnj_d) _(fminmax_d) _(fcmp_d) _(fcvt_w_d) _(fcvt_d_w)         \
+    _(fclass_d) _(fcvt_s_d) _(fcvt_d_s)
+/* clang-format on */
+
+enum {
+#define _(inst) RV_INSN_##inst,
+    RV_INSN_LIST
+#undef _
+    N_RV_INSNS
+};
+_Static_assert(N_RV_INSNS <= 128, "rv_insn_t holds opcodes in 7 bits");
+
+/* floating-point rounding modes */
+enum {
+    RV_RM_RNE = 0b000, /**< round to nearest, ties to even */
+    RV_RM_RTZ = 0b001, /**< round towards zero */
+    RV_RM_RDN = 0b010, /**< round down */
+    RV_RM_RUP = 0b011, /**< round up */
+    RV_RM_RMM = 0b100, /**< round to nearest, ties to max magnitude */
+    RV_RM_DYN = 0b111, /**< use the rounding mode in frm */
+};
+
+/* floating-point accrued exception flags (fflags) */
+enum {
+    RV_FFLAG_NX = 1 << 0, /**< inexact */
+    RV_FFLAG_UF = 1 << 1, /**< underflow */
+    RV_FFLAG_OF = 1 << 2, /**< overflow */
+    RV_FFLAG_DZ = 1 << 3, /**< divide by zero */
+    RV_FFLAG_NV = 1 << 4, /**< invalid operation */
+};
+
+/* sstatus.FS: state of the floating-point unit */
+enum {
+    RV_FS_OFF = 0,
+    RV_FS_INITIAL = 1,
+    RV_FS_CLEAN = 2,
+    RV_FS_DIRTY = 3,
+};
+
+/* senvcfg fields. Only CBZE is writable, as the others control extensions
+ * that are not implemented.
+ */
+enum {
+    RV_ENVCFG_CBZE = 1 << 7, /**< CBO.ZERO is allowed in U-mode */
 };
 
 enum {
@@ -29,6 +121,9 @@ enum {
 
 /* RISC-V registers (mnemonics, ABI names) */
 enum {
+    RV_R_RA = 1,
+    RV_R_SP = 2,
+    RV_R_FP = 8,
     RV_R_A0 = 10,
     RV_R_A1 = 11,
     RV_R_A2 = 12,
@@ -41,10 +136,19 @@ enum {
 
 /* unprivileged ISA: CSRs */
 enum {
+    RV_CSR_FFLAGS = 0x001, /**< Floating-point accrued exceptions */
+    RV_CSR_FRM = 0x002,    /**< Floating-point dynamic rounding mode */
+    RV_CSR_FCSR = 0x003,   /**< Floating-point control and status */
+    RV_CSR_CYCLE = 0xC00,
     RV_CSR_TIME = 0xC01,
     RV_CSR_INSTRET = 0xC02,
+    RV_CSR_HPMCOUNTER3 = 0xC03,
+    RV_CSR_HPMCOUNTER31 = 0xC1F,
+    RV_CSR_CYCLEH = 0xC80,
     RV_CSR_TIMEH = 0xC81,
     RV_CSR_INSTRETH = 0xC82,
+    RV_CSR_HPMCOUNTER3H = 0xC83,
+    RV_CSR_HPMCOUNTER31H = 0xC9F,
 };
 
 /* privileged ISA: CSRs */
@@ -66,8 +170,15 @@ enum {
     RV_CSR_STVAL = 0x143,  /**< Supervisor bad address or instruction */
     RV_CSR_SIP = 0x144,    /**< Supervisor interrupt pending */
 
+    /* S-mode (Supervisor Timer Compare, Sstc) */
+    RV_CSR_STIMECMP = 0x14D,  /**< Supervisor timer compare, low half */
+    RV_CSR_STIMECMPH = 0x15D, /**< Supervisor timer compare, high half */
+
     /* S-mode (Supervisor Protection and Translation) */
     RV_CSR_SATP = 0x180, /**< Supervisor address translation and protection */
+
+    /* S-mode (Supervisor Count Overflow, Sscofpmf) */
+    RV_CSR_SCOUNTOVF = 0xDA0, /**< Overflow bits of the hpmcounters */
 };
 
 /* privileged ISA: exception causes */
@@ -99,6 +210,8 @@ enum {
     RV_INT_STI_BIT = (1 << RV_INT_STI),
     RV_INT_SEI = 9,
     RV_INT_SEI_BIT = (1 << RV_INT_SEI),
+    RV_INT_LCOFI = 13, /**< local counter overflow, Sscofpmf */
+    RV_INT_LCOFI_BIT = (1 << RV_INT_LCOFI),
 };
 
 /* SBI 0.2 */
@@ -155,3 +268,29 @@ enum {
 #define SBI_RFENCE__GVMA 4
 #define SBI_RFENCE__VVMA_ASID 5
 #define SBI_RFENCE__VVMA 6
+
+#define SBI_EID_PMU 0x504D55
+#define SBI_PMU__NUM_COUNTERS 0
+#define SBI_PMU__COUNTER_GET_INFO 1
+#define SBI_PMU__COUNTER_CONFIG_MATCHING 2
+#define SBI_PMU__COUNTER_START 3
+#define SBI_PMU__COUNTER_STOP 4
+#define SBI_PMU__COUNTER_FW_READ 5
+
+#define SBI_PMU_CFG_FLAG_SKIP_MATCH (1 << 0)
+#define SBI_PMU_CFG_FLAG_CLEAR_VALUE (1 << 1)
+#define SBI_PMU_CFG_FLAG_AUTO_START (1 << 2)
+#define SBI_PMU_START_FLAG_SET_INIT_VALUE (1 << 0)
+#define SBI_PMU_STOP_FLAG_RESET (1 << 0)
+
+#define SBI_PMU_EVENT_TYPE_HW 0
+#define SBI_PMU_EVENT_TYPE_CACHE 1
+#define SBI_PMU_EVENT_TYPE_RAW 2
+#define SBI_PMU_HW_CPU_CYCLES 1
+#define SBI_PMU_HW_INSTRUCTIONS 2
+/* cache event codes are (cache << 3) | (operation << 1) | result */
+#define SBI_PMU_HW_CACHE_ITLB_READ_MISS ((4 << 3) | (0 << 1) | 1)
+
+/* Firmware-specific extension of semu */
+#define SBI_EID_SEMU 0x0A000000
+#define SBI_SEMU__FORK_SERVER 0 /**< see forkserver.h */
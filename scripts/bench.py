@@ -0,0 +1,576 @@
+#!/usr/bin/env python3
+"""Bare-metal CPU benchmarks for semu.
+
+Each kernel is a small RV32IMA program, assembled here so that no cross
+toolchain is needed. It runs on the emulator like a Linux image would, then
+prints the instructions that every hart retired and shuts the machine down.
+The speed of a kernel is the instructions it retired over the wall-clock time
+of the best run, less the time that the emulator takes to start up and shut
+down. The result is printed as JSON.
+
+usage: bench.py [--runs N] [--only NAME,...] semu dtb
+"""
+
+import argparse
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+REGS = {
+    "zero": 0, "ra": 1, "sp": 2, "gp": 3, "tp": 4, "t0": 5, "t1": 6, "t2": 7,
+    "s0": 8, "s1": 9, "a0": 10, "a1": 11, "a2": 12, "a3": 13, "a4": 14,
+    "a5": 15, "a6": 16, "a7": 17, "s2": 18, "s3": 19, "s4": 20, "s5": 21,
+    "s6": 22, "s7": 23, "s8": 24, "s9": 25, "s10": 26, "s11": 27, "t3": 28,
+    "t4": 29, "t5": 30, "t6": 31,
+}
+
+CSRS = {
+    "sstatus": 0x100, "sie": 0x104, "stvec": 0x105, "sscratch": 0x140,
+    "sepc": 0x141, "scause": 0x142, "satp": 0x180, "instret": 0xC02,
+    "instreth": 0xC82,
+}
+
+UART = 0xF4000000
+SBI_EID_HSM = 0x48534D
+SBI_EID_RST = 0x53525354
+
+# Data of the kernels lives above the image, well below the device tree
+BUF = 0x01000000
+SLOTS = 0x00F00000  # per-hart instruction counts of the AMO kernel
+
+
+class Asm:
+    """Assembler for the subset of RV32IMA that the kernels use. The image is
+    loaded at address 0, so label offsets are addresses.
+    """
+
+    def __init__(self):
+        self.words = []
+        self.labels = {}
+        self.fixups = []
+        self.n_local = 0
+
+    def local(self):
+        self.n_local += 1
+        return f".L{self.n_local}"
+
+    def label(self, name):
+        assert name not in self.labels, name
+        self.labels[name] = 4 * len(self.words)
+
+    def here(self):
+        return 4 * len(self.words)
+
+    def word(self, value):
+        self.words.append(value & 0xFFFFFFFF)
+
+    def align(self, size):
+        while self.here() % size:
+            self.word(0)
+
+    # encodings
+    def r_type(self, opcode, f3, f7, rd, rs1, rs2):
+        self.word(f7 << 25 | REGS[rs2] << 20 | REGS[rs1] << 15 | f3 << 12 |
+                  REGS[rd] << 7 | opcode)
+
+    def i_type(self, opcode, f3, rd, rs1, imm):
+        assert -2048 <= imm < 2048, imm
+        self.word((imm & 0xFFF) << 20 | REGS[rs1] << 15 | f3 << 12 |
+                  REGS[rd] << 7 | opcode)
+
+    def s_type(self, f3, rs2, rs1, imm):
+        assert -2048 <= imm < 2048, imm
+        self.word((imm >> 5 & 0x7F) << 25 | REGS[rs2] << 20 |
+                  REGS[rs1] << 15 | f3 << 12 | (imm & 0x1F) << 7 | 0x23)
+
+    def b_type(self, f3, rs1, rs2, target):
+        self.fixups.append((len(self.words), "b", target))
+        self.word(REGS[rs2] << 20 | REGS[rs1] << 15 | f3 << 12 | 0x63)
+
+    def resolve(self):
+        for idx, kind, target in self.fixups:
+            addr = self.labels[target]
+            off = addr - 4 * idx
+            w = self.words[idx]
+            if kind == "b":
+                assert -4096 <= off < 4096, target
+                w |= ((off >> 12 & 1) << 31 | (off >> 5 & 0x3F) << 25 |
+                      (off >> 1 & 0xF) << 8 | (off >> 11 & 1) << 7)
+            elif kind == "j":
+                assert -(1 << 20) <= off < (1 << 20), target
+                w |= ((off >> 20 & 1) << 31 | (off >> 1 & 0x3FF) << 21 |
+                      (off >> 11 & 1) << 20 | (off >> 12 & 0xFF) << 12)
+            elif kind == "hi":
+                w |= ((addr + 0x800) >> 12 & 0xFFFFF) << 12
+            elif kind == "lo":
+                w |= (addr & 0xFFF) << 20
+            self.words[idx] = w
+        return b"".join(w.to_bytes(4, "little") for w in self.words)
+
+    # instructions
+    def add(self, rd, rs1, rs2): self.r_type(0x33, 0, 0, rd, rs1, rs2)
+    def sub(self, rd, rs1, rs2): self.r_type(0x33, 0, 0x20, rd, rs1, rs2)
+    def xor(self, rd, rs1, rs2): self.r_type(0x33, 4, 0, rd, rs1, rs2)
+    def or_(self, rd, rs1, rs2): self.r_type(0x33, 6, 0, rd, rs1, rs2)
+    def and_(self, rd, rs1, rs2): self.r_type(0x33, 7, 0, rd, rs1, rs2)
+    def sltu(self, rd, rs1, rs2): self.r_type(0x33, 3, 0, rd, rs1, rs2)
+    def mul(self, rd, rs1, rs2): self.r_type(0x33, 0, 1, rd, rs1, rs2)
+    def addi(self, rd, rs1, imm): self.i_type(0x13, 0, rd, rs1, imm)
+    def andi(self, rd, rs1, imm): self.i_type(0x13, 7, rd, rs1, imm)
+    def slli(self, rd, rs1, sh): self.i_type(0x13, 1, rd, rs1, sh)
+    def srli(self, rd, rs1, sh): self.i_type(0x13, 5, rd, rs1, sh)
+    def srl(self, rd, rs1, rs2): self.r_type(0x33, 5, 0, rd, rs1, rs2)
+    def lw(self, rd, imm, rs1): self.i_type(0x03, 2, rd, rs1, imm)
+    def sw(self, rs2, imm, rs1): self.s_type(2, rs2, rs1, imm)
+    def sb(self, rs2, imm, rs1): self.s_type(0, rs2, rs1, imm)
+    def beq(self, rs1, rs2, t): self.b_type(0, rs1, rs2, t)
+    def bne(self, rs1, rs2, t): self.b_type(1, rs1, rs2, t)
+    def blt(self, rs1, rs2, t): self.b_type(4, rs1, rs2, t)
+    def bge(self, rs1, rs2, t): self.b_type(5, rs1, rs2, t)
+    def bltu(self, rs1, rs2, t): self.b_type(6, rs1, rs2, t)
+    def beqz(self, rs, t): self.beq(rs, "zero", t)
+    def bnez(self, rs, t): self.bne(rs, "zero", t)
+    def mv(self, rd, rs): self.addi(rd, rs, 0)
+
+    def jal(self, rd, target):
+        self.fixups.append((len(self.words), "j", target))
+        self.word(REGS[rd] << 7 | 0x6F)
+
+    def j(self, target): self.jal("zero", target)
+    def call(self, target): self.jal("ra", target)
+    def ret(self): self.i_type(0x67, 0, "zero", "ra", 0)
+
+    def li(self, rd, value):
+        value &= 0xFFFFFFFF
+        if value >= 0x80000000:
+            value -= 1 << 32
+        if -2048 <= value < 2048:
+            self.addi(rd, "zero", value)
+            return
+        hi = (value + 0x800) >> 12 & 0xFFFFF
+        lo = value - ((hi << 12) if hi < 0x80000 else (hi << 12) - (1 << 32))
+        self.word(hi << 12 | REGS[rd] << 7 | 0x37)  # lui
+        if lo:
+            self.addi(rd, rd, lo)
+
+    def la(self, rd, target):
+        self.fixups.append((len(self.words), "hi", target))
+        self.word(REGS[rd] << 7 | 0x37)  # lui
+        self.fixups.append((len(self.words), "lo", target))
+        self.word(REGS[rd] << 15 | REGS[rd] << 7 | 0x13)  # addi
+
+    def csrrw(self, rd, csr, rs): self.i_csr(1, rd, csr, rs)
+    def csrrs(self, rd, csr, rs): self.i_csr(2, rd, csr, rs)
+    def csrrc(self, rd, csr, rs): self.i_csr(3, rd, csr, rs)
+    def csrr(self, rd, csr): self.csrrs(rd, csr, "zero")
+    def csrw(self, csr, rs): self.csrrw("zero", csr, rs)
+    def csrs(self, csr, rs): self.csrrs("zero", csr, rs)
+    def csrc(self, csr, rs): self.csrrc("zero", csr, rs)
+
+    def i_csr(self, f3, rd, csr, rs):
+        self.word(CSRS[csr] << 20 | REGS[rs] << 15 | f3 << 12 |
+                  REGS[rd] << 7 | 0x73)
+
+    def amoadd_w(self, rd, rs2, rs1):
+        self.r_type(0x2F, 2, 0, rd, rs1, rs2)
+
+    def ecall(self): self.word(0x00000073)
+    def ebreak(self): self.word(0x00100073)
+    def sret(self): self.word(0x10200073)
+    def wfi(self): self.word(0x10500073)
+    def sfence_vma(self): self.word(0x12000073)
+
+
+def prologue(a):
+    """Enter U-mode once, which the emulator takes as the end of the boot, so
+    that the kernels run at the speed of a booted system. Every trap returns
+    to S-mode right after the trapping instruction.
+    """
+    a.label("_start")
+    a.la("t0", "trap")
+    a.csrw("stvec", "t0")
+    a.la("t0", "user")
+    a.csrw("sepc", "t0")
+    a.li("t0", 1 << 8)  # sstatus.SPP
+    a.csrc("sstatus", "t0")
+    a.sret()
+    a.label("user")
+    a.ecall()
+    a.j("main")
+
+    a.label("trap")
+    a.csrr("t6", "sepc")
+    a.addi("t6", "t6", 4)
+    a.csrw("sepc", "t6")
+    a.li("t6", 1 << 8)
+    a.csrs("sstatus", "t6")
+    a.sret()
+
+
+def print_hex(a):
+    """Print a0 as eight hex digits, clobbering t0 to t5"""
+    a.label("print_hex")
+    a.li("t0", 28)
+    a.li("t5", UART)
+    a.label("print_hex.loop")
+    a.srl("t1", "a0", "t0")
+    a.andi("t1", "t1", 15)
+    a.addi("t3", "t1", -10)
+    a.blt("t3", "zero", "print_hex.digit")
+    a.addi("t1", "t1", ord("a") - ord("0") - 10)
+    a.label("print_hex.digit")
+    a.addi("t1", "t1", ord("0"))
+    a.sb("t1", 0, "t5")
+    a.addi("t0", "t0", -4)
+    a.bge("t0", "zero", "print_hex.loop")
+    a.ret()
+
+
+def read_instret(a, hi, lo):
+    again = a.local()
+    a.label(again)
+    a.csrr(hi, "instreth")
+    a.csrr(lo, "instret")
+    a.csrr("t0", "instreth")
+    a.bne(hi, "t0", again)
+
+
+def print_count(a, hi, lo):
+    """Print the 64-bit count as a line of 16 hex digits"""
+    a.mv("a0", hi)
+    a.call("print_hex")
+    a.mv("a0", lo)
+    a.call("print_hex")
+    a.li("t5", UART)
+    a.li("t1", ord("\n"))
+    a.sb("t1", 0, "t5")
+
+
+def shutdown(a):
+    a.li("a7", SBI_EID_RST)
+    a.li("a6", 0)
+    a.li("a0", 0)
+    a.li("a1", 0)
+    a.ecall()
+    halt = a.local()
+    a.label(halt)
+    a.wfi()
+    a.j(halt)
+
+
+def epilogue(a):
+    """Report the instructions of the single hart and shut down"""
+    a.csrw("satp", "zero")  # the UART is not mapped
+    a.sfence_vma()
+    read_instret(a, "s10", "s11")
+    print_count(a, "s10", "s11")
+    shutdown(a)
+    print_hex(a)
+
+
+def mmu_on(a):
+    """Map the first 1 GiB onto itself with megapages and turn on Sv32"""
+    a.la("t0", "page_table")
+    a.srli("t0", "t0", 12)
+    a.li("t1", 1 << 31)
+    a.or_("t0", "t0", "t1")
+    a.csrw("satp", "t0")
+    a.sfence_vma()
+
+
+def page_table(a):
+    a.align(4096)
+    a.label("page_table")
+    for i in range(1024):
+        # V, R, W, X, A and D, for S-mode only
+        a.word((i << 20) | 0xCF if i < 256 else 0)
+
+
+def kernel_alu(a, n):
+    a.label("main")
+    a.li("s0", n)
+    a.li("a0", 1)
+    a.li("a1", 0x12345)
+    a.label("loop")
+    a.add("a0", "a0", "a1")
+    a.xor("a1", "a1", "a0")
+    a.slli("a2", "a0", 3)
+    a.srli("a3", "a1", 5)
+    a.sub("a4", "a2", "a3")
+    a.mul("a5", "a4", "a0")
+    a.or_("a0", "a0", "a5")
+    a.and_("a1", "a1", "a4")
+    a.addi("s0", "s0", -1)
+    a.bnez("s0", "loop")
+    epilogue(a)
+
+
+def kernel_branch(a, n):
+    """Branches on pseudo-random bits, which end a block every few
+    instructions
+    """
+    a.label("main")
+    a.li("s0", n)
+    a.li("s1", 1)
+    a.li("s2", 1103515245)
+    a.li("s3", 12345)
+    a.label("loop")
+    a.mul("s1", "s1", "s2")
+    a.add("s1", "s1", "s3")
+    a.srli("t0", "s1", 16)
+    a.andi("t1", "t0", 1)
+    a.beqz("t1", "skip1")
+    a.addi("a0", "a0", 1)
+    a.label("skip1")
+    a.andi("t1", "t0", 2)
+    a.bnez("t1", "skip2")
+    a.addi("a1", "a1", 1)
+    a.label("skip2")
+    a.andi("t1", "t0", 4)
+    a.beqz("t1", "skip3")
+    a.xor("a2", "a2", "t0")
+    a.label("skip3")
+    a.addi("s0", "s0", -1)
+    a.bnez("s0", "loop")
+    epilogue(a)
+
+
+CHASE_NODES = 1 << 18  # 1 MiB of words
+CHASE_STRIDE = 40503  # odd, so the chain visits every node
+
+
+def kernel_chase(a, n, mmu=False):
+    """Follow a chain of pointers that jumps about 160 KiB each time"""
+    a.label("main")
+    if mmu:
+        mmu_on(a)
+    # node i points to node (i + CHASE_STRIDE) % CHASE_NODES
+    a.li("s1", BUF)
+    a.li("s2", CHASE_NODES - 1)
+    a.li("s3", CHASE_STRIDE)
+    a.li("t0", 0)
+    a.label("build")
+    a.add("t1", "t0", "s3")
+    a.and_("t1", "t1", "s2")
+    a.slli("t1", "t1", 2)
+    a.add("t1", "t1", "s1")
+    a.slli("t2", "t0", 2)
+    a.add("t2", "t2", "s1")
+    a.sw("t1", 0, "t2")
+    a.addi("t0", "t0", 1)
+    a.bge("s2", "t0", "build")
+
+    a.li("s0", n)
+    a.mv("a0", "s1")
+    a.label("loop")
+    for _ in range(8):
+        a.lw("a0", 0, "a0")
+    a.addi("s0", "s0", -1)
+    a.bnez("s0", "loop")
+    epilogue(a)
+    if mmu:
+        page_table(a)
+
+
+COPY_BYTES = 64 * 1024
+
+
+def kernel_memcpy(a, n, mmu=False):
+    """Copy 64 KiB over and over, a word at a time"""
+    a.label("main")
+    if mmu:
+        mmu_on(a)
+    a.li("s0", n)
+    a.li("s1", BUF)
+    a.li("s2", BUF + COPY_BYTES)
+    a.label("outer")
+    a.mv("t0", "s1")
+    a.mv("t1", "s2")
+    a.li("t2", BUF + COPY_BYTES)
+    a.label("loop")
+    for i in range(4):
+        a.lw(f"a{i}", 4 * i, "t0")
+    for i in range(4):
+        a.sw(f"a{i}", 4 * i, "t1")
+    a.addi("t0", "t0", 16)
+    a.addi("t1", "t1", 16)
+    a.bltu("t0", "t2", "loop")
+    a.addi("s0", "s0", -1)
+    a.bnez("s0", "outer")
+    epilogue(a)
+    if mmu:
+        page_table(a)
+
+
+AMO_HARTS = 4
+
+
+def kernel_amo(a, n):
+    """Every hart adds to the same word. Hart 0 starts the others, waits for
+    all of them to finish, and prints the instructions of each.
+    """
+    a.label("main")
+    a.li("s1", 1)
+    a.label("start")
+    a.li("a7", SBI_EID_HSM)
+    a.li("a6", 0)  # HART_START
+    a.mv("a0", "s1")
+    a.la("a1", "secondary")
+    a.li("a2", 0)
+    a.ecall()
+    a.addi("s1", "s1", 1)
+    a.li("t0", AMO_HARTS)
+    a.blt("s1", "t0", "start")
+    a.li("tp", 0)
+    a.j("work")
+
+    a.label("secondary")
+    a.mv("tp", "a0")
+
+    a.label("work")
+    a.li("s0", n)
+    a.li("s2", BUF)
+    a.li("t1", 1)
+    a.label("loop")
+    for _ in range(4):
+        a.amoadd_w("zero", "t1", "s2")
+    a.addi("s0", "s0", -1)
+    a.bnez("s0", "loop")
+
+    # store the count of this hart, then count it as done
+    read_instret(a, "s10", "s11")
+    a.li("t1", SLOTS)
+    a.slli("t2", "tp", 3)
+    a.add("t1", "t1", "t2")
+    a.sw("s10", 0, "t1")
+    a.sw("s11", 4, "t1")
+    a.li("t1", SLOTS + 8 * AMO_HARTS)
+    a.li("t2", 1)
+    a.amoadd_w("zero", "t2", "t1")
+    a.bnez("tp", "park")
+
+    a.label("wait")
+    a.lw("t2", 0, "t1")
+    a.li("t0", AMO_HARTS)
+    a.bne("t2", "t0", "wait")
+    a.li("s1", SLOTS)
+    a.li("s3", SLOTS + 8 * AMO_HARTS)
+    a.label("report")
+    a.lw("s10", 0, "s1")
+    a.lw("s11", 4, "s1")
+    print_count(a, "s10", "s11")
+    a.addi("s1", "s1", 8)
+    a.bltu("s1", "s3", "report")
+    shutdown(a)
+
+    a.label("park")
+    a.wfi()
+    a.j("park")
+    print_hex(a)
+
+
+def kernel_trap(a, n):
+    """Take a breakpoint trap and swap a CSR on every iteration"""
+    a.label("main")
+    a.li("s0", n)
+    a.label("loop")
+    a.ebreak()
+    a.csrrw("t1", "sscratch", "t1")
+    a.addi("s0", "s0", -1)
+    a.bnez("s0", "loop")
+    epilogue(a)
+
+
+def kernel_null(a, n):
+    """Measures the startup and shutdown of the emulator"""
+    a.label("main")
+    epilogue(a)
+
+
+# name: (generator, iterations, harts)
+KERNELS = {
+    "alu": (kernel_alu, 10_000_000, 1),
+    "branch": (kernel_branch, 6_000_000, 1),
+    "chase": (kernel_chase, 10_000_000, 1),
+    "chase-mmu": (lambda a, n: kernel_chase(a, n, mmu=True), 10_000_000, 1),
+    "memcpy": (kernel_memcpy, 8_000, 1),
+    "memcpy-mmu": (lambda a, n: kernel_memcpy(a, n, mmu=True), 8_000, 1),
+    "amo": (kernel_amo, 5_000_000, AMO_HARTS),
+    "trap": (kernel_trap, 5_000_000, 1),
+}
+
+
+def assemble(kernel, n):
+    a = Asm()
+    prologue(a)
+    kernel(a, n)
+    return a.resolve()
+
+
+def run(semu, dtb, image, harts):
+    """Return the wall-clock time of a run and the instructions retired"""
+    start = time.perf_counter()
+    proc = subprocess.run([semu, "-k", image, "-b", dtb, "-c", str(harts)],
+                          stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                          stderr=subprocess.DEVNULL, timeout=600)
+    elapsed = time.perf_counter() - start
+    counts = re.findall(rb"^([0-9a-f]{16})$", proc.stdout, re.MULTILINE)
+    if proc.returncode or not counts:
+        sys.exit(f"{image}: exit code {proc.returncode}, output "
+                 f"{proc.stdout[-200:]!r}")
+    return elapsed, sum(int(c, 16) for c in counts)
+
+
+def best_run(semu, dtb, kernel, n, harts, runs, tmpdir):
+    image = os.path.join(tmpdir, "kernel.bin")
+    with open(image, "wb") as f:
+        f.write(assemble(kernel, n))
+    return min(run(semu, dtb, image, harts) for _ in range(runs))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--runs", type=int, default=3,
+                        help="runs of each kernel, the fastest counts")
+    parser.add_argument("--only", help="comma-separated kernels to run")
+    parser.add_argument("semu")
+    parser.add_argument("dtb")
+    args = parser.parse_args()
+
+    names = args.only.split(",") if args.only else list(KERNELS)
+    for name in names:
+        if name not in KERNELS:
+            sys.exit(f"unknown kernel {name}, pick from {', '.join(KERNELS)}")
+
+    results = {}
+    with tempfile.TemporaryDirectory() as tmpdir:
+        overhead, _ = best_run(args.semu, args.dtb, kernel_null, 0, 1,
+                               args.runs, tmpdir)
+        for name in names:
+            kernel, n, harts = KERNELS[name]
+            elapsed, insns = best_run(args.semu, args.dtb, kernel, n, harts,
+                                      args.runs, tmpdir)
+            seconds = max(elapsed - overhead, 1e-6)
+            results[name] = {
+                "instructions": insns,
+                "seconds": round(seconds, 4),
+                "mips": round(insns / seconds / 1e6, 2),
+            }
+            print(f"{name}: {results[name]['mips']} MIPS", file=sys.stderr)
+
+    mips = [r["mips"] for r in results.values()]
+    print(json.dumps({
+        "kernels": results,
+        "geomean_mips": round(math.exp(sum(map(math.log, mips)) / len(mips)),
+                              2),
+        "startup_seconds": round(overhead, 4),
+    }, indent=2))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,11 +1,12 @@
 import sys
 
-def cpu_template (id):
+def cpu_template (id, cboz_block_size):
     return f"""cpu{id}: cpu@{id} {{
             device_type = "cpu";
             compatible = "riscv";
             reg = <{id}>;
-            riscv,isa = "rv32ima";
+            riscv,isa = "rv32imafdc_zicboz_zihintpause_zawrs_zba_zbb_zbs_sscofpmf_sstc";
+            riscv,cboz-block-size = <{cboz_block_size}>;
             mmu-type = "riscv,sv32";
             cpu{id}_intc: interrupt-controller {{
                 #interrupt-cells = <1>;
@@ -16,10 +17,10 @@ def cpu_template (id):
         }};
         """
 
-def cpu_format(nums):
+def cpu_format(nums, cboz_block_size):
     s = ""
     for i in range(nums):
-        s += cpu_template(i)
+        s += cpu_template(i, cboz_block_size)
     return s
 
 def plic_irq_format(nums):
@@ -96,6 +97,7 @@ def dtsi_template (cpu_list: str, plic_list, sswi_list, mtimer_list, mswi_list,
 dtsi = sys.argv[1]
 harts = int(sys.argv[2])
 clock_freq = int(sys.argv[3])
+cboz_block_size = int(sys.argv[4]) if len(sys.argv) > 4 else 64
 
 with open(dtsi, "w") as dts:
-    dts.write(dtsi_template(cpu_format(harts), plic_irq_format(harts), sswi_irq_format(harts), mswi_irq_format(harts), mtimer_irq_format(harts), clock_freq))
+    dts.write(dtsi_template(cpu_format(harts, cboz_block_size), plic_irq_format(harts), sswi_irq_format(harts), mswi_irq_format(harts), mtimer_irq_format(harts), clock_freq))
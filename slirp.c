@@ -1,5 +1,8 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "netdev.h"
 
@@ -35,7 +38,7 @@ static void net_slirp_init_completed(Slirp *slirp, void *opaque)
 static void slirp_timer_init(slirp_timer *t, void (*cb)(void *opaque))
 {
     t->cb = cb;
-    semu_timer_init(&t->timer, CLOCK_FREQ, 1);
+    semu_timer_init(&t->timer, CLOCK_FREQ);
 }
 
 static void net_slirp_timer_cb(void *opaque)
@@ -194,12 +197,126 @@ int net_slirp_init(net_user_options_t *usr)
     }
 
     usr->pfd = malloc(sizeof(struct pollfd));
+    usr->tx_ring = calloc(SLIRP_TX_RING_SIZE, sizeof(slirp_pkt_t));
+    if (!usr->pfd || !usr->tx_ring)
+        return -1;
 
-    /* Register the read end of the internal pipe (channel[SLIRP_READ_SIDE])
-     * with slirp's poll system. This allows slirp to monitor it for incoming
-     * data (POLL_IN) or hang-up event (POLL_HUP).
+    /* Register the read end of the wake-up pipe with slirp's poll system, so
+     * that the network thread notices packets that the guest sends.
      */
-    semu_slirp_add_poll_socket(usr->channel[SLIRP_READ_SIDE],
-                               SLIRP_POLL_IN | SLIRP_POLL_HUP, usr);
+    if (pipe(usr->wake) < 0)
+        return -1;
+    fcntl(usr->wake[SLIRP_READ_SIDE], F_SETFL, O_NONBLOCK);
+    fcntl(usr->wake[SLIRP_WRITE_SIDE], F_SETFL, O_NONBLOCK);
+    semu_slirp_add_poll_socket(usr->wake[SLIRP_READ_SIDE], SLIRP_POLL_IN,
+                               usr);
     return 0;
 }
+
+/* Hand the guest packets queued by net_slirp_send() over to slirp */
+static void net_slirp_drain_tx(net_user_options_t *usr)
+{
+    uint32_t head = __atomic_load_n(&usr->tx_head, __ATOMIC_ACQUIRE);
+    uint32_t tail = usr->tx_tail;
+    if (head == tail)
+        return;
+
+    while (tail != head) {
+        slirp_pkt_t *pkt = &usr->tx_ring[tail % SLIRP_TX_RING_SIZE];
+        slirp_input(usr->slirp, pkt->data, pkt->len);
+        tail++;
+    }
+    __atomic_store_n(&usr->tx_tail, tail, __ATOMIC_SEQ_CST);
+
+    /* Let the guest resume transmitting if the ring was full */
+    if (!__atomic_load_n(usr->tx_ready, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(usr->tx_ready, true, __ATOMIC_SEQ_CST);
+        char c = 0;
+        if (write(usr->notify_fd, &c, 1) < 0 && errno != EAGAIN)
+            fprintf(stderr, "failed to notify of network I/O: %s\n",
+                    strerror(errno));
+    }
+}
+
+/* All slirp calls happen on this thread. The packets for the guest are
+ * written to "channel" from the send_packet callback.
+ */
+static void *net_slirp_thread(void *opaque)
+{
+    net_user_options_t *usr = (net_user_options_t *) opaque;
+
+    while (true) {
+        uint32_t timeout = -1;
+        usr->pfd_len = 1;
+        slirp_pollfds_fill_socket(usr->slirp, &timeout,
+                                  semu_slirp_add_poll_socket, usr);
+
+        /* Clear the kick before draining, so that a packet queued from now on
+         * kicks again.
+         */
+        __atomic_store_n(&usr->kicked, false, __ATOMIC_SEQ_CST);
+        net_slirp_drain_tx(usr);
+
+        int pollout = poll(usr->pfd, usr->pfd_len, (int) timeout);
+        if (usr->pfd[0].revents & POLLIN) {
+            char buf[64];
+            while (read(usr->wake[SLIRP_READ_SIDE], buf, sizeof(buf)) > 0)
+                ;
+        }
+        slirp_pollfds_poll(usr->slirp, (pollout <= 0), semu_slirp_get_revents,
+                           usr);
+    }
+    return NULL;
+}
+
+bool net_slirp_start(net_user_options_t *usr, int notify_fd)
+{
+    usr->notify_fd = notify_fd;
+    if (pthread_create(&usr->thread, NULL, net_slirp_thread, usr)) {
+        fprintf(stderr, "Failed to create the network thread.\n");
+        return false;
+    }
+    return true;
+}
+
+/* Queue a guest packet for the network thread. Return false if the ring is
+ * full, in which case "tx_ready" is cleared until the thread makes room.
+ */
+bool net_slirp_send(net_user_options_t *usr,
+                    const struct iovec *iovs,
+                    size_t niovs)
+{
+    uint32_t head = usr->tx_head;
+    if (head - __atomic_load_n(&usr->tx_tail, __ATOMIC_SEQ_CST) ==
+        SLIRP_TX_RING_SIZE) {
+        __atomic_store_n(usr->tx_ready, false, __ATOMIC_SEQ_CST);
+        /* The thread may have made room before seeing "tx_ready" cleared */
+        if (head - __atomic_load_n(&usr->tx_tail, __ATOMIC_SEQ_CST) ==
+            SLIRP_TX_RING_SIZE)
+            return false;
+        __atomic_store_n(usr->tx_ready, true, __ATOMIC_SEQ_CST);
+    }
+
+    /* Aggregate data from the scatter-gather I/O vector into a contiguous
+     * packet buffer, truncating oversized frames
+     */
+    slirp_pkt_t *pkt = &usr->tx_ring[head % SLIRP_TX_RING_SIZE];
+    size_t len = 0;
+    for (size_t i = 0; i < niovs && len < SLIRP_PKT_SIZE; i++) {
+        size_t n = iovs[i].iov_len;
+        if (n > SLIRP_PKT_SIZE - len)
+            n = SLIRP_PKT_SIZE - len;
+        memcpy(pkt->data + len, iovs[i].iov_base, n);
+        len += n;
+    }
+    pkt->len = len;
+    __atomic_store_n(&usr->tx_head, head + 1, __ATOMIC_RELEASE);
+
+    if (!__atomic_exchange_n(&usr->kicked, true, __ATOMIC_SEQ_CST)) {
+        char c = 0;
+        if (write(usr->wake[SLIRP_WRITE_SIDE], &c, 1) < 0 && errno != EAGAIN)
+            fprintf(stderr, "failed to wake the network thread: %s\n",
+                    strerror(errno));
+    }
+    return true;
+}
@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "device.h"
+#include "riscv.h"
+#include "snapshot.h"
+#include "utils.h"
+
+/* File layout: the header, then guest RAM at "ram_offset", where pages of
+ * zeros are left as holes, then the remaining state at "state_offset".
+ */
+#define SNAPSHOT_MAGIC "semusnap"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN (64 * 1024) /**< for mmap(), above any host page size */
+
+/* The devices of the build, which must match between save and load */
+#define SNAPSHOT_DEVICES                                   \
+    (SEMU_HAS(VIRTIONET) << 0 | SEMU_HAS(VIRTIOBLK) << 1 | \
+     SEMU_HAS(VIRTIORNG) << 2 | SEMU_HAS(VIRTIOSND) << 3 | \
+     SEMU_HAS(VIRTIOGPU) << 4 | SEMU_HAS(VIRTIOINPUT) << 5)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t devices; /**< SNAPSHOT_DEVICES */
+    uint32_t n_hart;
+    uint32_t ram_size;
+    uint64_t ram_offset;
+    uint64_t state_offset;
+    uint64_t state_size;
+} snapshot_header_t;
+
+/* The state after RAM is read and written by the same code. "load" tells the
+ * direction, and "error" latches the first failure.
+ */
+typedef struct {
+    FILE *f;
+    bool load;
+    bool error;
+    uint64_t size;
+} snapshot_t;
+
+static struct {
+    const char *save;
+    stream_match_t marker;
+    bool marker_seen;
+    bool due;
+} snap;
+
+int snapshot_init(const snapshot_config_t *config)
+{
+    snap.save = config->save;
+    if (!snap.save)
+        return 0;
+    if (!stream_match_init(&snap.marker, config->marker
+                                             ? config->marker
+                                             : SNAPSHOT_DEFAULT_MARKER)) {
+        fprintf(stderr, "The snapshot marker must have 1 to %d characters.\n",
+                STREAM_MATCH_MAX);
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_console(uint8_t c)
+{
+    if (!snap.save || snap.marker_seen)
+        return;
+    if (stream_match(&snap.marker, c))
+        snap.marker_seen = snap.due = true;
+}
+
+bool snapshot_due(void)
+{
+    if (likely(!snap.due))
+        return false;
+    snap.due = false;
+    return true;
+}
+
+static void snapshot_io(snapshot_t *s, void *data, size_t size)
+{
+    if (s->error)
+        return;
+    size_t n = s->load ? fread(data, 1, size, s->f)
+                       : fwrite(data, 1, size, s->f);
+    if (n != size)
+        s->error = true;
+    s->size += size;
+}
+
+#define SNAPSHOT_FIELD(s, field) snapshot_io(s, &(field), sizeof(field))
+
+/* A timer is saved as its current value, and restarts from there */
+static void snapshot_timer(snapshot_t *s, semu_timer_t *timer)
+{
+    uint64_t time = s->load ? 0 : semu_timer_get(timer);
+    SNAPSHOT_FIELD(s, time);
+    if (s->load && !s->error)
+        semu_timer_rebase(timer, time);
+}
+
+/* The architectural state of a hart. The LR reservation and a WRS stall are
+ * dropped, which the guest has to cope with anyway.
+ */
+static void snapshot_hart(snapshot_t *s, hart_t *hart)
+{
+    SNAPSHOT_FIELD(s, hart->x_regs);
+    SNAPSHOT_FIELD(s, hart->f_regs);
+    SNAPSHOT_FIELD(s, hart->fflags);
+    SNAPSHOT_FIELD(s, hart->frm);
+    SNAPSHOT_FIELD(s, hart->pc);
+    SNAPSHOT_FIELD(s, hart->current_pc);
+    SNAPSHOT_FIELD(s, hart->instret);
+    snapshot_timer(s, &hart->time);
+    SNAPSHOT_FIELD(s, hart->s_mode);
+    SNAPSHOT_FIELD(s, hart->sstatus_spp);
+    SNAPSHOT_FIELD(s, hart->sstatus_spie);
+    SNAPSHOT_FIELD(s, hart->sepc);
+    SNAPSHOT_FIELD(s, hart->scause);
+    SNAPSHOT_FIELD(s, hart->stval);
+    SNAPSHOT_FIELD(s, hart->sstatus_mxr);
+    SNAPSHOT_FIELD(s, hart->sstatus_sum);
+    SNAPSHOT_FIELD(s, hart->sstatus_sie);
+    SNAPSHOT_FIELD(s, hart->sstatus_fs);
+    SNAPSHOT_FIELD(s, hart->sie);
+    SNAPSHOT_FIELD(s, hart->sip);
+    SNAPSHOT_FIELD(s, hart->wfi);
+    SNAPSHOT_FIELD(s, hart->stvec_addr);
+    SNAPSHOT_FIELD(s, hart->stvec_vectored);
+    SNAPSHOT_FIELD(s, hart->sscratch);
+    SNAPSHOT_FIELD(s, hart->scounteren);
+    SNAPSHOT_FIELD(s, hart->senvcfg);
+    SNAPSHOT_FIELD(s, hart->satp);
+    SNAPSHOT_FIELD(s, hart->hsm_status);
+    SNAPSHOT_FIELD(s, hart->hsm_resume_is_ret);
+    SNAPSHOT_FIELD(s, hart->hsm_resume_pc);
+    SNAPSHOT_FIELD(s, hart->hsm_resume_opaque);
+    SNAPSHOT_FIELD(s, hart->rfence_pending);
+    SNAPSHOT_FIELD(s, hart->events);
+    SNAPSHOT_FIELD(s, hart->pmu);
+    SNAPSHOT_FIELD(s, hart->pmu_overflow);
+    SNAPSHOT_FIELD(s, hart->pmu_next);
+    if (s->load)
+        vm_reload(hart);
+}
+
+/* The registers and queues of a virtio-mmio device */
+#define SNAPSHOT_VIRTIO(s, dev)                      \
+    do {                                             \
+        SNAPSHOT_FIELD(s, (dev)->DeviceFeaturesSel); \
+        SNAPSHOT_FIELD(s, (dev)->DriverFeatures);    \
+        SNAPSHOT_FIELD(s, (dev)->DriverFeaturesSel); \
+        SNAPSHOT_FIELD(s, (dev)->QueueSel);          \
+        SNAPSHOT_FIELD(s, (dev)->queues);            \
+        SNAPSHOT_FIELD(s, (dev)->Status);            \
+        SNAPSHOT_FIELD(s, (dev)->InterruptStatus);   \
+    } while (0)
+
+static void snapshot_devices(snapshot_t *s, emu_state_t *emu)
+{
+    uint32_t n_hart = emu->vm.n_hart;
+
+    SNAPSHOT_FIELD(s, emu->plic);
+
+    SNAPSHOT_FIELD(s, emu->uart.dll);
+    SNAPSHOT_FIELD(s, emu->uart.dlh);
+    SNAPSHOT_FIELD(s, emu->uart.lcr);
+    SNAPSHOT_FIELD(s, emu->uart.ier);
+    SNAPSHOT_FIELD(s, emu->uart.current_int);
+    SNAPSHOT_FIELD(s, emu->uart.pending_ints);
+    SNAPSHOT_FIELD(s, emu->uart.mcr);
+
+    snapshot_io(s, emu->mtimer.mtimecmp, n_hart * sizeof(uint64_t));
+    snapshot_timer(s, &emu->mtimer.mtime);
+    snapshot_io(s, emu->mswi.msip, n_hart * sizeof(uint32_t));
+    snapshot_io(s, emu->sswi.ssip, n_hart * sizeof(uint32_t));
+
+#if SEMU_HAS(VIRTIONET)
+    SNAPSHOT_VIRTIO(s, &emu->vnet);
+    /* The host side of the backend is new, so its readiness is that of a
+     * fresh one, see net_init_user(). Slirp takes packets at any time.
+     */
+    if (s->load) {
+        emu->vnet.queues[VNET_QUEUE_RX].fd_ready = false;
+        emu->vnet.queues[VNET_QUEUE_TX].fd_ready =
+            emu->vnet.peer.type == NETDEV_IMPL_user;
+    }
+#endif
+#if SEMU_HAS(VIRTIOBLK)
+    SNAPSHOT_VIRTIO(s, &emu->vblk);
+#endif
+#if SEMU_HAS(VIRTIORNG)
+    SNAPSHOT_VIRTIO(s, &emu->vrng);
+#endif
+#if SEMU_HAS(VIRTIOSND)
+    SNAPSHOT_VIRTIO(s, &emu->vsnd);
+#endif
+#if SEMU_HAS(VIRTIOGPU)
+    SNAPSHOT_VIRTIO(s, &emu->vgpu);
+#endif
+#if SEMU_HAS(VIRTIOINPUT)
+    SNAPSHOT_VIRTIO(s, &emu->vkeyboard);
+    SNAPSHOT_VIRTIO(s, &emu->vmouse);
+#endif
+}
+
+/* Everything but RAM. The emulator time depends on the boot progress, so that
+ * comes first.
+ */
+static void snapshot_state(snapshot_t *s, emu_state_t *emu)
+{
+    vm_t *vm = &emu->vm;
+
+    SNAPSHOT_FIELD(s, boot_complete);
+    snapshot_io(s, emu->boot_progress, vm->n_hart * sizeof(uint64_t));
+    if (s->load) {
+        for (uint32_t i = 0; i < vm->n_hart; i++)
+            semu_timer_boot_progress(emu->boot_progress[i]);
+    }
+
+    for (uint32_t i = 0; i < vm->n_hart; i++)
+        snapshot_hart(s, vm->hart[i]);
+    snapshot_devices(s, emu);
+}
+
+/* Write RAM in chunks, skipping those of zeros, so that the file is sparse */
+static int snapshot_save_ram(FILE *f, const emu_state_t *emu, uint64_t offset)
+{
+    static const uint8_t zero[SNAPSHOT_ALIGN];
+    const uint8_t *ram = (const uint8_t *) emu->ram;
+
+    for (uint32_t addr = 0; addr < RAM_SIZE; addr += SNAPSHOT_ALIGN) {
+        if (!memcmp(ram + addr, zero, SNAPSHOT_ALIGN))
+            continue;
+        if (fseeko(f, offset + addr, SEEK_SET) ||
+            fwrite(ram + addr, 1, SNAPSHOT_ALIGN, f) != SNAPSHOT_ALIGN)
+            return -1;
+    }
+    return 0;
+}
+
+int snapshot_save(emu_state_t *emu)
+{
+#if SEMU_HAS(VIRTIOSND)
+    if (emu->vsnd.Status) {
+        fprintf(stderr, "Cannot save a snapshot while virtio-snd is in use.\n");
+        return -1;
+    }
+#endif
+#if SEMU_HAS(VIRTIOGPU)
+    if (emu->vgpu.Status) {
+        fprintf(stderr, "Cannot save a snapshot while virtio-gpu is in use.\n");
+        return -1;
+    }
+#endif
+
+    FILE *f = fopen(snap.save, "wb");
+    if (!f) {
+        fprintf(stderr, "could not open %s: %s\n", snap.save, strerror(errno));
+        return -1;
+    }
+
+    snapshot_header_t header = {
+        .version = SNAPSHOT_VERSION,
+        .devices = SNAPSHOT_DEVICES,
+        .n_hart = emu->vm.n_hart,
+        .ram_size = RAM_SIZE,
+        .ram_offset = SNAPSHOT_ALIGN,
+        .state_offset = SNAPSHOT_ALIGN + (uint64_t) RAM_SIZE,
+    };
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    snapshot_t s = {.f = f};
+    if (!snapshot_save_ram(f, emu, header.ram_offset) &&
+        !fseeko(f, header.state_offset, SEEK_SET))
+        snapshot_state(&s, emu);
+    else
+        s.error = true;
+
+    header.state_size = s.size;
+    if (!s.error && (fseeko(f, 0, SEEK_SET) ||
+                     fwrite(&header, sizeof(header), 1, f) != 1))
+        s.error = true;
+    if (fclose(f))
+        s.error = true;
+
+    if (s.error) {
+        fprintf(stderr, "could not write snapshot %s\n", snap.save);
+        unlink(snap.save);
+        return -1;
+    }
+    fprintf(stderr, "\r\nsaved snapshot %s\r\n", snap.save);
+    return 0;
+}
+
+int snapshot_load(emu_state_t *emu, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    snapshot_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+        header.version != SNAPSHOT_VERSION ||
+        header.devices != SNAPSHOT_DEVICES || header.ram_size != RAM_SIZE) {
+        fprintf(stderr, "%s is not a snapshot of this emulator build\n", path);
+        fclose(f);
+        return -1;
+    }
+    if (header.n_hart != emu->vm.n_hart) {
+        fprintf(stderr, "%s holds %u harts, run with -c %u\n", path,
+                header.n_hart, header.n_hart);
+        fclose(f);
+        return -1;
+    }
+
+    /* Map RAM from the file rather than read it. Being private, the mapping
+     * leaves the file as it is.
+     */
+    void *ram = mmap(emu->ram, RAM_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, fileno(f), header.ram_offset);
+    if (ram == MAP_FAILED) {
+        fprintf(stderr, "could not map %s: %s\n", path, strerror(errno));
+        fclose(f);
+        return -1;
+    }
+
+    snapshot_t s = {.f = f, .load = true};
+    if (fseeko(f, header.state_offset, SEEK_SET))
+        s.error = true;
+    snapshot_state(&s, emu);
+    fclose(f);
+    if (s.error || s.size != header.state_size) {
+        fprintf(stderr, "%s is truncated or of another emulator build\n",
+                path);
+        return -1;
+    }
+    return 0;
+}
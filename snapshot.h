@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "device.h"
+
+/* Snapshots of the whole machine: guest RAM, the state of every hart and of
+ * the PLIC, ACLINT, UART and virtio devices, and the emulator time. A booted
+ * system is saved once the console prints a marker, and later runs restore it
+ * instead of booting. The RAM is mapped from the file copy-on-write, so the
+ * restore only reads the pages that the guest touches.
+ *
+ * A snapshot only loads into the same build of the emulator, with the same
+ * number of harts. Host-side state is not part of it: the TAP device and the
+ * disk image are opened anew, and the disk image must be the one that the
+ * saved system had mounted.
+ */
+
+#define SNAPSHOT_DEFAULT_MARKER "login:"
+
+typedef struct {
+    const char *save;   /**< file to save to, NULL if not saving */
+    const char *marker; /**< console output that triggers the save */
+    const char *load;   /**< file to restore from, NULL to boot */
+} snapshot_config_t;
+
+/* Return nonzero on error */
+int snapshot_init(const snapshot_config_t *config);
+
+/* Feed a byte of console output to the marker matcher */
+void snapshot_console(uint8_t c);
+
+/* Return true once after the marker appeared, when the harts are between two
+ * steps and the snapshot should be saved.
+ */
+bool snapshot_due(void);
+
+/* Save the machine to the configured file. Return nonzero on error. */
+int snapshot_save(emu_state_t *emu);
+
+/* Replace the state of the freshly set up machine with the snapshot in
+ * "path". Return nonzero on error.
+ */
+int snapshot_load(emu_state_t *emu, const char *path);
@@ -0,0 +1,142 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "riscv.h"
+#include "stats.h"
+
+static FILE *stats_file;
+static volatile sig_atomic_t stats_signaled;
+
+static void stats_on_signal(int sig UNUSED)
+{
+    stats_signaled = 1;
+}
+
+int stats_init(const char *path)
+{
+    stats_file = stderr;
+    if (path && !(stats_file = fopen(path, "a"))) {
+        fprintf(stderr, "could not open %s\n", path);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(SIGUSR1, &sa, NULL);
+}
+
+bool stats_requested(void)
+{
+    if (likely(!stats_signaled))
+        return false;
+    stats_signaled = 0;
+    return true;
+}
+
+static const char *const exception_names[16] = {
+    [0] = "pc_misalign",       [1] = "fetch_fault",
+    [2] = "illegal_insn",      [3] = "breakpoint",
+    [4] = "load_misalign",     [5] = "load_fault",
+    [6] = "store_misalign",    [7] = "store_fault",
+    [8] = "ecall_u",           [9] = "ecall_s",
+    [12] = "fetch_page_fault", [13] = "load_page_fault",
+    [15] = "store_page_fault",
+};
+
+static const char *const interrupt_names[16] = {
+    [1] = "software",
+    [5] = "timer",
+    [9] = "external",
+    [13] = "counter_overflow",
+};
+
+static const char *const sbi_names[STATS_N_SBI] = {
+    [STATS_SBI_BASE] = "base", [STATS_SBI_TIMER] = "timer",
+    [STATS_SBI_RST] = "rst",   [STATS_SBI_HSM] = "hsm",
+    [STATS_SBI_IPI] = "ipi",   [STATS_SBI_RFENCE] = "rfence",
+    [STATS_SBI_PMU] = "pmu",   [STATS_SBI_SEMU] = "semu",
+    [STATS_SBI_OTHER] = "other",
+};
+
+/* The 1 MiB regions of each device at 0xF0000000, see mmio_load() */
+static const struct {
+    uint8_t first, last;
+    const char *name;
+} mmio_regions[] = {
+    {0x00, 0x3F, "plic"},         {0x40, 0x40, "uart"},
+    {0x41, 0x41, "virtio-net"},   {0x42, 0x42, "virtio-blk"},
+    {0x43, 0x43, "mtimer"},       {0x44, 0x44, "mswi"},
+    {0x45, 0x45, "sswi"},         {0x46, 0x46, "virtio-rng"},
+    {0x47, 0x47, "virtio-snd"},   {0x48, 0x48, "virtio-gpu"},
+    {0x49, 0x49, "virtio-input"}, {0x50, 0x50, "virtio-input-mouse"},
+};
+
+/* Write the named counters of "counts" as a JSON object */
+static void stats_dump_named(FILE *f,
+                             const char *key,
+                             const uint64_t *counts,
+                             const char *const *names,
+                             uint32_t n)
+{
+    fprintf(f, ",\"%s\":{", key);
+    const char *sep = "";
+    for (uint32_t i = 0; i < n; i++) {
+        if (!names[i])
+            continue;
+        fprintf(f, "%s\"%s\":%llu", sep, names[i],
+                (unsigned long long) counts[i]);
+        sep = ",";
+    }
+    fputc('}', f);
+}
+
+static void stats_dump_mmio(FILE *f, const hart_stats_t *stats)
+{
+    fputs(",\"mmio\":{", f);
+    for (uint32_t i = 0; i < ARRAY_SIZE(mmio_regions); i++) {
+        uint64_t loads = 0, stores = 0;
+        for (uint32_t r = mmio_regions[i].first; r <= mmio_regions[i].last;
+             r++) {
+            loads += stats->mmio_loads[r];
+            stores += stats->mmio_stores[r];
+        }
+        fprintf(f, "%s\"%s\":{\"loads\":%llu,\"stores\":%llu}", i ? "," : "",
+                mmio_regions[i].name, (unsigned long long) loads,
+                (unsigned long long) stores);
+    }
+    fputc('}', f);
+}
+
+void stats_dump(const vm_t *vm)
+{
+    FILE *f = stats_file ? stats_file : stderr;
+    fputs("{\"harts\":[", f);
+    for (uint32_t i = 0; i < vm->n_hart; i++) {
+        const hart_t *hart = vm->hart[i];
+        const hart_stats_t *stats = &hart->stats;
+        fprintf(f, "%s{\"hartid\":%u,\"instret\":%llu", i ? "," : "",
+                hart->mhartid, (unsigned long long) hart->instret);
+        stats_dump_named(f, "exceptions", stats->exceptions, exception_names,
+                         ARRAY_SIZE(exception_names));
+        stats_dump_named(f, "interrupts", stats->interrupts, interrupt_names,
+                         ARRAY_SIZE(interrupt_names));
+        fprintf(f,
+                ",\"fetch_misses\":%llu,\"block_misses\":%llu"
+                ",\"page_walks\":%llu,\"sc_failures\":%llu",
+                (unsigned long long) stats->fetch_misses,
+                (unsigned long long) stats->block_misses,
+                (unsigned long long) stats->page_walks,
+                (unsigned long long) stats->sc_failures);
+        stats_dump_mmio(f, stats);
+        stats_dump_named(f, "sbi_calls", stats->sbi_calls, sbi_names,
+                         STATS_N_SBI);
+        fputc('}', f);
+    }
+    fputs("]}\n", f);
+    fflush(f);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "riscv.h"
+
+/* Counters of emulator events, such as traps, page walks and MMIO accesses,
+ * which tell the hot paths that a workload takes. They only exist in builds
+ * with ENABLE_STATS=1, and are otherwise compiled out along with STATS_INC().
+ * The counters are dumped as a line of JSON on SIGUSR1 and at exit.
+ */
+
+/* Slots of hart_stats_t.sbi_calls */
+enum {
+    STATS_SBI_BASE,
+    STATS_SBI_TIMER,
+    STATS_SBI_RST,
+    STATS_SBI_HSM,
+    STATS_SBI_IPI,
+    STATS_SBI_RFENCE,
+    STATS_SBI_PMU,
+    STATS_SBI_SEMU,
+    STATS_SBI_OTHER, /**< unsupported extensions */
+    STATS_N_SBI,
+};
+
+#if SEMU_HAS(STATS)
+_Static_assert(STATS_N_SBI <= ARRAY_SIZE(((hart_stats_t *) 0)->sbi_calls),
+               "hart_stats_t.sbi_calls has a slot for every extension");
+
+/* Dump the counters to "path", or to stderr if NULL, when SIGUSR1 arrives.
+ * Return nonzero on error.
+ */
+int stats_init(const char *path);
+
+/* Return true once after each SIGUSR1 */
+bool stats_requested(void);
+
+/* Append the counters of all harts to the dump file. Other host threads may
+ * update the counters meanwhile, so they can be slightly stale.
+ */
+void stats_dump(const vm_t *vm);
+#endif
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "riscv.h"
+#include "timeline.h"
+#include "utils.h"
+#include "virtio.h"
+
+typedef struct {
+    uint64_t ns;
+    int32_t hartid; /**< -1 if no hart in particular */
+    const char *event, *detail;
+    uint64_t *instret; /**< of each hart */
+} timeline_event_t;
+
+bool timeline_enabled;
+
+static struct {
+    const char *out;
+    const vm_t *vm;
+    uint64_t begin;
+    timeline_event_t events[TIMELINE_MAX_EVENTS];
+    uint32_t n_events;
+
+    bool boot_complete;
+    /* DRIVER_OK seen of each 1 MiB MMIO region */
+    bool driver_ok[256];
+
+    stream_match_t marker;
+    bool marker_seen;
+} tl;
+
+/* The virtio devices among the MMIO regions, see mmio_store() */
+static const char *const virtio_names[256] = {
+    [0x41] = "virtio-net", [0x42] = "virtio-blk",   [0x46] = "virtio-rng",
+    [0x47] = "virtio-snd", [0x48] = "virtio-gpu",   [0x49] = "virtio-input",
+    [0x50] = "virtio-input-mouse",
+};
+
+static uint64_t timeline_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int timeline_init(const timeline_config_t *config, const vm_t *vm)
+{
+    if (!config->out)
+        return 0;
+
+    tl.out = config->out;
+    tl.vm = vm;
+    tl.begin = timeline_now();
+    if (!stream_match_init(&tl.marker, config->marker
+                                           ? config->marker
+                                           : TIMELINE_DEFAULT_MARKER)) {
+        fprintf(stderr, "The timeline marker must have 1 to %d characters.\n",
+                STREAM_MATCH_MAX);
+        return -1;
+    }
+
+    uint64_t *instret =
+        calloc((size_t) TIMELINE_MAX_EVENTS * vm->n_hart, sizeof(uint64_t));
+    if (!instret)
+        return -1;
+    for (uint32_t i = 0; i < TIMELINE_MAX_EVENTS; i++)
+        tl.events[i].instret = &instret[i * vm->n_hart];
+
+    timeline_enabled = true;
+    return 0;
+}
+
+static void timeline_add(const hart_t *hart,
+                         const char *event,
+                         const char *detail)
+{
+    uint32_t idx = __atomic_fetch_add(&tl.n_events, 1, __ATOMIC_RELAXED);
+    if (idx >= TIMELINE_MAX_EVENTS)
+        return;
+
+    timeline_event_t *e = &tl.events[idx];
+    e->ns = timeline_now() - tl.begin;
+    e->hartid = hart ? (int32_t) hart->mhartid : -1;
+    e->event = event;
+    e->detail = detail;
+    /* Harts on other host threads keep running, so their counts may be off
+     * by the instructions of a block.
+     */
+    for (uint32_t i = 0; i < tl.vm->n_hart; i++)
+        e->instret[i] = tl.vm->hart[i]->instret;
+}
+
+void timeline_mark(const hart_t *hart, const char *event)
+{
+    if (timeline_enabled)
+        timeline_add(hart, event, NULL);
+}
+
+void timeline_boot_complete(const hart_t *hart)
+{
+    if (!__atomic_exchange_n(&tl.boot_complete, true, __ATOMIC_RELAXED))
+        timeline_add(hart, "user-mode", NULL);
+}
+
+void timeline_mmio_store(const hart_t *hart, uint32_t addr, uint32_t value)
+{
+    uint32_t region = (addr >> 20) & MASK(8);
+    if ((addr & MASK(20)) != VIRTIO_Status << 2 ||
+        !(value & VIRTIO_STATUS__DRIVER_OK) || !virtio_names[region])
+        return;
+    if (!__atomic_exchange_n(&tl.driver_ok[region], true, __ATOMIC_RELAXED))
+        timeline_add(hart, "driver-ok", virtio_names[region]);
+}
+
+void timeline_console(uint8_t c)
+{
+    if (!timeline_enabled || tl.marker_seen)
+        return;
+
+    if (stream_match(&tl.marker, c)) {
+        tl.marker_seen = true;
+        timeline_add(NULL, "console", tl.marker.str);
+    }
+}
+
+static int timeline_compare(const void *a, const void *b)
+{
+    const timeline_event_t *x = a, *y = b;
+    return (x->ns > y->ns) - (x->ns < y->ns);
+}
+
+void timeline_write(void)
+{
+    if (!timeline_enabled)
+        return;
+
+    FILE *f = stderr;
+    if (strcmp(tl.out, "-") && !(f = fopen(tl.out, "w"))) {
+        fprintf(stderr, "could not open %s\n", tl.out);
+        return;
+    }
+
+    uint32_t n = tl.n_events;
+    if (n > TIMELINE_MAX_EVENTS)
+        n = TIMELINE_MAX_EVENTS;
+    qsort(tl.events, n, sizeof(*tl.events), timeline_compare);
+
+    fprintf(f, "# %9s %9s %4s  %-30s instret of harts 0 to %u\n", "seconds",
+            "delta", "hart", "event", tl.vm->n_hart - 1);
+    uint64_t prev = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const timeline_event_t *e = &tl.events[i];
+        char hart[12] = "-", event[96];
+        if (e->hartid >= 0)
+            snprintf(hart, sizeof(hart), "%d", e->hartid);
+        if (e->detail)
+            snprintf(event, sizeof(event), "%s %s", e->event, e->detail);
+        else
+            snprintf(event, sizeof(event), "%s", e->event);
+        fprintf(f, "  %9.4f %9.4f %4s  %-30s", e->ns / 1e9,
+                (e->ns - prev) / 1e9, hart, event);
+        for (uint32_t h = 0; h < tl.vm->n_hart; h++)
+            fprintf(f, " %llu", (unsigned long long) e->instret[h]);
+        fputc('\n', f);
+        prev = e->ns;
+    }
+    if (tl.n_events > TIMELINE_MAX_EVENTS)
+        fprintf(f, "# %u events dropped\n",
+                tl.n_events - TIMELINE_MAX_EVENTS);
+
+    if (f != stderr)
+        fclose(f);
+    else
+        fflush(f);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "riscv.h"
+
+/* Boot timeline. At the events that divide a boot into phases, it records the
+ * wall-clock time and the instructions that every hart has retired:
+ * - the first instruction
+ * - each hart turning on the MMU, until the boot completes
+ * - each hart started through SBI HSM
+ * - the first switch to U-mode, which completes the boot
+ * - the first DRIVER_OK of each virtio device
+ * - the first time that the console prints the marker string
+ * The timeline is written as a table on exit.
+ */
+
+#define TIMELINE_MAX_EVENTS 256
+#define TIMELINE_DEFAULT_MARKER "login:"
+
+typedef struct {
+    const char *out;    /**< timeline file, "-" for stderr, NULL if off */
+    const char *marker; /**< console string, TIMELINE_DEFAULT_MARKER if NULL */
+} timeline_config_t;
+
+/* Set once the timeline is set up, so that callers on hot paths can skip the
+ * calls below.
+ */
+extern bool timeline_enabled;
+
+/* Return nonzero on error */
+int timeline_init(const timeline_config_t *config, const vm_t *vm);
+
+/* Record "event" of "hart", which is NULL if no hart in particular caused it.
+ * Safe to call from several host threads.
+ */
+void timeline_mark(const hart_t *hart, const char *event);
+
+/* Record the first switch to U-mode, which completes the boot. Several harts
+ * may see it happen.
+ */
+void timeline_boot_complete(const hart_t *hart);
+
+/* Record the first DRIVER_OK of a virtio device, given a store to MMIO */
+void timeline_mmio_store(const hart_t *hart, uint32_t addr, uint32_t value);
+
+/* Feed a byte of console output to the marker matcher */
+void timeline_console(uint8_t c);
+
+/* Write the timeline, if enabled */
+void timeline_write(void);
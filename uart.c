@@ -7,8 +7,11 @@
 #include <unistd.h>
 
 #include "device.h"
+#include "forkserver.h"
 #include "riscv.h"
 #include "riscv_private.h"
+#include "snapshot.h"
+#include "timeline.h"
 
 /*
  * The control mode flag for keyboard.
@@ -31,7 +34,7 @@
 
 #define U8250_INT_THRE 1
 
-static void reset_keyboard_input()
+void reset_keyboard_input()
 {
     /* Re-enable echo, etc. on keyboard. */
     struct termios term;
@@ -84,6 +87,9 @@ static void u8250_handle_out(u8250_state_t *uart, uint8_t value)
 {
     if (write(uart->out_fd, &value, 1) < 1)
         fprintf(stderr, "failed to write UART output: %s\n", strerror(errno));
+    timeline_console(value);
+    snapshot_console(value);
+    forkserver_console(value);
 }
 
 static uint8_t u8250_handle_in(u8250_state_t *uart)
@@ -93,15 +99,25 @@ static uint8_t u8250_handle_in(u8250_state_t *uart)
     if (!uart->in_ready)
         return value;
 
-    if (read(uart->in_fd, &value, 1) < 0)
+    ssize_t n = read(uart->in_fd, &value, 1);
+    if (n < 0)
         fprintf(stderr, "failed to read UART input: %s\n", strerror(errno));
+    else if (!n && uart->exit_on_eof)
+        exit(0);
     uart->in_ready = false;
     u8250_check_ready(uart);
 
     if (value == 1) {           /* start of heading (Ctrl-a) */
         if (getchar() == 120) { /* keyboard x */
             printf("\n");       /* end emulator with newline */
+#if SEMU_HAS(SMP_THREADS)
+            /* The other harts keep running on their threads, so stop them
+             * all before the exit handlers run, see mmio_load()
+             */
+            uart->quit = true;
+#else
             exit(0);
+#endif
         }
     }
 
@@ -213,6 +229,9 @@ void u8250_write(hart_t *vm,
     switch (width) {
     case RV_MEM_SB:
         u8250_reg_write(uart, addr, value);
+        /* Stop soon after printing the marker of the fork server */
+        if (unlikely(forkserver_pending()))
+            vm->yield = true;
         break;
     case RV_MEM_SW:
     case RV_MEM_SH:
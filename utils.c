@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <string.h>
 #include <time.h>
 
 #include "utils.h"
@@ -22,7 +23,8 @@
 
 bool boot_complete = false;
 static double ticks_increment;
-static double boot_ticks;
+static uint64_t boot_begin;
+static uint64_t boot_progress;
 
 /* Calculate "x * n / d" without unnecessary overflow or loss of precision.
  *
@@ -83,39 +85,52 @@ static uint64_t semu_timer_clocksource(semu_timer_t *timer)
      *
      * After switching to real time, the correct way to update time is to
      * calculate the increment of time. Then add it to the emulator time.
+     *
+     * Harts may run on several host threads, so the first thread to see the
+     * switch decides the offset.
      */
-    static int64_t offset = 0;
-    static bool first_switch = true;
+    static int64_t offset = INT64_MIN;
 
-    if (!boot_complete) {
-        boot_ticks += ticks_increment;
-        return (uint64_t) boot_ticks;
-    }
+    uint64_t progress = __atomic_load_n(&boot_progress, __ATOMIC_RELAXED);
+    uint64_t boot_ticks = boot_begin + (uint64_t) (progress * ticks_increment);
+    if (!__atomic_load_n(&boot_complete, __ATOMIC_RELAXED))
+        return boot_ticks;
 
     uint64_t real_ticks = mult_frac(host_time_ns(), timer->freq, 1e9);
-    if (first_switch) {
-        first_switch = false;
-
+    int64_t off = __atomic_load_n(&offset, __ATOMIC_RELAXED);
+    if (off == INT64_MIN) {
         /* Calculate the offset between the real time and the emulator time */
-        offset = (int64_t) (real_ticks - boot_ticks);
+        int64_t unset = INT64_MIN;
+        off = (int64_t) (real_ticks - boot_ticks);
+        if (!__atomic_compare_exchange_n(&offset, &unset, off, false,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            off = unset;
     }
-    return (uint64_t) ((int64_t) real_ticks - offset);
+    return (uint64_t) ((int64_t) real_ticks - off);
 }
 
-void semu_timer_init(semu_timer_t *timer, uint64_t freq, int n_harts)
+void semu_timer_init(semu_timer_t *timer, uint64_t freq)
 {
     timer->freq = freq;
     timer->begin = mult_frac(host_time_ns(), timer->freq, 1e9);
-    boot_ticks = timer->begin; /* Initialize the fake ticks for boot process */
+    boot_begin = timer->begin; /* Initialize the fake ticks for boot process */
 
-    /* According to statistics, the number of times 'semu_timer_clocksource'
-     * called is approximately 'SMP count * 2.15 * 1e8'. By the time the boot
-     * process is completed, the emulator will have a total of 'boot seconds *
-     * frequency' ticks. Therefore, each time, '(boot seconds * frequency) /
-     * (2.15 * 1e8 * SMP count)' ticks need to be added.
+    /* According to statistics, the boot hart retires approximately '2.15 *
+     * 1e8' instructions during the boot process. By the time the boot process
+     * is completed, the emulator will have a total of 'boot seconds *
+     * frequency' ticks. Therefore, '(boot seconds * frequency) / (2.15 *
+     * 1e8)' ticks need to be added for each instruction of progress.
      */
-    ticks_increment =
-        (SEMU_BOOT_TARGET_TIME * CLOCK_FREQ) / (2.15 * 1e8 * n_harts);
+    ticks_increment = (SEMU_BOOT_TARGET_TIME * CLOCK_FREQ) / (2.15 * 1e8);
+}
+
+void semu_timer_boot_progress(uint64_t progress)
+{
+    uint64_t seen = __atomic_load_n(&boot_progress, __ATOMIC_RELAXED);
+    while (progress > seen &&
+           !__atomic_compare_exchange_n(&boot_progress, &seen, progress, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
 uint64_t semu_timer_get(semu_timer_t *timer)
@@ -127,3 +142,18 @@ void semu_timer_rebase(semu_timer_t *timer, uint64_t time)
 {
     timer->begin = semu_timer_clocksource(timer) - time;
 }
+
+bool stream_match_init(stream_match_t *m, const char *str)
+{
+    memset(m, 0, sizeof(*m));
+    m->str = str;
+    m->len = strlen(str);
+    return m->len && m->len <= STREAM_MATCH_MAX;
+}
+
+bool stream_match(stream_match_t *m, uint8_t c)
+{
+    memmove(m->tail, m->tail + 1, m->len - 1);
+    m->tail[m->len - 1] = c;
+    return !memcmp(m->tail, m->str, m->len);
+}
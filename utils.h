@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -19,10 +20,30 @@ typedef struct {
     uint64_t freq;
 } semu_timer_t;
 
-void semu_timer_init(semu_timer_t *timer, uint64_t freq, int n_harts);
+void semu_timer_init(semu_timer_t *timer, uint64_t freq);
 uint64_t semu_timer_get(semu_timer_t *timer);
 void semu_timer_rebase(semu_timer_t *timer, uint64_t time);
 
+/* Report that a hart has made "progress" instructions of headway into the
+ * boot. The fake timer follows the hart that is furthest ahead.
+ */
+void semu_timer_boot_progress(uint64_t progress);
+
+/* Watch a stream of bytes, such as the console output, for a string */
+#define STREAM_MATCH_MAX 64
+
+typedef struct {
+    const char *str;
+    size_t len;
+    char tail[STREAM_MATCH_MAX]; /**< last "len" bytes of the stream */
+} stream_match_t;
+
+/* Return false if "str" is empty or longer than STREAM_MATCH_MAX */
+bool stream_match_init(stream_match_t *m, const char *str);
+
+/* Feed the next byte, and return true if the stream now ends with the string */
+bool stream_match(stream_match_t *m, uint8_t c);
+
 /* Linux-like queue API */
 
 #if defined(__GNUC__) || defined(__clang__) ||         \
@@ -65,6 +65,7 @@ PACKED(struct vblk_req_header {
 });
 
 static struct virtio_blk_config vblk_configs[VBLK_DEV_CNT_MAX];
+static const char *vblk_disk_files[VBLK_DEV_CNT_MAX];
 static int vblk_dev_cnt = 0;
 
 static void virtio_blk_set_fail(virtio_blk_state_t *vblk)
@@ -452,6 +453,8 @@ uint32_t *virtio_blk_init(virtio_blk_state_t *vblk, char *disk_file)
         return NULL;
     }
 
+    vblk_disk_files[vblk_dev_cnt - 1] = disk_file;
+
     /* Open disk file */
     int disk_fd = open(disk_file, O_RDWR);
     if (disk_fd < 0) {
@@ -479,3 +482,31 @@ uint32_t *virtio_blk_init(virtio_blk_state_t *vblk, char *disk_file)
 
     return disk_mem;
 }
+
+/* Map the disk image copy-on-write in place of the shared mapping, so that
+ * the writes of the guest from now on stay in this process. A clone of the
+ * fork server writes to its own overlay this way, see forkserver.h.
+ */
+bool virtio_blk_overlay(virtio_blk_state_t *vblk)
+{
+    if (!vblk->disk)
+        return true;
+
+    const char *disk_file = vblk_disk_files[PRIV(vblk) - vblk_configs];
+    int disk_fd = open(disk_file, O_RDONLY);
+    if (disk_fd < 0) {
+        fprintf(stderr, "could not open %s\n", disk_file);
+        return false;
+    }
+
+    /* The mapping covers the same pages as the one it replaces */
+    size_t disk_size = (size_t) PRIV(vblk)->capacity * DISK_BLK_SIZE;
+    void *disk_mem = mmap(vblk->disk, disk_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, disk_fd, 0);
+    close(disk_fd);
+    if (disk_mem == MAP_FAILED) {
+        fprintf(stderr, "Could not map disk overlay\n");
+        return false;
+    }
+    return true;
+}
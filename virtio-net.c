@@ -3,7 +3,6 @@
 #include <fcntl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
-#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,8 +27,6 @@
 
 #define PRIV(x) ((struct virtio_net_config *) x->priv)
 
-enum { VNET_QUEUE_RX = 0, VNET_QUEUE_TX = 1 };
-
 PACKED(struct virtio_net_config {
     uint8_t mac[6];
     uint16_t status;
@@ -61,13 +58,17 @@ static void virtio_net_update_status(virtio_net_state_t *vnet, uint32_t status)
     if (status)
         return;
 
-    /* Reset */
+    /* Reset, keeping what is known of the host side of the backend */
     netdev_t peer = vnet->peer;
     uint32_t *ram = vnet->ram;
     void *priv = vnet->priv;
+    bool rx_ready = vnet->queues[VNET_QUEUE_RX].fd_ready;
+    bool tx_ready = vnet->queues[VNET_QUEUE_TX].fd_ready;
     memset(vnet, 0, sizeof(*vnet));
     vnet->peer = peer, vnet->ram = ram;
     vnet->priv = priv;
+    vnet->queues[VNET_QUEUE_RX].fd_ready = rx_ready;
+    vnet->queues[VNET_QUEUE_TX].fd_ready = tx_ready;
 }
 
 static bool vnet_iovec_write(struct iovec **vecs,
@@ -183,17 +184,11 @@ static ssize_t handle_write(netdev_t *netdev,
     case _(user):
         net_user_options_t *usr = (net_user_options_t *) netdev->op;
 
-        uint8_t pkt[1514];
-
-        /* Aggregate data from scatter-gater I/O vector into a
-         * contiguous packet buffer
-         */
-        for (size_t i = 0; i < niovs; i++) {
-            memcpy(pkt + plen, iovs_cursor[i].iov_base, iovs_cursor[i].iov_len);
+        /* The network thread hands the packet over to slirp */
+        if (!net_slirp_send(usr, iovs_cursor, niovs))
+            return -1;
+        for (size_t i = 0; i < niovs; i++)
             plen += iovs_cursor[i].iov_len;
-        }
-
-        slirp_input(usr->slirp, pkt, plen);
 
         break;
     default:
@@ -309,22 +304,12 @@ void virtio_net_refresh_queue(virtio_net_state_t *vnet)
     netdev_impl_t dev_type = vnet->peer.type;
 #define _(dev) NETDEV_IMPL_##dev
     switch (dev_type) {
-    case _(tap): {
-        net_tap_options_t *tap = (net_tap_options_t *) vnet->peer.op;
-        struct pollfd pfd = {tap->tap_fd, POLLIN | POLLOUT, 0};
-        poll(&pfd, 1, 0);
-        if (pfd.revents & POLLIN) {
-            vnet->queues[VNET_QUEUE_RX].fd_ready = true;
-            virtio_net_try_rx(vnet);
-        }
-        if (pfd.revents & POLLOUT) {
-            vnet->queues[VNET_QUEUE_TX].fd_ready = true;
-            virtio_net_try_tx(vnet);
-        }
-        break;
-    }
+    case _(tap):
     case _(user):
-        vnet->queues[VNET_QUEUE_TX].fd_ready = true;
+        /* The emulator watches the host side of the backend and sets
+         * "fd_ready"
+         */
+        virtio_net_try_rx(vnet);
         virtio_net_try_tx(vnet);
         break;
     default:
@@ -333,14 +318,6 @@ void virtio_net_refresh_queue(virtio_net_state_t *vnet)
 #undef _
 }
 
-void virtio_net_recv_from_peer(void *peer)
-{
-    virtio_net_state_t *vnet = (virtio_net_state_t *) peer;
-    vnet->queues[VNET_QUEUE_RX].fd_ready = true;
-
-    virtio_net_try_rx(vnet);
-}
-
 static bool virtio_net_reg_read(virtio_net_state_t *vnet,
                                 uint32_t addr,
                                 uint32_t *value)